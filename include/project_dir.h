@@ -19,6 +19,6 @@
 #endif
 #endif
 
-#define res_path "/root/tc_rdma_proc/data"
+#define res_path "/root/repo/data"
 
 #endif
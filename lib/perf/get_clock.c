@@ -38,9 +38,14 @@
 /* #define DEBUG_DATA 1 */
 /* #define GET_CPU_MHZ_FROM_PROC 1 */
 
-/* For gettimeofday */
+/* For gettimeofday, the affinity calls for the skew check */
 #define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 #include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
 
 #include <unistd.h>
 #include <stdio.h>
@@ -210,8 +215,268 @@ static double proc_get_cpu_mhz(int no_cpu_freq_warn)
 }
 #endif
 
+/*
+ * perf_clock: pairs of (cycles, CLOCK_MONOTONIC_RAW) CALIB_STEP_NS apart,
+ * the cycles of each pair are the middle of fenced reads around the
+ * clock_gettime, the best of CALIB_TRIES, then a least squares fit.
+ */
+#define CALIB_SAMPLES 64
+#define CALIB_STEP_NS 250000
+#define CALIB_TRIES 4
+#define CALIB_MIN_R2 0.9999
+/* refine waits until the baseline is at least this long */
+#define REFINE_MIN_NS 1000000000ull
+
+struct perf_clock perf_clock;
+
+int perf_clock_invariant(void)
+{
+#if defined (__x86_64__) || defined(__i386__)
+	unsigned eax, ebx, ecx, edx;
+
+	/* CPUID.80000007H:EDX[8], invariant TSC */
+	asm volatile ("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (0x80000000));
+	if (eax < 0x80000007)
+		return 0;
+	asm volatile ("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (0x80000007));
+	return (edx >> 8) & 1;
+#elif defined(__aarch64__)
+	/* the generic timer runs at a fixed frequency */
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+static void clock_pair(cycles_t *cycles, uint64_t *ns)
+{
+	cycles_t c1, c2, best = (cycles_t)-1;
+	uint64_t n;
+	int i;
+
+	for (i = 0; i < CALIB_TRIES; i++) {
+		c1 = get_cycles_start();
+		n = raw_clock_ns();
+		c2 = get_cycles_end();
+		if (c2 - c1 < best) {
+			best = c2 - c1;
+			*cycles = c1 + (c2 - c1) / 2;
+			*ns = n;
+		}
+	}
+}
+
+int perf_clock_calibrate(void)
+{
+	cycles_t c[CALIB_SAMPLES];
+	uint64_t n[CALIB_SAMPLES];
+	double sx = 0, sy = 0, sxx = 0, syy = 0, sxy = 0;
+	double tx, ty, b, r_2;
+	int i;
+
+	if (perf_clock.calibrated)
+		return 0;
+	perf_clock.invariant = perf_clock_invariant();
+	if (!perf_clock.invariant)
+		return -1;
+
+	for (i = 0; i < CALIB_SAMPLES; ++i) {
+		if (i) {
+			while (raw_clock_ns() < n[0] + (uint64_t)i * CALIB_STEP_NS)
+				;
+		}
+		clock_pair(&c[i], &n[i]);
+	}
+
+	/* Regression: cycles = a + b ns, relative to the first pair */
+	for (i = 0; i < CALIB_SAMPLES; ++i) {
+		tx = (double)(n[i] - n[0]);
+		ty = (double)(c[i] - c[0]);
+		sx += tx;
+		sy += ty;
+		sxx += tx * tx;
+		syy += ty * ty;
+		sxy += tx * ty;
+	}
+	b = (CALIB_SAMPLES * sxy - sx * sy) / (CALIB_SAMPLES * sxx - sx * sx);
+	r_2 = (CALIB_SAMPLES * sxy - sx * sy) * (CALIB_SAMPLES * sxy - sx * sy) /
+		(CALIB_SAMPLES * sxx - sx * sx) /
+		(CALIB_SAMPLES * syy - sy * sy);
+	if (b <= 0 || r_2 < CALIB_MIN_R2) {
+		fprintf(stderr, "Cycle counter calibration r^2 %g, staying on clock_gettime\n", r_2);
+		return -1;
+	}
+
+	perf_clock.cycles_per_ns = b;
+	perf_clock.calib_cycles = c[0];
+	perf_clock.calib_ns = n[0];
+	perf_clock.base_cycles = c[CALIB_SAMPLES - 1];
+	perf_clock.base_ns = n[CALIB_SAMPLES - 1];
+	perf_clock.mult = (uint64_t)(4294967296.0 / b);
+	__atomic_store_n(&perf_clock.calibrated, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void perf_clock_refine(void)
+{
+	cycles_t cycles;
+	uint64_t ns, now, mult;
+	double b;
+
+	if (!__atomic_load_n(&perf_clock.calibrated, __ATOMIC_ACQUIRE))
+		return;
+	clock_pair(&cycles, &ns);
+	if (ns - perf_clock.calib_ns < REFINE_MIN_NS || cycles <= perf_clock.calib_cycles)
+		return;
+
+	b = (double)(cycles - perf_clock.calib_cycles) / (double)(ns - perf_clock.calib_ns);
+	mult = (uint64_t)(4294967296.0 / b);
+	/* continue from where the old rate has got to */
+	now = perf_clock.base_ns + perf_clock_scale(cycles - perf_clock.base_cycles, perf_clock.mult);
+
+	__atomic_store_n(&perf_clock.seq, perf_clock.seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&perf_clock.base_cycles, cycles, __ATOMIC_RELAXED);
+	__atomic_store_n(&perf_clock.base_ns, now, __ATOMIC_RELAXED);
+	__atomic_store_n(&perf_clock.mult, mult, __ATOMIC_RELAXED);
+	__atomic_store_n(&perf_clock.seq, perf_clock.seq + 1, __ATOMIC_RELEASE);
+	perf_clock.cycles_per_ns = b;
+}
+
+/*
+ * Skew: the reference stamps t0 and bumps ping, the remote stamps t1
+ * and answers on pong, the reference stamps t2. With the shortest round
+ * trip the remote read happened close to the middle of [t0, t2].
+ */
+#define SKEW_ROUNDS 2000
+#define SKEW_CACHE_LINE 64
+
+int64_t perf_clock_cpu_offset[PERF_CLOCK_MAX_CPUS];
+int64_t perf_clock_max_skew_ns;
+int perf_clock_skew_ok = 1;
+
+struct skew_line {
+	uint64_t seq;
+	uint64_t tsc;
+	char pad[SKEW_CACHE_LINE - 2 * sizeof(uint64_t)];
+};
+
+struct skew_pair {
+	struct skew_line ping;
+	struct skew_line pong;
+	int cpu;
+	int pinned;
+};
+
+static int pin_to_cpu(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void *skew_remote(void *arg)
+{
+	struct skew_pair *p = arg;
+	uint64_t r;
+
+	__atomic_store_n(&p->pinned, pin_to_cpu(p->cpu) ? -1 : 1, __ATOMIC_RELEASE);
+	if (p->pinned < 0)
+		return NULL;
+	for (r = 1; r <= SKEW_ROUNDS; r++) {
+		while (__atomic_load_n(&p->ping.seq, __ATOMIC_ACQUIRE) != r)
+			;
+		p->pong.tsc = get_cycles_start();
+		__atomic_store_n(&p->pong.seq, r, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/* offset of cpu against the calling thread's cpu, in cycles */
+static int measure_offset(int cpu, int64_t *offset)
+{
+	struct skew_pair *p;
+	pthread_t thread;
+	cycles_t t0, t2, best = (cycles_t)-1;
+	uint64_t r;
+
+	if (posix_memalign((void **)&p, SKEW_CACHE_LINE, sizeof(*p)))
+		return -1;
+	memset(p, 0, sizeof(*p));
+	p->cpu = cpu;
+	if (pthread_create(&thread, NULL, skew_remote, p)) {
+		free(p);
+		return -1;
+	}
+	while (!__atomic_load_n(&p->pinned, __ATOMIC_ACQUIRE))
+		;
+	if (p->pinned > 0) {
+		for (r = 1; r <= SKEW_ROUNDS; r++) {
+			t0 = get_cycles_start();
+			__atomic_store_n(&p->ping.seq, r, __ATOMIC_RELEASE);
+			while (__atomic_load_n(&p->pong.seq, __ATOMIC_ACQUIRE) != r)
+				;
+			t2 = get_cycles_end();
+			if (t2 - t0 < best) {
+				best = t2 - t0;
+				*offset = (int64_t)(p->pong.tsc - (t0 + (t2 - t0) / 2));
+			}
+		}
+	}
+	pthread_join(thread, NULL);
+	r = p->pinned > 0;
+	free(p);
+	return r ? 0 : -1;
+}
+
+int perf_clock_check_skew(int64_t threshold_ns)
+{
+	cpu_set_t mask;
+	int cpu, ref = -1, ret = 0;
+	int64_t offset, skew_ns;
+
+	if (perf_clock_calibrate())
+		return -1;
+	if (sched_getaffinity(0, sizeof(mask), &mask))
+		return -1;
+	for (cpu = 0; cpu < CPU_SETSIZE && ref < 0; cpu++) {
+		if (CPU_ISSET(cpu, &mask))
+			ref = cpu;
+	}
+	if (ref < 0 || pin_to_cpu(ref))
+		return -1;
+
+	perf_clock_max_skew_ns = 0;
+	memset(perf_clock_cpu_offset, 0, sizeof(perf_clock_cpu_offset));
+	for (cpu = ref + 1; cpu < CPU_SETSIZE && cpu < PERF_CLOCK_MAX_CPUS; cpu++) {
+		if (!CPU_ISSET(cpu, &mask))
+			continue;
+		if (measure_offset(cpu, &offset)) {
+			ret = -1;
+			break;
+		}
+		perf_clock_cpu_offset[cpu] = offset;
+		skew_ns = (int64_t)((offset < 0 ? -offset : offset) / perf_clock.cycles_per_ns);
+		if (skew_ns > perf_clock_max_skew_ns)
+			perf_clock_max_skew_ns = skew_ns;
+	}
+	/* give the caller its old mask back */
+	pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+
+	if (ret)
+		return ret;
+	perf_clock_skew_ok = perf_clock_max_skew_ns <= threshold_ns;
+	return perf_clock_skew_ok ? 0 : 1;
+}
+
 double get_cpu_mhz(int no_cpu_freq_warn)
 {
+	/* cycles per usec straight from the calibrated counter */
+	if (!perf_clock_calibrate())
+		return perf_clock.cycles_per_ns * 1000;
+
 	#if defined(__s390x__) || defined(__s390__)
 	return sample_get_cpu_mhz();
 	#else
@@ -119,6 +119,192 @@ static inline cycles_t get_cycles()
 #include <asm/timex.h>
 #endif
 
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Fenced reads of the cycle counter for timing a region: nothing before
+ * get_cycles_start can drift past it and nothing after get_cycles_end
+ * can start before it. Elsewhere they are plain get_cycles.
+ */
+#if defined (__x86_64__) || defined(__i386__)
+static inline cycles_t get_cycles_start(void)
+{
+	unsigned low, high;
+	asm volatile ("lfence\n\trdtsc" : "=a" (low), "=d" (high) : : "memory");
+	return ((cycles_t)high << 32) | low;
+}
+
+/* rdtscp waits for the earlier instructions, cpu gets IA32_TSC_AUX */
+static inline cycles_t get_cycles_end_cpu(unsigned *cpu)
+{
+	unsigned low, high, aux;
+	asm volatile ("rdtscp\n\tlfence" : "=a" (low), "=d" (high), "=c" (aux) : : "memory");
+	if (cpu)
+		*cpu = aux;
+	return ((cycles_t)high << 32) | low;
+}
+#else
+static inline cycles_t get_cycles_start(void)
+{
+	return get_cycles();
+}
+
+/* no counter read carries the cpu here, getcpu is asked right after it
+ * and a migration in between goes unseen */
+static inline cycles_t get_cycles_end_cpu(unsigned *cpu)
+{
+	cycles_t cycles = get_cycles();
+
+	if (cpu && syscall(SYS_getcpu, cpu, NULL, NULL))
+		*cpu = 0;
+	return cycles;
+}
+#endif
+
+static inline cycles_t get_cycles_end(void)
+{
+	return get_cycles_end_cpu(NULL);
+}
+
+/*
+ * Cycle counter calibrated against CLOCK_MONOTONIC_RAW.
+ *
+ * perf_clock_calibrate fits cycles against raw nanoseconds over a short
+ * window, from then on now_ns is a counter read and a multiply instead
+ * of a clock_gettime. It only takes the counter when its rate does not
+ * follow the core frequency (invariant TSC, the arm generic timer),
+ * otherwise now_ns stays on clock_gettime.
+ *
+ * perf_clock_refine, called from one thread every second or so, re-fits
+ * the rate over everything since calibration and re-anchors, so now_ns
+ * never jumps.
+ */
+#define PERF_CLOCK_SHIFT 32
+
+struct perf_clock {
+	int			invariant;
+	int			calibrated;
+	double			cycles_per_ns;
+	/* seqlock over the anchor, odd while refine writes it */
+	unsigned		seq;
+	cycles_t		base_cycles;
+	uint64_t		base_ns;
+	uint64_t		mult;		/* ns = cycles * mult >> PERF_CLOCK_SHIFT */
+	/* where calibration started, the long baseline of refine */
+	cycles_t		calib_cycles;
+	uint64_t		calib_ns;
+};
+
+extern struct perf_clock perf_clock;
+
+int perf_clock_invariant(void);
+/* 0 once the counter is usable, safe to call again */
+int perf_clock_calibrate(void);
+void perf_clock_refine(void);
+
+static inline uint64_t raw_clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline uint64_t perf_clock_scale(uint64_t delta, uint64_t mult)
+{
+#ifdef __SIZEOF_INT128__
+	return (uint64_t)(((unsigned __int128)delta * mult) >> PERF_CLOCK_SHIFT);
+#else
+	return (uint64_t)((double)delta * mult / 4294967296.0);
+#endif
+}
+
+/* cycles to ns with the calibrated rate, 0 before calibration */
+static inline uint64_t cycles_to_ns(cycles_t cycles)
+{
+	return perf_clock_scale(cycles, __atomic_load_n(&perf_clock.mult, __ATOMIC_RELAXED));
+}
+
+/* monotonic nanoseconds, the same timeline as CLOCK_MONOTONIC_RAW */
+static inline uint64_t now_ns(void)
+{
+	unsigned seq;
+	cycles_t base_cycles, cycles;
+	uint64_t base_ns, mult;
+
+	if (!__atomic_load_n(&perf_clock.calibrated, __ATOMIC_ACQUIRE))
+		return raw_clock_ns();
+	do {
+		seq = __atomic_load_n(&perf_clock.seq, __ATOMIC_ACQUIRE);
+		base_cycles = __atomic_load_n(&perf_clock.base_cycles, __ATOMIC_RELAXED);
+		base_ns = __atomic_load_n(&perf_clock.base_ns, __ATOMIC_RELAXED);
+		mult = __atomic_load_n(&perf_clock.mult, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&perf_clock.seq, __ATOMIC_RELAXED));
+
+	cycles = get_cycles();
+	/* another core may be a few cycles behind the anchor */
+	if (cycles < base_cycles)
+		return base_ns;
+	return base_ns + perf_clock_scale(cycles - base_cycles, mult);
+}
+
+/*
+ * Cross-core counter skew. perf_clock_check_skew pins a thread to every
+ * cpu we may run on in turn and ping-pongs a cache line with the first
+ * one, the round trip with the smallest delay gives the offset of that
+ * cpu's counter against the first cpu's, to within half of it.
+ *
+ * The offsets go into perf_clock_cpu_offset, get_cycles_corrected takes
+ * them off a counter read on any cpu, now_ns stays uncorrected to keep
+ * its single counter read. A timestamp taken on one thread and compared
+ * on another uncorrected is only trusted when perf_clock_skew_ok: the
+ * largest offset is within the threshold, or it was never measured.
+ */
+#define PERF_CLOCK_MAX_CPUS 1024
+/* rdtscp's IA32_TSC_AUX, linux keeps the cpu number in the low bits */
+#define PERF_CLOCK_AUX_CPU_MASK 0xfff
+
+/* cycles of each cpu's counter ahead of the reference cpu */
+extern int64_t perf_clock_cpu_offset[PERF_CLOCK_MAX_CPUS];
+extern int64_t perf_clock_max_skew_ns;
+extern int perf_clock_skew_ok;
+
+/*
+ * 0 if every cpu of the affinity mask is within threshold_ns, 1 if one
+ * is not, -1 if the skew could not be measured (no calibrated clock).
+ */
+int perf_clock_check_skew(int64_t threshold_ns);
+
+static inline cycles_t get_cycles_corrected(void)
+{
+	unsigned cpu;
+	cycles_t cycles = get_cycles_end_cpu(&cpu);
+
+	cpu &= PERF_CLOCK_AUX_CPU_MASK;
+	if (cpu < PERF_CLOCK_MAX_CPUS)
+		cycles -= perf_clock_cpu_offset[cpu];
+	return cycles;
+}
+
+/* the offset of cpu in ns, 0 for a cpu never measured */
+static inline int64_t perf_clock_cpu_offset_ns(unsigned cpu)
+{
+	if (cpu >= PERF_CLOCK_MAX_CPUS || perf_clock.cycles_per_ns <= 0)
+		return 0;
+	return (int64_t)(perf_clock_cpu_offset[cpu] / perf_clock.cycles_per_ns);
+}
+
 extern double get_cpu_mhz(int);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
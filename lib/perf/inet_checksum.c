@@ -0,0 +1,160 @@
+#include <string.h>
+
+#include "inet_checksum.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define INET_CSUM_X86 1
+#endif
+
+typedef uint64_t (*csum_fn)(const void *buf, size_t len, uint64_t sum);
+
+/******************************************************************************
+ * scalar, also the tail of the vector loops
+ ******************************************************************************/
+static uint64_t csum_scalar(const void *buf, size_t len, uint64_t sum)
+{
+	const uint8_t *p = buf;
+	uint32_t w32;
+	uint16_t w16;
+
+	/* 32-bit words into a 64-bit sum, the carries are folded at the end */
+	while (len >= 16) {
+		uint32_t w[4];
+		memcpy(w, p, 16);
+		sum += (uint64_t)w[0] + w[1] + w[2] + w[3];
+		p += 16;
+		len -= 16;
+	}
+	while (len >= 4) {
+		memcpy(&w32, p, 4);
+		sum += w32;
+		p += 4;
+		len -= 4;
+	}
+	if (len >= 2) {
+		memcpy(&w16, p, 2);
+		sum += w16;
+		p += 2;
+		len -= 2;
+	}
+	if (len) {
+		/* the odd byte is padded with a zero byte after it */
+		uint8_t last[2] = { *p, 0 };
+		memcpy(&w16, last, 2);
+		sum += w16;
+	}
+	return sum;
+}
+
+#if INET_CSUM_X86
+/******************************************************************************
+ * sse2, 32-bit words zero extended into 64-bit lanes so nothing overflows
+ ******************************************************************************/
+static uint64_t csum_sse2(const void *buf, size_t len, uint64_t sum)
+{
+	const uint8_t *p = buf;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc0 = zero, acc1 = zero;
+	uint64_t lanes[2];
+
+	while (len >= 32) {
+		__m128i a = _mm_loadu_si128((const __m128i *)p);
+		__m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+		acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(a, zero));
+		acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(a, zero));
+		acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(b, zero));
+		acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(b, zero));
+		p += 32;
+		len -= 32;
+	}
+	_mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(acc0, acc1));
+	sum += lanes[0];
+	sum += lanes[1];
+	return csum_scalar(p, len, sum);
+}
+
+/******************************************************************************
+ * avx2, the same on 256-bit registers
+ ******************************************************************************/
+__attribute__((target("avx2")))
+static uint64_t csum_avx2(const void *buf, size_t len, uint64_t sum)
+{
+	const uint8_t *p = buf;
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc0 = zero, acc1 = zero;
+	uint64_t lanes[4];
+
+	while (len >= 64) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)p);
+		__m256i b = _mm256_loadu_si256((const __m256i *)(p + 32));
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(b, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(b, zero));
+		p += 64;
+		len -= 64;
+	}
+	_mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(acc0, acc1));
+	sum += lanes[0];
+	sum += lanes[1];
+	sum += lanes[2];
+	sum += lanes[3];
+	/* the sse2 loop takes the last 32 bytes block */
+	return csum_sse2(p, len, sum);
+}
+#endif
+
+/******************************************************************************
+ * dispatch
+ ******************************************************************************/
+static csum_fn csum_impl_fn = csum_scalar;
+static const char *csum_impl_name = "scalar";
+
+__attribute__((constructor))
+static void pick_csum_impl(void)
+{
+#if INET_CSUM_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		csum_impl_fn = csum_avx2;
+		csum_impl_name = "avx2";
+	} else {
+		/* part of x86-64 */
+		csum_impl_fn = csum_sse2;
+		csum_impl_name = "sse2";
+	}
+#endif
+}
+
+uint64_t inet_csum_partial(const void *buf, size_t len, uint64_t sum)
+{
+	/* headers are too short for the vector setup to pay off */
+	if (len < INET_CSUM_VECTOR_MIN)
+		return csum_scalar(buf, len, sum);
+	return csum_impl_fn(buf, len, sum);
+}
+
+const char *inet_csum_impl(void)
+{
+	return csum_impl_name;
+}
+
+int inet_csum_select(const char *name)
+{
+	if (!strcmp(name, "scalar")) {
+		csum_impl_fn = csum_scalar;
+		csum_impl_name = "scalar";
+#if INET_CSUM_X86
+	} else if (!strcmp(name, "sse2")) {
+		csum_impl_fn = csum_sse2;
+		csum_impl_name = "sse2";
+	} else if (!strcmp(name, "avx2") && __builtin_cpu_supports("avx2")) {
+		csum_impl_fn = csum_avx2;
+		csum_impl_name = "avx2";
+#endif
+	} else {
+		return 1;
+	}
+	return 0;
+}
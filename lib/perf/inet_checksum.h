@@ -0,0 +1,90 @@
+#ifndef INET_CHECKSUM_H
+#define INET_CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The ones-complement Internet checksum of RFC 1071. The sum does not
+ * care about byte order, so everything here works on 16-bit words as
+ * they sit in the packet and the result is stored back as is. Buffers
+ * are summed 32 bits at a time into 64-bit lanes, with AVX2 or SSE2
+ * when the cpu has it, picked at load time. */
+
+/* shorter buffers always take the scalar loop, whatever is selected */
+#define INET_CSUM_VECTOR_MIN	64
+
+/* Unfolded sum of buf added to sum, 0 to start. Only the last piece of
+ * a buffer summed in several calls may have an odd length. */
+uint64_t inet_csum_partial(const void *buf, size_t len, uint64_t sum);
+
+/* folds a partial sum to 16 bits and complements it */
+static inline uint16_t inet_csum_fold(uint64_t sum)
+{
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t)~sum;
+}
+
+/* checksum field value for buf, whose own checksum field must be 0 */
+static inline uint16_t inet_checksum(const void *buf, size_t len)
+{
+	return inet_csum_fold(inet_csum_partial(buf, len, 0));
+}
+
+/* the same for a 20 byte IPv4 header without options, inline since
+ * every generated packet carries one and a call costs more than the sum.
+ * 16-bit loads, the header was just written field by field and wider
+ * loads over the narrow stores would stall store forwarding */
+static inline uint16_t inet_csum_ipv4(const void *hdr)
+{
+	uint16_t w[10];
+	uint32_t sum = 0;
+	int i;
+
+	memcpy(w, hdr, sizeof(w));
+	for (i = 0; i < 10; i++)
+		sum += w[i];
+	return inet_csum_fold(sum);
+}
+
+/* RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m'), the checksum after a 16-bit
+ * field changes from old to new, without touching the rest */
+static inline uint16_t inet_csum_replace2(uint16_t check, uint16_t old, uint16_t new_val)
+{
+	uint32_t sum = (uint16_t)~check + (uint16_t)~old + (uint32_t)new_val;
+
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t)~sum;
+}
+
+/* the same for a 32-bit field such as an IPv4 address */
+static inline uint16_t inet_csum_replace4(uint16_t check, uint32_t old, uint32_t new_val)
+{
+	uint32_t sum = (uint16_t)~check;
+
+	sum += (uint16_t)~old + (uint16_t)~(old >> 16);
+	sum += (new_val & 0xffff) + (new_val >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t)~sum;
+}
+
+/* "avx2", "sse2" or "scalar" */
+const char *inet_csum_impl(void);
+/* forces one of the above for every thread, for comparing them,
+ * 1 when the cpu can't run it */
+int inet_csum_select(const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INET_CHECKSUM_H */
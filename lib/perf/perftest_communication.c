@@ -14,6 +14,11 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <poll.h>
 #include "perftest_communication.h"
 #ifdef HAVE_SRD
 #include <infiniband/efadv.h>
@@ -283,145 +288,140 @@ static int create_ah_from_wc_recv(struct pingpong_context *ctx,
 
 
 /******************************************************************************
- *
+ * blocking socket io of exactly size bytes, a stream socket may return less
  ******************************************************************************/
-static int ethernet_write_keys(struct pingpong_dest *my_dest,
-		struct perftest_comm *comm)
+static int sock_write_full(int sockfd, const void *buf, size_t size)
 {
-	if (my_dest->gid_index == -1) {
+	const char *p = buf;
+	ssize_t n;
 
-		char msg[KEY_MSG_SIZE];
-
-		sprintf(msg,KEY_PRINT_FMT,my_dest->lid,my_dest->out_reads,
-				my_dest->qpn,my_dest->psn, my_dest->rkey, my_dest->vaddr, my_dest->srqn);
-
-		if (write(comm->rdma_params->sockfd,msg,sizeof msg) != sizeof msg) {
-			perror("client write");
-			fprintf(stderr, "Couldn't send local address\n");
+	while (size) {
+		n = send(sockfd, p, size, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
 			return 1;
 		}
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
 
-	} else {
-		char msg[KEY_MSG_SIZE_GID];
-		sprintf(msg,KEY_PRINT_FMT_GID, my_dest->lid,my_dest->out_reads,
-				my_dest->qpn,my_dest->psn, my_dest->rkey, my_dest->vaddr,
-				my_dest->gid.raw[0],my_dest->gid.raw[1],
-				my_dest->gid.raw[2],my_dest->gid.raw[3],
-				my_dest->gid.raw[4],my_dest->gid.raw[5],
-				my_dest->gid.raw[6],my_dest->gid.raw[7],
-				my_dest->gid.raw[8],my_dest->gid.raw[9],
-				my_dest->gid.raw[10],my_dest->gid.raw[11],
-				my_dest->gid.raw[12],my_dest->gid.raw[13],
-				my_dest->gid.raw[14],my_dest->gid.raw[15],
-				my_dest->srqn);
-
-		if (write(comm->rdma_params->sockfd, msg, sizeof msg) != sizeof msg) {
-			perror("client write");
-			fprintf(stderr, "Couldn't send local address\n");
-			return 1;
-		}
+static int sock_read_full(int sockfd, void *buf, size_t size)
+{
+	char *p = buf;
+	ssize_t n;
 
+	while (size) {
+		n = recv(sockfd, p, size, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 1;
+		p += n;
+		size -= n;
 	}
-
 	return 0;
 }
 
 /******************************************************************************
- *
+ * binary key messages: an oob_msg_header and count oob_dest_wire entries
  ******************************************************************************/
-static int ethernet_read_keys(struct pingpong_dest *rem_dest,
-		struct perftest_comm *comm)
+static size_t oob_msg_size(int count)
 {
-	if (rem_dest->gid_index == -1) {
-
-		int parsed;
-		char msg[KEY_MSG_SIZE];
-
-		if (read(comm->rdma_params->sockfd, msg, sizeof msg) != sizeof msg) {
-			fprintf(stderr, "ethernet_read_keys: Couldn't read remote address\n");
-			return 1;
-		}
-
-		parsed = sscanf(msg,KEY_PRINT_FMT,(unsigned int*)&rem_dest->lid,
-				&rem_dest->out_reads,&rem_dest->qpn,
-				&rem_dest->psn, &rem_dest->rkey,&rem_dest->vaddr,&rem_dest->srqn);
-
-		if (parsed != 7) {
-			fprintf(stderr, "Couldn't parse line <%.*s>\n",(int)sizeof msg, msg);
-			return 1;
-		}
-
-	} else {
-
-		char msg[KEY_MSG_SIZE_GID];
-		char *pstr = msg, *term;
-		char tmp[120];
-		int i;
-
-		if (read(comm->rdma_params->sockfd, msg, sizeof msg) != sizeof msg) {
-			fprintf(stderr, "ethernet_read_keys: Couldn't read remote address\n");
-			return 1;
-		}
-
-		term = strpbrk(pstr, ":");
-		memcpy(tmp, pstr, term - pstr);
-		tmp[term - pstr] = 0;
-		rem_dest->lid = (int)strtol(tmp, NULL, 16); /*LID*/
-
-		pstr += term - pstr + 1;
-		term = strpbrk(pstr, ":");
-		memcpy(tmp, pstr, term - pstr);
-		tmp[term - pstr] = 0;
-		rem_dest->out_reads = (int)strtol(tmp, NULL, 16); /*OUT_READS*/
-
-		pstr += term - pstr + 1;
-		term = strpbrk(pstr, ":");
-		memcpy(tmp, pstr, term - pstr);
-		tmp[term - pstr] = 0;
-		rem_dest->qpn = (int)strtol(tmp, NULL, 16); /*QPN*/
-
-		pstr += term - pstr + 1;
-		term = strpbrk(pstr, ":");
-		memcpy(tmp, pstr, term - pstr);
-		tmp[term - pstr] = 0;
-		rem_dest->psn = (int)strtol(tmp, NULL, 16); /*PSN*/
-
-		pstr += term - pstr + 1;
-		term = strpbrk(pstr, ":");
-		memcpy(tmp, pstr, term - pstr);
-		tmp[term - pstr] = 0;
-		rem_dest->rkey = (unsigned)strtoul(tmp, NULL, 16); /*RKEY*/
+	return sizeof(struct oob_msg_header) + count * sizeof(struct oob_dest_wire);
+}
 
-		pstr += term - pstr + 1;
-		term = strpbrk(pstr, ":");
-		memcpy(tmp, pstr, term - pstr);
-		tmp[term - pstr] = 0;
+static void oob_encode(void *msg, const struct pingpong_dest *dest, int count)
+{
+	struct oob_msg_header *hdr = msg;
+	struct oob_dest_wire *wire = (struct oob_dest_wire*)(hdr + 1);
+	int i;
 
-		rem_dest->vaddr = strtoull(tmp, NULL, 16); /*VA*/
+	hdr->magic = htonl(OOB_MSG_MAGIC);
+	hdr->version = htons(OOB_MSG_VERSION);
+	hdr->reserved = 0;
+	hdr->count = htonl(count);
+	for (i = 0; i < count; i++) {
+		wire[i].lid = htonl(dest[i].lid);
+		wire[i].out_reads = htonl(dest[i].out_reads);
+		wire[i].qpn = htonl(dest[i].qpn);
+		wire[i].psn = htonl(dest[i].psn);
+		wire[i].rkey = htonl(dest[i].rkey);
+		wire[i].srqn = htonl(dest[i].srqn);
+		wire[i].vaddr = hton_64(dest[i].vaddr);
+		memcpy(wire[i].gid, dest[i].gid.raw, sizeof(wire[i].gid));
+	}
+}
 
-		for (i = 0; i < 15; ++i) {
-			pstr += term - pstr + 1;
-			term = strpbrk(pstr, ":");
-			memcpy(tmp, pstr, term - pstr);
-			tmp[term - pstr] = 0;
+/* checks the header of a received message against the count expected */
+static int oob_check_header(const void *msg, int count)
+{
+	const struct oob_msg_header *hdr = msg;
 
-			rem_dest->gid.raw[i] = (unsigned char)strtoll(tmp, NULL, 16);
-		}
+	if (ntohl(hdr->magic) != OOB_MSG_MAGIC || ntohs(hdr->version) != OOB_MSG_VERSION) {
+		fprintf(stderr, "Remote side doesn't speak the binary key exchange\n");
+		return 1;
+	}
+	if (ntohl(hdr->count) != count) {
+		fprintf(stderr, "Expected %d remote keys, got %u\n", count, ntohl(hdr->count));
+		return 1;
+	}
+	return 0;
+}
 
-		pstr += term - pstr + 1;
+/* gid_index is local, the one of the matching my_dest */
+static void oob_decode(const void *msg, struct pingpong_dest *dest, int count)
+{
+	const struct oob_dest_wire *wire =
+		(const struct oob_dest_wire*)((const struct oob_msg_header*)msg + 1);
+	int i;
 
-		strcpy(tmp, pstr);
-		rem_dest->gid.raw[15] = (unsigned char)strtoll(tmp, NULL, 16);
+	for (i = 0; i < count; i++) {
+		dest[i].lid = ntohl(wire[i].lid);
+		dest[i].out_reads = ntohl(wire[i].out_reads);
+		dest[i].qpn = ntohl(wire[i].qpn);
+		dest[i].psn = ntohl(wire[i].psn);
+		dest[i].rkey = ntohl(wire[i].rkey);
+		dest[i].srqn = ntohl(wire[i].srqn);
+		dest[i].vaddr = ntoh_64(wire[i].vaddr);
+		memcpy(dest[i].gid.raw, wire[i].gid, sizeof(wire[i].gid));
+	}
+}
 
+/******************************************************************************
+ *
+ ******************************************************************************/
+static int ethernet_write_keys(struct pingpong_dest *my_dest,
+		struct perftest_comm *comm)
+{
+	char msg[sizeof(struct oob_msg_header) + sizeof(struct oob_dest_wire)];
 
-		pstr += term - pstr + 4;
+	oob_encode(msg, my_dest, 1);
+	if (sock_write_full(comm->rdma_params->sockfd, msg, sizeof msg)) {
+		perror("client write");
+		fprintf(stderr, "Couldn't send local address\n");
+		return 1;
+	}
+	return 0;
+}
 
-		term = strpbrk(pstr, ":");
-		memcpy(tmp, pstr, term - pstr);
-		tmp[term - pstr] = 0;
-		rem_dest->srqn = (unsigned)strtoul(tmp, NULL, 16); /*SRQN*/
+/******************************************************************************
+ *
+ ******************************************************************************/
+static int ethernet_read_keys(struct pingpong_dest *rem_dest,
+		struct perftest_comm *comm)
+{
+	char msg[sizeof(struct oob_msg_header) + sizeof(struct oob_dest_wire)];
 
+	if (sock_read_full(comm->rdma_params->sockfd, msg, sizeof msg)) {
+		fprintf(stderr, "ethernet_read_keys: Couldn't read remote address\n");
+		return 1;
 	}
+	if (oob_check_header(msg, 1))
+		return 1;
+	oob_decode(msg, rem_dest, 1);
 	return 0;
 }
 
@@ -649,6 +649,17 @@ static int get_best_gid_index (struct pingpong_context *ctx,
 	return gid_index;
 }
 
+/******************************************************************************
+ * the key exchange is a few small messages each way, don't let Nagle hold
+ * them back for the peer's delayed ack
+ ******************************************************************************/
+static void oob_set_nodelay(int sockfd)
+{
+	int one = 1;
+
+	setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
 /******************************************************************************
  *
  ******************************************************************************/
@@ -699,20 +710,21 @@ static int ethernet_client_connect(struct perftest_comm *comm)
 		return 1;
 	}
 
+	oob_set_nodelay(sockfd);
 	comm->rdma_params->sockfd = sockfd;
 	return 0;
 }
 
 /******************************************************************************
- *
+ * bound and listening socket on the comm port, -1 on failure
  ******************************************************************************/
-static int ethernet_server_connect(struct perftest_comm *comm)
+static int ethernet_server_listen(struct perftest_comm *comm, int backlog)
 {
 	struct addrinfo *res, *t;
 	struct addrinfo hints;
 	char *service;
 	int n;
-	int sockfd = -1, connfd;
+	int sockfd = -1;
 	char *src_ip = comm->rdma_params->has_source_ip ? comm->rdma_params->source_ip : NULL;
 
 	memset(&hints, 0, sizeof hints);
@@ -723,7 +735,7 @@ static int ethernet_server_connect(struct perftest_comm *comm)
 	if (check_add_port(&service,comm->rdma_params->port,src_ip,&hints,&res))
 	{
 		fprintf(stderr, "Problem in resolving basic address and port\n");
-		return 1;
+		return -1;
 	}
 
 	for (t = res; t; t = t->ai_next) {
@@ -742,10 +754,24 @@ static int ethernet_server_connect(struct perftest_comm *comm)
 
 	if (sockfd < 0) {
 		fprintf(stderr, "Couldn't listen to port %d\n", comm->rdma_params->port);
-		return 1;
+		return -1;
 	}
 
-	listen(sockfd, 1);
+	listen(sockfd, backlog);
+	return sockfd;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+static int ethernet_server_connect(struct perftest_comm *comm)
+{
+	int sockfd, connfd;
+
+	sockfd = ethernet_server_listen(comm, 1);
+	if (sockfd < 0)
+		return 1;
+
 	connfd = accept(sockfd, NULL, 0);
 
 	if (connfd < 0) {
@@ -755,10 +781,63 @@ static int ethernet_server_connect(struct perftest_comm *comm)
 		return 1;
 	}
 	close(sockfd);
+	oob_set_nodelay(connfd);
 	comm->rdma_params->sockfd = connfd;
 	return 0;
 }
 
+/******************************************************************************
+ *
+ ******************************************************************************/
+static uint64_t oob_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int ethernet_server_accept_peers(struct perftest_comm *comm, int num_peers, int *fds,
+				 int timeout_ms)
+{
+	uint64_t deadline = timeout_ms >= 0 ? oob_now_ms() + timeout_ms : 0;
+	struct pollfd pfd;
+	int sockfd, i, n;
+
+	sockfd = ethernet_server_listen(comm, num_peers);
+	if (sockfd < 0)
+		return 1;
+
+	pfd.fd = sockfd;
+	pfd.events = POLLIN;
+	for (i = 0; i < num_peers; i++) {
+		do {
+			int wait_ms = -1;
+
+			if (timeout_ms >= 0) {
+				uint64_t now = oob_now_ms();
+				wait_ms = now < deadline ? deadline - now : 0;
+			}
+			n = poll(&pfd, 1, wait_ms);
+		} while (n < 0 && errno == EINTR);
+		fds[i] = n > 0 ? accept(sockfd, NULL, 0) : -1;
+		if (fds[i] < 0) {
+			if (n == 0)
+				fprintf(stderr, "No client within %d ms\n", timeout_ms);
+			else
+				perror("server accept");
+			fprintf(stderr, "accept() failed after %d of %d peers\n", i, num_peers);
+			while (i--)
+				close(fds[i]);
+			close(sockfd);
+			return 1;
+		}
+		oob_set_nodelay(fds[i]);
+	}
+	close(sockfd);
+	return 0;
+}
+
 /******************************************************************************
  *
  ******************************************************************************/
@@ -1371,6 +1450,197 @@ int ctx_hand_shake(struct perftest_comm *comm,
 	return 0;
 }
 
+/******************************************************************************
+ * progress of one oob_peer in oob_xchg_peers
+ ******************************************************************************/
+struct oob_state {
+	char	*out;
+	size_t	out_len;
+	size_t	out_done;
+	char	*in;
+	size_t	in_len;
+	size_t	in_done;
+	int	flags;		/* fcntl flags to restore, -1 before saving */
+	int	writing;	/* EPOLLOUT still armed */
+};
+
+/* moves what the socket takes or has, 1 on error, *done once both ways
+ * are complete */
+static int oob_progress(struct oob_peer *peer, struct oob_state *st,
+			uint32_t events, int *done)
+{
+	ssize_t n;
+
+	while (st->out_done < st->out_len) {
+		n = send(peer->fd, st->out + st->out_done, st->out_len - st->out_done,
+			 MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			perror("oob send");
+			return 1;
+		}
+		st->out_done += n;
+	}
+
+	while ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && st->in_done < st->in_len) {
+		n = recv(peer->fd, st->in + st->in_done, st->in_len - st->in_done, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			perror("oob recv");
+			return 1;
+		}
+		if (n == 0) {
+			fprintf(stderr, "Remote side closed the key exchange\n");
+			return 1;
+		}
+		/* a wrong count is reported before waiting for keys that never come */
+		if (st->in_done < sizeof(struct oob_msg_header) &&
+		    st->in_done + n >= sizeof(struct oob_msg_header) &&
+		    oob_check_header(st->in, peer->num))
+			return 1;
+		st->in_done += n;
+	}
+
+	*done = st->out_done == st->out_len && st->in_done == st->in_len;
+	return 0;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+int oob_xchg_peers(struct oob_peer *peers, int num_peers, int timeout_ms)
+{
+	struct epoll_event ev, events[OOB_MAX_EVENTS];
+	struct oob_state *st;
+	uint64_t deadline = timeout_ms >= 0 ? oob_now_ms() + timeout_ms : 0;
+	int epfd, remaining = num_peers;
+	int ret = 1;
+	int i, n, done;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		perror("epoll_create1");
+		return 1;
+	}
+	ALLOCATE(st, struct oob_state, num_peers);
+	memset(st, 0, sizeof(struct oob_state) * num_peers);
+	for (i = 0; i < num_peers; i++)
+		st[i].flags = -1;
+
+	for (i = 0; i < num_peers; i++) {
+		st[i].out_len = oob_msg_size(peers[i].num);
+		st[i].in_len = oob_msg_size(peers[i].num);
+		ALLOCATE(st[i].out, char, st[i].out_len);
+		ALLOCATE(st[i].in, char, st[i].in_len);
+		oob_encode(st[i].out, peers[i].my_dest, peers[i].num);
+
+		/* every peer sends and receives at once, nobody waits on a turn */
+		st[i].flags = fcntl(peers[i].fd, F_GETFL);
+		if (st[i].flags < 0 || fcntl(peers[i].fd, F_SETFL, st[i].flags | O_NONBLOCK)) {
+			perror("fcntl");
+			goto out;
+		}
+		ev.events = EPOLLIN | EPOLLOUT;
+		ev.data.u32 = i;
+		st[i].writing = 1;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, peers[i].fd, &ev)) {
+			perror("epoll_ctl");
+			goto out;
+		}
+	}
+
+	while (remaining) {
+		int wait_ms = -1;
+
+		if (timeout_ms >= 0) {
+			uint64_t now = oob_now_ms();
+			if (now >= deadline) {
+				fprintf(stderr, "Key exchange timed out, %d of %d peers left\n",
+					remaining, num_peers);
+				goto out;
+			}
+			wait_ms = deadline - now;
+		}
+		n = epoll_wait(epfd, events, OOB_MAX_EVENTS, wait_ms);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			goto out;
+		}
+		for (i = 0; i < n; i++) {
+			int p = events[i].data.u32;
+
+			if (oob_progress(&peers[p], &st[p], events[i].events, &done)) {
+				fprintf(stderr, "Key exchange with peer %d failed\n", p);
+				goto out;
+			}
+			if (done) {
+				oob_decode(st[p].in, peers[p].rem_dest, peers[p].num);
+				epoll_ctl(epfd, EPOLL_CTL_DEL, peers[p].fd, NULL);
+				remaining--;
+			} else if (st[p].writing && st[p].out_done == st[p].out_len) {
+				/* sent, only wake up for what comes in */
+				ev.events = EPOLLIN;
+				ev.data.u32 = p;
+				epoll_ctl(epfd, EPOLL_CTL_MOD, peers[p].fd, &ev);
+				st[p].writing = 0;
+			}
+		}
+	}
+
+	for (i = 0; i < num_peers; i++) {
+		int j;
+		for (j = 0; j < peers[i].num; j++)
+			peers[i].rem_dest[j].gid_index = peers[i].my_dest[j].gid_index;
+	}
+	ret = 0;
+
+out:
+	for (i = 0; i < num_peers; i++) {
+		if (st[i].flags >= 0)
+			fcntl(peers[i].fd, F_SETFL, st[i].flags);
+		free(st[i].out);
+		free(st[i].in);
+	}
+	free(st);
+	close(epfd);
+	return ret;
+}
+
+/******************************************************************************
+ *
+ ******************************************************************************/
+int ctx_hand_shake_batch(struct perftest_comm *comm,
+		struct pingpong_dest *my_dest,
+		struct pingpong_dest *rem_dest,
+		int num)
+{
+	struct oob_peer peer;
+	int i;
+
+	/* rdma_cm carries one pingpong_dest per send */
+	if (comm->rdma_params->use_rdma_cm || comm->rdma_params->work_rdma_cm) {
+		for (i = 0; i < num; i++) {
+			if (ctx_hand_shake(comm, &my_dest[i], &rem_dest[i]))
+				return 1;
+		}
+		return 0;
+	}
+
+	peer.fd = comm->rdma_params->sockfd;
+	peer.my_dest = my_dest;
+	peer.rem_dest = rem_dest;
+	peer.num = num;
+	return oob_xchg_peers(&peer, 1, -1);
+}
+
 
 
 
@@ -1518,7 +1788,7 @@ int rdma_write_data(void *data,
  ******************************************************************************/
 int ethernet_write_data(struct perftest_comm *comm, char *msg, size_t size)
 {
-	if (write(comm->rdma_params->sockfd, msg, size) != size) {
+	if (sock_write_full(comm->rdma_params->sockfd, msg, size)) {
 		perror("client write");
 		fprintf(stderr, "Couldn't send reports\n");
 		return 1;
@@ -1532,7 +1802,7 @@ int ethernet_write_data(struct perftest_comm *comm, char *msg, size_t size)
  ******************************************************************************/
 int ethernet_read_data(struct perftest_comm *comm, char *recv_msg, size_t size)
 {
-	if (read(comm->rdma_params->sockfd, recv_msg, size) != size) {
+	if (sock_read_full(comm->rdma_params->sockfd, recv_msg, size)) {
 		fprintf(stderr, "ethernet_read_data: Couldn't read reports\n");
 		return 1;
 	}
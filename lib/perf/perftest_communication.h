@@ -44,6 +44,10 @@
 #include <rdma/rdma_cma.h>
 #include "perftest_resources.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /* Macro for 64 bit variables to switch to/from net */
 #if BYTE_ORDER == BIG_ENDIAN
 #define ntoh_64(x) (x)
@@ -72,15 +76,46 @@
 #define ntoh_int(x) (int) ntohl((uint32_t) (x))
 #define hton_int(x) (int) htonl((uint32_t) (x))
 
-#define KEY_MSG_SIZE 	 (59)   /* Message size without gid. */
-#define KEY_MSG_SIZE_GID (108)   /* Message size with gid (MGID as well). */
 #define SYNC_SPEC_ID	 (5)
 
-/* The Format of the message we pass through sockets , without passing Gid. */
-#define KEY_PRINT_FMT "%04x:%04x:%06x:%06x:%08x:%016llx:%08x"
-
-/* The Format of the message we pass through sockets (With Gid). */
-#define KEY_PRINT_FMT_GID "%04x:%04x:%06x:%06x:%08x:%016llx:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%08x:"
+/* The keys go through sockets as one oob_msg_header followed by count
+ * oob_dest_wire entries, fixed width and in network order. A single
+ * ctx_hand_shake sends a count of 1, ctx_hand_shake_batch all QPs at once. */
+#define OOB_MSG_MAGIC	 (0x70667462)	/* "pftb" */
+/* Version 1 replaced the per QP sprintf text of earlier builds, which
+ * have no header: this side rejects their text on the magic and they
+ * misread ours, so both ends must be rebuilt together. Bump it with any
+ * change to oob_msg_header or oob_dest_wire. */
+#define OOB_MSG_VERSION	 (1)
+/* epoll events handled per wakeup of oob_xchg_peers */
+#define OOB_MAX_EVENTS	 (64)
+
+struct oob_msg_header {
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	reserved;
+	uint32_t	count;
+}__attribute__((packed));
+
+struct oob_dest_wire {
+	uint32_t	lid;
+	uint32_t	out_reads;
+	uint32_t	qpn;
+	uint32_t	psn;
+	uint32_t	rkey;
+	uint32_t	srqn;
+	uint64_t	vaddr;
+	uint8_t		gid[16];
+}__attribute__((packed));
+
+/* One connected socket of oob_xchg_peers, my_dest is sent and rem_dest
+ * filled, num entries each. */
+struct oob_peer {
+	int			fd;
+	struct pingpong_dest	*my_dest;
+	struct pingpong_dest	*rem_dest;
+	int			num;
+};
 
 /* The Basic print format for all verbs. */
 #define BASIC_ADDR_FMT " %s address: LID %#04x QPN %#06x PSN %#06x"
@@ -225,6 +260,66 @@ int ctx_hand_shake(struct perftest_comm *comm,
 		struct pingpong_dest *my_dest,
 		struct pingpong_dest *rem_dest);
 
+/* ctx_hand_shake_batch .
+ *
+ * Description :
+ *
+ *  ctx_hand_shake for num QPs in one message each way instead of a round
+ *  trip per QP. Both sides send and receive at the same time, so neither
+ *  waits for the other to finish writing. Over rdma_cm it falls back to
+ *  one ctx_hand_shake per QP.
+ *
+ * Parameters :
+ *
+ *  comm     - contains connections info
+ *  my_dest  - num entries to pass to the other side.
+ *  rem_dest - num entries of the other side, it must pass the same num.
+ *  num      - number of QPs.
+ *
+ * Return Value : 0 upon success. 1 if it fails.
+ */
+int ctx_hand_shake_batch(struct perftest_comm *comm,
+		struct pingpong_dest *my_dest,
+		struct pingpong_dest *rem_dest,
+		int num);
+
+/* oob_xchg_peers .
+ *
+ * Description :
+ *
+ *  Exchanges the keys with many connected peers at once, driven by epoll
+ *  over non blocking sockets. The sockets are switched back to their
+ *  old flags before it returns.
+ *
+ * Parameters :
+ *
+ *  peers      - one entry per socket.
+ *  num_peers  - number of entries in peers.
+ *  timeout_ms - for the whole exchange, -1 waits forever.
+ *
+ * Return Value : 0 upon success. 1 if any peer fails.
+ */
+int oob_xchg_peers(struct oob_peer *peers, int num_peers, int timeout_ms);
+
+/* ethernet_server_accept_peers .
+ *
+ * Description :
+ *
+ *  Listens on the comm port and accepts num_peers clients, which
+ *  connected as for ctx_hand_shake, for oob_xchg_peers.
+ *
+ * Parameters :
+ *
+ *  comm       - contains connections info
+ *  num_peers  - number of clients to wait for.
+ *  fds        - filled with num_peers connected sockets.
+ *  timeout_ms - for all of them, -1 waits forever.
+ *
+ * Return Value : 0 upon success. 1 if it fails or times out.
+ */
+int ethernet_server_accept_peers(struct perftest_comm *comm, int num_peers, int *fds,
+				 int timeout_ms);
+
 
 
 /* ctx_print_pingpong_data.
@@ -844,6 +939,9 @@ int create_rdma_cm_connection(struct pingpong_context *ctx,
 		struct perftest_parameters *user_param, struct perftest_comm *comm,
 		struct pingpong_dest *my_dest, struct pingpong_dest *rem_dest);
 
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* PERFTEST_COMMUNICATION_H */
 
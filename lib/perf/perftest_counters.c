@@ -2,41 +2,66 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include "perftest_parameters.h"
 
-#define COUNTER_PATH "/sys/class/infiniband/%s/ports/%i/%s"
+#define COUNTER_PORT_PATH "/sys/class/infiniband/%s/ports/%i/%s"
 #define COUNTER_VALUE_MAX_LEN (21)
+/* a bare name is looked up in these port directories, in order */
+static const char *counter_dirs[] = { "counters/", "hw_counters/", NULL };
+static const char *counter_dir_as_is[] = { "", NULL };
 
 typedef unsigned long long counter_t;
 
 struct counter_context {
 	char *counter_list;
 	unsigned num_counters;
+	struct timespec prev_time;
+	struct timespec last_time;
 	struct {
 		int fd;
 		char *name;
+		unsigned scale;
 		counter_t prev_value;
 		counter_t last_value;
 	} counters[];
 };
 
+/*
+ * port_xmit_data and port_rcv_data count 32 bit words,
+ * everything else counts events.
+ */
+static unsigned counter_scale(const char *name)
+{
+	const char *base = strrchr(name, '/');
+	base = base ? base + 1 : name;
+	return (!strcmp(base, "port_xmit_data") || !strcmp(base, "port_rcv_data")) ? 4 : 1;
+}
 
+/*
+ * One pass over all counters, pread keeps the offset at 0 so there is
+ * no seek per counter, and the pass is stamped once.
+ */
 static int counters_read(struct counter_context *ctx)
 {
-	char read_buf[COUNTER_VALUE_MAX_LEN];
+	char read_buf[COUNTER_VALUE_MAX_LEN + 1];
+	ssize_t len;
 
 	int i;
+	ctx->prev_time = ctx->last_time;
+	clock_gettime(CLOCK_MONOTONIC, &ctx->last_time);
 	for (i = 0; i < ctx->num_counters; i++) {
-		int read_fd = ctx->counters[i].fd;
-		if (read(read_fd, &read_buf, COUNTER_VALUE_MAX_LEN) < 0) {
-			return -1;
+		len = pread(ctx->counters[i].fd, read_buf, COUNTER_VALUE_MAX_LEN, 0);
+		if (len < 0) {
+			return FAILURE;
 		}
+		read_buf[len] = '\0';
 
 		ctx->counters[i].prev_value = ctx->counters[i].last_value;
-		ctx->counters[i].last_value = strtoll(read_buf, NULL, 10);
-		(void) lseek(read_fd, 0, SEEK_SET);
+		ctx->counters[i].last_value = strtoull(read_buf, NULL, 10);
 	}
 
 	return SUCCESS;
@@ -53,62 +78,121 @@ int counters_alloc(const char *counter_names,
 		}
 	}
 
-	ALLOCATE(*ctx, struct counter_context, 3 * num_counters + 1);
+	*ctx = calloc(1, sizeof(**ctx) + num_counters * sizeof((*ctx)->counters[0]));
+	if (!*ctx) {
+		fprintf(stderr," Cannot Allocate\n");
+		exit(1);
+	}
 	(*ctx)->counter_list = strdup(counter_names);
 	(*ctx)->num_counters = num_counters;
 	return SUCCESS;
 }
 
+/*
+ * Open one counter of the port, a name with a '/' is taken as is,
+ * a bare one is tried in counters/ and then hw_counters/.
+ */
+static int counter_open_fd(const char *dev_name, int port, const char *name)
+{
+	const char **dirs = strchr(name, '/') ? counter_dir_as_is : counter_dirs;
+	char *given_path, *real_path;
+	int fd = -1;
+
+	for (; *dirs && fd < 0; dirs++) {
+		if (asprintf(&given_path, COUNTER_PORT_PATH "%s", dev_name, port,
+					*dirs, name) == -1) {
+			return -1;
+		}
+		real_path = realpath(given_path, NULL);
+		free(given_path);
+		if (!real_path) {
+			continue;
+		}
+		/* a name with ".." must not leave sysfs */
+		if (!strncmp(real_path, "/sys/", 5)) {
+			fd = open(real_path, O_RDONLY);
+		}
+		free(real_path);
+	}
+	return fd;
+}
+
 int counters_open(struct counter_context *ctx,
 		const char *dev_name, int port)
 {
 	/* Open the sysfs file for each counter */
 	int i;
-	char *given_path, *real_path, *next_counter;
+	char *next_counter;
 	for (i = 0, next_counter = strtok(ctx->counter_list, ",");
 		 i < ctx->num_counters;
 		 i++, next_counter = strtok(0, ",")) {
-		if (asprintf(&given_path, COUNTER_PATH, dev_name, port, next_counter) == -1) {
-			goto counter_cleanup;
-		}
-
-		real_path = realpath(given_path, NULL);
-		if (!real_path) {
-			goto counter_cleanup;
-		}
-
-		free(given_path);
-		if (strstr(real_path, COUNTER_PATH) != 0) {
-			free(real_path);
-			goto counter_cleanup;
-		}
-
-		if ((ctx->counters[i].fd = open(real_path, O_RDONLY)) < 0) {
-			free(real_path);
+		if (!next_counter ||
+			(ctx->counters[i].fd = counter_open_fd(dev_name, port, next_counter)) < 0) {
+			fprintf(stderr, " Couldn't open counter %s of %s port %d\n",
+					next_counter ? next_counter : "", dev_name, port);
 			goto counter_cleanup;
 		}
 
 		ctx->counters[i].name = next_counter;
+		ctx->counters[i].scale = counter_scale(next_counter);
 		ctx->counters[i].last_value = 0;
-		free(real_path);
 	}
 
-	return counters_read(ctx);
+	if (counters_read(ctx) == SUCCESS) {
+		return SUCCESS;
+	}
+	fprintf(stderr, " Couldn't read the counters of %s port %d\n", dev_name, port);
 
+	/* i counters are open, all of them when the first read failed */
 counter_cleanup:
 	ctx->num_counters = i;
 	counters_close(ctx);
 	return FAILURE;
 }
 
+int counters_sample(struct counter_context *ctx)
+{
+	return counters_read(ctx);
+}
+
+unsigned counters_count(struct counter_context *ctx)
+{
+	return ctx->num_counters;
+}
+
+const char *counters_name(struct counter_context *ctx, unsigned i)
+{
+	return ctx->counters[i].name;
+}
+
+unsigned long long counters_delta(struct counter_context *ctx, unsigned i)
+{
+	return (ctx->counters[i].last_value - ctx->counters[i].prev_value) *
+		ctx->counters[i].scale;
+}
+
+double counters_interval(struct counter_context *ctx)
+{
+	return (ctx->last_time.tv_sec - ctx->prev_time.tv_sec) +
+		(ctx->last_time.tv_nsec - ctx->prev_time.tv_nsec) / 1e9;
+}
+
+double counters_rate(struct counter_context *ctx, unsigned i)
+{
+	double interval = counters_interval(ctx);
+	return interval > 0 ? counters_delta(ctx, i) / interval : 0;
+}
+
 void counters_print(struct counter_context *ctx)
 {
 	(void) counters_read(ctx);
 
 	int i;
 	for (i = 0; i < ctx->num_counters; i++) {
-		printf("\t%s=%llu\n", ctx->counters[i].name,
-				ctx->counters[i].last_value - ctx->counters[i].prev_value);
+		printf("\t%s=%llu%s (%.2lf/sec)\n", ctx->counters[i].name,
+				counters_delta(ctx, i),
+				ctx->counters[i].scale > 1 ? " bytes" : "",
+				counters_rate(ctx, i));
 	}
 	printf("\n");
 }
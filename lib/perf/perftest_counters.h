@@ -1,6 +1,10 @@
 #ifndef PERFTEST_COUNTERS_H
 #define PERFTEST_COUNTERS_H
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct counter_context;
 
 /*
@@ -10,19 +14,40 @@ int counters_alloc(const char *counter_names,
 		struct counter_context **ctx);
 
 /*
- * Open a handle to the counters (and sample once).
+ * Open a handle to the counters (and sample once). A counter name is
+ * either a file of the port's counters/ or hw_counters/ directory
+ * (port_xmit_data, out_of_buffer, np_cnp_sent ...) or a path relative
+ * to the port. On failure ctx is closed and freed.
  */
 int counters_open(struct counter_context *ctx,
 		const char *dev_name, int port);
 
 /*
- * Sample and output the values to STDOUT.
+ * Sample and output the change since the previous sample to STDOUT.
  */
 void counters_print(struct counter_context *ctx);
 
+/*
+ * Sample all counters in one pass. The accessors below report the change
+ * between the last two samples, port_xmit_data and port_rcv_data are
+ * scaled from words to bytes.
+ */
+int counters_sample(struct counter_context *ctx);
+unsigned counters_count(struct counter_context *ctx);
+const char *counters_name(struct counter_context *ctx, unsigned i);
+unsigned long long counters_delta(struct counter_context *ctx, unsigned i);
+/* per second over the last interval */
+double counters_rate(struct counter_context *ctx, unsigned i);
+/* seconds between the last two samples */
+double counters_interval(struct counter_context *ctx);
+
 /*
  * Close the handle to the counters.
  */
 void counters_close(struct counter_context *ctx);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -38,6 +38,7 @@
 #include <netinet/in.h>
 #endif
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -51,6 +52,7 @@
 #include "multicast_resources.h"
 #include "perftest_communication.h"
 #include "raw_ethernet_resources.h"
+#include "inet_checksum.h"
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
@@ -97,26 +99,6 @@ static void mac_from_user(uint8_t   *mac, uint8_t *gid,int size )
 	memcpy(mac,gid,size);
 }
 
-/******************************************************************************
- *
- ******************************************************************************/
-static uint16_t ip_checksum	(void * buf,size_t 	  hdr_len)
-{
-	unsigned long sum = 0;
-	const uint16_t *ip1;
-	ip1 = buf;
-	while (hdr_len > 1) {
-		sum += *ip1++;
-		if (sum & 0x80000000)
-			sum = (sum & 0xFFFF) + (sum >> 16);
-		hdr_len -= 2;
-	}
-	while (sum >> 16)
-		sum = (sum & 0xFFFF) + (sum >> 16);
-
-	return(~sum);
-}
-
 void gen_ipv6_header(void* ip_header_buffer, uint8_t* saddr, uint8_t* daddr,
 		     uint8_t protocol, int pkt_size, int hop_limit, int tos, int is_l4,
 		     int is_tcp)
@@ -161,7 +143,7 @@ void gen_ipv4_header(void* ip_header_buffer, uint32_t* saddr, uint32_t* daddr,
 	ip_header.protocol = protocol;
 	ip_header.saddr = *saddr;
 	ip_header.daddr = *daddr;
-	ip_header.check = ip_checksum((void*)&ip_header,sizeof(struct IP_V4_header));
+	ip_header.check = inet_csum_ipv4(&ip_header);
 
 	memcpy(ip_header_buffer, &ip_header, sizeof(struct IP_V4_header));
 }
@@ -529,19 +511,13 @@ void build_pkt_on_buffer(struct ETH_header* eth_header,
 			 struct raw_ethernet_info *rem_dest_info,
 			 struct perftest_parameters *user_param,
 			 uint16_t eth_type, uint16_t ip_next_protocol,
-			 int print_flag, int pkt_size, int flows_offset)
+			 int print_flag, int pkt_size, int flows_offset,
+			 uint32_t vlan_pcp)
 {
 	void* header_buff = NULL;
 	int have_ip_header = user_param->is_client_ip || user_param->is_server_ip;
 	int is_udp_or_tcp = user_param->is_client_port && user_param->is_server_port;
 	int eth_header_size = sizeof(struct ETH_header);
-	static uint32_t vlan_pcp = 0;
-
-	if(user_param->vlan_pcp==VLAN_PCP_VARIOUS) {
-		vlan_pcp++;
-	} else {
-		vlan_pcp = user_param->vlan_pcp;
-	}
 
 	gen_eth_header(eth_header, my_dest_info->mac, rem_dest_info->mac, eth_type);
 
@@ -587,12 +563,168 @@ void build_pkt_on_buffer(struct ETH_header* eth_header,
 	}
 }
 
+/******************************************************************************
+ *raw_eth_template_init - build the base flow's header stack once
+ ******************************************************************************/
+void raw_eth_template_init(struct raw_eth_template *tmpl,
+			   struct raw_ethernet_info *my_dest_info,
+			   struct raw_ethernet_info *rem_dest_info,
+			   struct perftest_parameters *user_param,
+			   uint16_t eth_type, uint16_t ip_next_protocol,
+			   int pkt_size)
+{
+	int have_ip_header = user_param->is_client_ip || user_param->is_server_ip;
+	int is_udp_or_tcp = user_param->is_client_port && user_param->is_server_port;
+	int offset;
+
+	memset(tmpl, 0, sizeof(*tmpl));
+	tmpl->vlan_pcp = (user_param->vlan_pcp == VLAN_PCP_VARIOUS) ? 0 : user_param->vlan_pcp;
+	tmpl->is_ipv6 = user_param->raw_ipv6;
+	tmpl->is_tcp = user_param->tcp;
+
+	build_pkt_on_buffer((struct ETH_header*)tmpl->hdr, my_dest_info, rem_dest_info,
+			    user_param, eth_type, ip_next_protocol, PRINT_OFF,
+			    pkt_size, 0, tmpl->vlan_pcp);
+
+	/* the same layout build_pkt_on_buffer wrote */
+	if (user_param->vlan_en) {
+		tmpl->vlan_offset = offsetof(struct ETH_vlan_header, vlan_header);
+		offset = sizeof(struct ETH_vlan_header);
+	} else {
+		tmpl->vlan_offset = -1;
+		offset = sizeof(struct ETH_header);
+	}
+	tmpl->ip_offset = -1;
+	tmpl->l4_offset = -1;
+	if (have_ip_header) {
+		tmpl->ip_offset = offset;
+		offset += tmpl->is_ipv6 ? sizeof(struct IP_V6_header) : sizeof(struct IP_V4_header);
+	}
+	if (is_udp_or_tcp) {
+		tmpl->l4_offset = offset;
+		offset += tmpl->is_tcp ? sizeof(struct TCP_header) : sizeof(struct UDP_header);
+	}
+	tmpl->hdr_len = offset;
+}
+
+/******************************************************************************
+ * the fields are patched through byte offsets, a packet in the buffer need
+ * not be aligned for any of them
+ ******************************************************************************/
+static uint16_t load16(const uint8_t *p)
+{
+	uint16_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static void store16(uint8_t *p, uint16_t v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+/* udp/tcp checksum field, NULL without one. 0 means none was computed for
+ * udp and that the generator left it out for tcp, neither gets patched */
+static uint8_t *l4_check(const struct raw_eth_template *tmpl, uint8_t *pkt)
+{
+	uint8_t *check;
+
+	if (tmpl->l4_offset < 0)
+		return NULL;
+	check = pkt + tmpl->l4_offset + (tmpl->is_tcp ?
+		offsetof(struct TCP_header, th_check) :
+		offsetof(struct UDP_header, uh_sum));
+	return load16(check) ? check : NULL;
+}
+
+/* a computed udp checksum of 0 goes on the wire as 0xffff */
+static void store_l4_check(const struct raw_eth_template *tmpl, uint8_t *check,
+			   uint16_t sum)
+{
+	store16(check, (!sum && !tmpl->is_tcp) ? 0xffff : sum);
+}
+
+/* adds offset to the 32-bit address at field, in network order, fixing
+ * the ipv4 header and the pseudo header part of the l4 checksum */
+static void patch_addr(const struct raw_eth_template *tmpl, uint8_t *pkt,
+		       uint8_t *field, uint32_t offset)
+{
+	uint32_t old, new_val;
+	uint8_t *check;
+
+	memcpy(&old, field, sizeof(old));
+	new_val = htonl(ntohl(old) + offset);
+	memcpy(field, &new_val, sizeof(new_val));
+
+	if (!tmpl->is_ipv6) {
+		check = pkt + tmpl->ip_offset + offsetof(struct IP_V4_header, check);
+		store16(check, inet_csum_replace4(load16(check), old, new_val));
+	}
+	check = l4_check(tmpl, pkt);
+	if (check)
+		store_l4_check(tmpl, check, inet_csum_replace4(load16(check), old, new_val));
+}
+
+/* the same for a port, sport and dport lead both udp and tcp headers */
+static void patch_port(const struct raw_eth_template *tmpl, uint8_t *pkt,
+		       uint8_t *field, int offset)
+{
+	uint16_t old = load16(field);
+	uint16_t new_val = htons(ntohs(old) + offset);
+	uint8_t *check = l4_check(tmpl, pkt);
+
+	store16(field, new_val);
+	if (check)
+		store_l4_check(tmpl, check, inet_csum_replace2(load16(check), old, new_val));
+}
+
+/******************************************************************************
+ *raw_eth_template_put - write one flow's headers, patching what differs
+ ******************************************************************************/
+void raw_eth_template_put(const struct raw_eth_template *tmpl, void *buf,
+			  const struct raw_eth_flow *flow)
+{
+	uint8_t *pkt = buf;
+
+	memcpy(pkt, tmpl->hdr, tmpl->hdr_len);
+
+	if (tmpl->vlan_offset >= 0 && flow->vlan_pcp != tmpl->vlan_pcp) {
+		uint32_t tag;
+		memcpy(&tag, pkt + tmpl->vlan_offset, sizeof(tag));
+		tag = htonl((ntohl(tag) & ~(0x7 << 13)) | ((flow->vlan_pcp & 0x7) << 13));
+		memcpy(pkt + tmpl->vlan_offset, &tag, sizeof(tag));
+	}
+
+	if (flow->ip_offset && tmpl->ip_offset >= 0) {
+		uint8_t *ip = pkt + tmpl->ip_offset;
+		if (tmpl->is_ipv6) {
+			/* the low 32 bits of each address */
+			patch_addr(tmpl, pkt, ip + offsetof(struct IP_V6_header, saddr) + 12,
+				   flow->ip_offset);
+			patch_addr(tmpl, pkt, ip + offsetof(struct IP_V6_header, daddr) + 12,
+				   flow->ip_offset);
+		} else {
+			patch_addr(tmpl, pkt, ip + offsetof(struct IP_V4_header, saddr),
+				   flow->ip_offset);
+			patch_addr(tmpl, pkt, ip + offsetof(struct IP_V4_header, daddr),
+				   flow->ip_offset);
+		}
+	}
+
+	if (flow->port_offset && tmpl->l4_offset >= 0) {
+		uint8_t *l4 = pkt + tmpl->l4_offset;
+		patch_port(tmpl, pkt, l4 + offsetof(struct UDP_header, uh_sport), flow->port_offset);
+		patch_port(tmpl, pkt, l4 + offsetof(struct UDP_header, uh_dport), flow->port_offset);
+	}
+}
+
 /******************************************************************************
  *Create_raw_eth_pkt - build raw Ethernet packet by user arguments.
  *On bw test, build one packet and duplicate it on the buffer per QP.
  *Alternatively, build multiple packets according to number of flows,
  * again per QP
  *On lat test, build only one packet on the buffer (for the ping pong method)
+ *The headers are built once as a template, flows only patch their ports
  ******************************************************************************/
 void create_raw_eth_pkt( struct perftest_parameters *user_param,
 		struct pingpong_context 	*ctx,
@@ -603,8 +735,12 @@ void create_raw_eth_pkt( struct perftest_parameters *user_param,
 	int pkt_offset = 0;
 	int flow_limit = 0;
 	int i = 0;
-	int print_flag = (user_param->vlan_pcp==VLAN_PCP_VARIOUS) ? PRINT_ON:PRINT_OFF;
+	int print_flag = PRINT_OFF;
+	int various_pcp = user_param->vlan_pcp == VLAN_PCP_VARIOUS;
+	uint32_t vlan_pcp = 0;
 	struct ETH_header* eth_header;
+	struct raw_eth_template tmpl;
+	struct raw_eth_flow flow;
 	uint16_t vlan_tag_size = user_param->vlan_en ? 4 : 0;
 	uint16_t ip_next_protocol = 0;
 	uint16_t eth_type = user_param->is_ethertype ? user_param->ethertype :
@@ -616,20 +752,29 @@ void create_raw_eth_pkt( struct perftest_parameters *user_param,
 
 	DEBUG_LOG(TRACE,">>>>>>%s",__FUNCTION__);
 
+	raw_eth_template_init(&tmpl, my_dest_info, rem_dest_info, user_param,
+			      eth_type, ip_next_protocol, ctx->size - RAWETH_ADDITION);
+	memset(&flow, 0, sizeof(flow));
+	flow.vlan_pcp = tmpl.vlan_pcp;
+
 	eth_header = buf;
 
 	if (user_param->tst == BW || user_param->tst == LAT_BY_BW) {
 		/* fill ctx buffer with different packets according to flows_offset */
 		for (i = 0; i < user_param->flows; i++) {
 			print_flag = PRINT_ON;
+			flow.port_offset = i;
 			pkt_offset = ctx->flow_buff_size * i; /* update the offset to next flow */
 			flow_limit = ctx->flow_buff_size * (i + 1);
 			eth_header = (void*)buf + pkt_offset;/* update the eth_header to next flow */
 			/* fill ctx buffer with same packets */
 			while ((flow_limit - INC(ctx->size, ctx->cache_line_size)) >= pkt_offset) {
-				build_pkt_on_buffer(eth_header, my_dest_info, rem_dest_info,
-						    user_param, eth_type, ip_next_protocol,
-						    print_flag, ctx->size - RAWETH_ADDITION, i);
+				/* a different priority for each packet */
+				if (various_pcp)
+					flow.vlan_pcp = ++vlan_pcp & 0x7;
+				raw_eth_template_put(&tmpl, eth_header, &flow);
+				if (print_flag == PRINT_ON)
+					print_pkt((void*)eth_header, user_param);
 				print_flag = PRINT_OFF;
 				pkt_offset += INC(ctx->size, ctx->cache_line_size);/* update the offset to next packet in same flow */
 				eth_header = (void*)buf + pkt_offset;/* update the eth_header to next packet in same flow */
@@ -638,12 +783,13 @@ void create_raw_eth_pkt( struct perftest_parameters *user_param,
 	} else if (user_param->tst == LAT) {
 		/* fill ctx buffer with different packets according to flows_offset */
 		for (i = 0; i < user_param->flows; i++) {
+			flow.port_offset = i;
+			if (various_pcp)
+				flow.vlan_pcp = ++vlan_pcp & 0x7;
 			pkt_offset = ctx->flow_buff_size * i;
 			eth_header = (void*)buf + pkt_offset;
-			build_pkt_on_buffer(eth_header, my_dest_info, rem_dest_info,
-					    user_param, eth_type, ip_next_protocol,
-					    PRINT_ON, ctx->size - RAWETH_ADDITION, i);
-
+			raw_eth_template_put(&tmpl, eth_header, &flow);
+			print_pkt((void*)eth_header, user_param);
 		}
 	}
 
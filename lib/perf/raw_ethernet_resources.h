@@ -177,6 +177,7 @@ int check_flow_steering_support(char *dev_name);
  *		print_flag - if print_flag == TRUE : print the packet after it's done
  *		pkt_size - size of the requested packet
  *		flows_offset - current offset from the base flow
+ *		vlan_pcp - priority of the vlan tag, when user_param->vlan_en
  */
 void build_pkt_on_buffer(struct ETH_header* eth_header,
 		struct raw_ethernet_info *my_dest_info,
@@ -186,12 +187,74 @@ void build_pkt_on_buffer(struct ETH_header* eth_header,
 		uint16_t ip_next_protocol,
 		int print_flag,
 		int pkt_size,
-		int flows_offset);
+		int flows_offset,
+		uint32_t vlan_pcp);
+
+/* largest header stack: vlan tagged ethernet, ipv6 and tcp */
+#define RAW_ETH_TEMPLATE_SIZE (sizeof(struct ETH_vlan_header) + \
+		sizeof(struct IP_V6_header) + sizeof(struct TCP_header))
+
+/* raw_eth_template
+ * Description: the header stack of a test's packets, built once by
+ *		build_pkt_on_buffer for the base flow. The variants of other flows
+ *		are written by raw_eth_template_put, which copies the stack and
+ *		patches only the fields that differ, updating the checksums
+ *		incrementally (RFC 1624). It is not changed after
+ *		raw_eth_template_init, so the threads filling the buffers of
+ *		different QPs can share one.
+ */
+struct raw_eth_template {
+	uint8_t		hdr[RAW_ETH_TEMPLATE_SIZE];
+	int		hdr_len;
+	int		vlan_offset;	/* vlan_header word, -1 without vlan */
+	int		ip_offset;	/* ip header, -1 without */
+	int		l4_offset;	/* udp or tcp header, -1 without */
+	int		is_ipv6;
+	int		is_tcp;
+	uint32_t	vlan_pcp;	/* priority the stack was built with */
+};
+
+/* what sets one flow's packets apart from the base flow */
+struct raw_eth_flow {
+	int		port_offset;	/* added to both udp/tcp ports */
+	uint32_t	ip_offset;	/* added to both ip addresses, the low
+					 * 32 bits of ipv6 ones */
+	uint32_t	vlan_pcp;
+};
+
+/* raw_eth_template_init
+ * Description: build the header stack of the base flow
+ *
+ * Parameters:
+ *		tmpl - Pointer to output
+ *		my_dest_info, rem_dest_info, user_param, eth_type,
+ *		ip_next_protocol, pkt_size - as for build_pkt_on_buffer
+ */
+void raw_eth_template_init(struct raw_eth_template *tmpl,
+		struct raw_ethernet_info *my_dest_info,
+		struct raw_ethernet_info *rem_dest_info,
+		struct perftest_parameters *user_param,
+		uint16_t eth_type,
+		uint16_t ip_next_protocol,
+		int pkt_size);
+
+/* raw_eth_template_put
+ * Description: write the headers of one flow's packet to buf
+ *
+ * Parameters:
+ *		tmpl - template of raw_eth_template_init
+ *		buf - start of the packet
+ *		flow - fields to patch, all zero but vlan_pcp is the base flow
+ */
+void raw_eth_template_put(const struct raw_eth_template *tmpl, void *buf,
+		const struct raw_eth_flow *flow);
 
 /*  create_raw_eth_pkt
  * 	Description: build raw Ethernet packet by user arguments
  *				 on bw test, build one packet and duplicate it on the buffer
  *				 on lat test, build only one packet on the buffer (for the ping pong method)
+ *				 every packet is written from one raw_eth_template, it keeps
+ *				 no state between calls and may run for several QPs at once
  *
  *	Parameters:
  *				user_param - user_parameters struct for this test
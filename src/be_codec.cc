@@ -0,0 +1,153 @@
+#include "be_codec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BE_CODEC_X86 1
+#endif
+
+typedef void (*swap_fn)(void *dst, const void *src, size_t num);
+
+/********** scalar **********/
+static void swap_4_scalar(void *dst, const void *src, size_t num) {
+  byte *d = (byte *)dst;
+  const byte *s = (const byte *)src;
+  for (size_t i = 0; i < num; i++) {
+    uint32_t v;
+    memcpy(&v, s + i * 4, 4);
+    v = m_to_be_4(v);
+    memcpy(d + i * 4, &v, 4);
+  }
+}
+
+static void swap_8_scalar(void *dst, const void *src, size_t num) {
+  byte *d = (byte *)dst;
+  const byte *s = (const byte *)src;
+  for (size_t i = 0; i < num; i++) {
+    uint64_t v;
+    memcpy(&v, s + i * 8, 8);
+    v = m_to_be_8(v);
+    memcpy(d + i * 8, &v, 8);
+  }
+}
+
+#if BE_CODEC_X86 && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/********** ssse3 **********/
+__attribute__((target("ssse3")))
+static void swap_4_ssse3(void *dst, const void *src, size_t num) {
+  const __m128i mask = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+                                    4, 5, 6, 7, 0, 1, 2, 3);
+  byte *d = (byte *)dst;
+  const byte *s = (const byte *)src;
+  size_t i = 0;
+  for (; i + 4 <= num; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i * 4));
+    _mm_storeu_si128((__m128i *)(d + i * 4), _mm_shuffle_epi8(v, mask));
+  }
+  swap_4_scalar(d + i * 4, s + i * 4, num - i);
+}
+
+__attribute__((target("ssse3")))
+static void swap_8_ssse3(void *dst, const void *src, size_t num) {
+  const __m128i mask = _mm_set_epi8(8, 9, 10, 11, 12, 13, 14, 15,
+                                    0, 1, 2, 3, 4, 5, 6, 7);
+  byte *d = (byte *)dst;
+  const byte *s = (const byte *)src;
+  size_t i = 0;
+  for (; i + 2 <= num; i += 2) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i * 8));
+    _mm_storeu_si128((__m128i *)(d + i * 8), _mm_shuffle_epi8(v, mask));
+  }
+  swap_8_scalar(d + i * 8, s + i * 8, num - i);
+}
+
+/********** avx2 **********/
+__attribute__((target("avx2")))
+static void swap_4_avx2(void *dst, const void *src, size_t num) {
+  /* vpshufb shuffles within each 128 bit lane */
+  const __m256i mask = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+                                       4, 5, 6, 7, 0, 1, 2, 3,
+                                       12, 13, 14, 15, 8, 9, 10, 11,
+                                       4, 5, 6, 7, 0, 1, 2, 3);
+  byte *d = (byte *)dst;
+  const byte *s = (const byte *)src;
+  size_t i = 0;
+  for (; i + 8 <= num; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + i * 4));
+    _mm256_storeu_si256((__m256i *)(d + i * 4), _mm256_shuffle_epi8(v, mask));
+  }
+  swap_4_ssse3(d + i * 4, s + i * 4, num - i);
+}
+
+__attribute__((target("avx2")))
+static void swap_8_avx2(void *dst, const void *src, size_t num) {
+  const __m256i mask = _mm256_set_epi8(8, 9, 10, 11, 12, 13, 14, 15,
+                                       0, 1, 2, 3, 4, 5, 6, 7,
+                                       8, 9, 10, 11, 12, 13, 14, 15,
+                                       0, 1, 2, 3, 4, 5, 6, 7);
+  byte *d = (byte *)dst;
+  const byte *s = (const byte *)src;
+  size_t i = 0;
+  for (; i + 4 <= num; i += 4) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + i * 8));
+    _mm256_storeu_si256((__m256i *)(d + i * 8), _mm256_shuffle_epi8(v, mask));
+  }
+  swap_8_ssse3(d + i * 8, s + i * 8, num - i);
+}
+#endif
+
+/********** dispatch **********/
+struct swap_impl {
+  swap_fn     swap_4;
+  swap_fn     swap_8;
+  const char  *name;
+};
+
+static swap_impl pick_swap_impl() {
+#if BE_CODEC_X86 && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return {swap_4_avx2, swap_8_avx2, "avx2"};
+  }
+  if (__builtin_cpu_supports("ssse3")) {
+    return {swap_4_ssse3, swap_8_ssse3, "ssse3"};
+  }
+#endif
+  return {swap_4_scalar, swap_8_scalar, "scalar"};
+}
+
+static swap_impl be_swap = pick_swap_impl();
+
+void m_write_4_array(byte *dst, const uint32_t *src, size_t num) {
+  be_swap.swap_4(dst, src, num);
+}
+
+void m_write_8_array(byte *dst, const uint64_t *src, size_t num) {
+  be_swap.swap_8(dst, src, num);
+}
+
+void m_read_4_array(uint32_t *dst, const byte *src, size_t num) {
+  be_swap.swap_4(dst, src, num);
+}
+
+void m_read_8_array(uint64_t *dst, const byte *src, size_t num) {
+  be_swap.swap_8(dst, src, num);
+}
+
+const char *be_codec_impl() {
+  return be_swap.name;
+}
+
+int be_codec_select(const char *name) {
+  if (!strcmp(name, "scalar")) {
+    be_swap = {swap_4_scalar, swap_8_scalar, "scalar"};
+#if BE_CODEC_X86 && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  } else if (!strcmp(name, "ssse3") && __builtin_cpu_supports("ssse3")) {
+    be_swap = {swap_4_ssse3, swap_8_ssse3, "ssse3"};
+  } else if (!strcmp(name, "avx2") && __builtin_cpu_supports("avx2")) {
+    be_swap = {swap_4_avx2, swap_8_avx2, "avx2"};
+#endif
+  } else {
+    return 1;
+  }
+  return 0;
+}
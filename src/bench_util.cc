@@ -0,0 +1,207 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+
+#include "bench_util.h"
+
+/********** BenchReport **********/
+static const char *bench_columns =
+    "suite,op,size,depth,threads,conns,ops,errors,seconds,mbps,kops,"
+    "target_kops,lat_min_us,lat_mean_us,lat_p50_us,lat_p90_us,lat_p99_us,"
+    "lat_p999_us,lat_max_us,lat_valid";
+
+void BenchReport::row(const bench_result &r) {
+  double mbps = r.seconds > 0 ? (double)r.size * r.ops / r.seconds / 1e6 : 0;
+  double kops = r.seconds > 0 ? r.ops / r.seconds / 1e3 : 0;
+  double lat[7] = {0};
+  if (r.lat && r.lat->count()) {
+    lat[0] = r.lat->min() / 1e3;
+    lat[1] = r.lat->mean() / 1e3;
+    lat[2] = r.lat->percentile(50) / 1e3;
+    lat[3] = r.lat->percentile(90) / 1e3;
+    lat[4] = r.lat->percentile(99) / 1e3;
+    lat[5] = r.lat->percentile(99.9) / 1e3;
+    lat[6] = r.lat->max() / 1e3;
+  }
+
+  if (format == BENCH_CSV) {
+    if (!header_done) {
+      fprintf(out, "%s\n", bench_columns);
+      header_done = true;
+    }
+    fprintf(out, "%s,%s,%u,%d,%d,%d,%lu,%lu,%.6f,%.2f,%.3f,%.3f,"
+            "%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%d\n",
+            r.suite.c_str(), r.op.c_str(), r.size, r.depth, r.threads, r.conns,
+            r.ops, r.errors, r.seconds, mbps, kops, r.target_kops,
+            lat[0], lat[1], lat[2], lat[3], lat[4], lat[5], lat[6], lat_valid);
+  } else {
+    fprintf(out, "{\"suite\":\"%s\",\"op\":\"%s\",\"size\":%u,\"depth\":%d,"
+            "\"threads\":%d,\"conns\":%d,\"ops\":%lu,\"errors\":%lu,"
+            "\"seconds\":%.6f,\"mbps\":%.2f,\"kops\":%.3f,\"target_kops\":%.3f,"
+            "\"lat_min_us\":%.3f,\"lat_mean_us\":%.3f,\"lat_p50_us\":%.3f,"
+            "\"lat_p90_us\":%.3f,\"lat_p99_us\":%.3f,\"lat_p999_us\":%.3f,"
+            "\"lat_max_us\":%.3f,\"lat_valid\":%d}\n",
+            r.suite.c_str(), r.op.c_str(), r.size, r.depth, r.threads, r.conns,
+            r.ops, r.errors, r.seconds, mbps, kops, r.target_kops,
+            lat[0], lat[1], lat[2], lat[3], lat[4], lat[5], lat[6], lat_valid);
+  }
+  fflush(out);
+}
+
+void BenchReport::note(const char *fmt, ...) {
+  char buf[512];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+
+  if (format == BENCH_CSV) {
+    fprintf(out, "# %s\n", buf);
+  } else {
+    /* notes are ours, only quotes and backslashes need escaping */
+    std::string s;
+    for (char *c = buf; *c; c++) {
+      if (*c == '"' || *c == '\\') s += '\\';
+      s += *c;
+    }
+    fprintf(out, "{\"note\":\"%s\"}\n", s.c_str());
+  }
+  fflush(out);
+}
+
+void BenchReport::check_clock(int64_t threshold_ns) {
+  switch (perf_clock_check_skew(threshold_ns)) {
+  case 0:
+    note("cross-core clock skew %ld ns, within %ld ns", perf_clock_max_skew_ns,
+         threshold_ns);
+    break;
+  case 1:
+    lat_valid = false;
+    note("cross-core clock skew %ld ns is above %ld ns, latencies are not valid",
+         perf_clock_max_skew_ns, threshold_ns);
+    break;
+  default:
+    /* without a calibrated counter now_ns is clock_gettime, the same on
+    every core */
+    note("cross-core clock skew not measured");
+    break;
+  }
+}
+
+/********** options **********/
+static bool parse_u64(const char *s, char **end, uint64_t *v) {
+  errno = 0;
+  *v = strtoull(s, end, 0);
+  return *end != s && !errno;
+}
+
+bool parse_size_list(const char *arg, std::vector<uint32_t> &out) {
+  const char *p = arg;
+  char *end;
+  uint64_t lo, hi;
+
+  out.clear();
+  while (*p) {
+    if (!parse_u64(p, &end, &lo) || !lo || lo > UINT32_MAX) {
+      return false;
+    }
+    if (*end == ':') {
+      p = end + 1;
+      if (!parse_u64(p, &end, &hi) || hi < lo || hi > UINT32_MAX) {
+        return false;
+      }
+      for (uint64_t s = lo; s <= hi; s *= 2) {
+        out.push_back((uint32_t)s);
+      }
+    } else {
+      out.push_back((uint32_t)lo);
+    }
+    if (*end == ',') {
+      end++;
+    } else if (*end) {
+      return false;
+    }
+    p = end;
+  }
+  return !out.empty();
+}
+
+bool parse_int_list(const char *arg, std::vector<int> &out) {
+  std::vector<uint32_t> values;
+  if (!parse_size_list(arg, values)) {
+    return false;
+  }
+  out.clear();
+  for (uint32_t v : values) {
+    if (v > INT32_MAX) {
+      return false;
+    }
+    out.push_back((int)v);
+  }
+  return true;
+}
+
+bool parse_format(const char *arg, bench_format *format) {
+  if (!strcmp(arg, "csv")) {
+    *format = BENCH_CSV;
+  } else if (!strcmp(arg, "json")) {
+    *format = BENCH_JSON;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/********** connection **********/
+static void bench_conn_thread(ConnectionProc *conn) {
+  if (conn->is_server()) {
+    static_cast<RDMAServer *>(conn)->run();
+  } else {
+    static_cast<RDMAClient *>(conn)->run();
+  }
+  conn->set_alive(false);
+}
+
+static ConnectionProc *bench_new_conn(EnvironmentProc *env) {
+  ConnectionProc *conn = nullptr;
+  if (env->is_server()) {
+    conn = new RDMAServer(env);
+  } else {
+    conn = new RDMAClient(env);
+  }
+  conn->set_alive(true);
+  return conn;
+}
+
+ConnectionProc *bench_start(EnvironmentProc *env) {
+  ConnectionProc *conn = bench_new_conn(env);
+  std::thread tc(bench_conn_thread, conn);
+  tc.detach();
+  return conn;
+}
+
+bool bench_wait(ConnectionProc *conn) {
+  while (!conn->is_connected()) {
+    if (!conn->is_alive()) {
+      return false;
+    }
+    std::this_thread::yield();
+  }
+  return true;
+}
+
+ConnectionProc *bench_connect(EnvironmentProc *env) {
+  ConnectionProc *conn = bench_new_conn(env);
+  std::thread tc(bench_conn_thread, conn);
+  if (bench_wait(conn)) {
+    tc.detach();
+    return conn;
+  }
+  /* it only dies before coming up when run() returned, which released
+  what it had built, so a retry doesn't pile up dead connections */
+  tc.join();
+  delete conn;
+  return nullptr;
+}
@@ -0,0 +1,105 @@
+#include "bulk_transfer.h"
+
+BulkTransfer::BulkTransfer(ConnectionProc *conn, uint32_t chunk_len,
+                           uint32_t window) : conn(conn), window(window) {
+  /* whole packets, and never more than a block */
+  chunk_len &= ~(uint32_t)(BULK_MTU_ALIGN - 1);
+  this->chunk_len = std::max((uint32_t)BULK_MTU_ALIGN,
+                             std::min(chunk_len, (uint32_t)FIX_BLOCK_LENGTH));
+  this->window = std::max(1u, std::min(window, (uint32_t)conn->get_tx_depth()));
+  slots = std::vector<rdma_request>(this->window);
+}
+
+int16_t BulkTransfer::write(uint64_t local_voff, uint64_t remote_voff,
+                            uint64_t length, bulk_stats *stats) {
+  return transfer(false, local_voff, remote_voff, length, stats);
+}
+
+int16_t BulkTransfer::read(uint64_t local_voff, uint64_t remote_voff,
+                           uint64_t length, bulk_stats *stats) {
+  return transfer(true, local_voff, remote_voff, length, stats);
+}
+
+int16_t BulkTransfer::next_chunk(uint64_t local_voff, uint64_t remote_voff,
+                                 uint64_t len, rdma_mem_info &info) {
+  MemoryMagr *mem = conn->get_mem_magr();
+  uint64_t local_room = FIX_BLOCK_LENGTH - local_voff % FIX_BLOCK_LENGTH;
+
+  memset(&info, 0, sizeof(info));
+  info.src_mr = mem->get_pinned_mr(local_voff - local_voff % FIX_BLOCK_LENGTH,
+                                   FIX_BLOCK_LENGTH);
+  if (info.src_mr == NULL) {
+    fprintf(stderr, "bulk transfer: local voff %lu not pinned\n", local_voff);
+    return FAILURE;
+  }
+  info.local_address = (uint64_t)mem->get_local_address(local_voff);
+
+  /* find the remote region first, then clip to its end */
+  info.length = 1;
+  if (conn->lookup_remote_mr(remote_voff, info)) {
+    fprintf(stderr, "bulk transfer: remote voff %lu unknown\n", remote_voff);
+    return FAILURE;
+  }
+  uint64_t remote_room = info.dst_mr.length - info.offset;
+
+  info.length = (uint32_t)std::min(std::min(len, (uint64_t)chunk_len),
+                                   std::min(local_room, remote_room));
+  return SUCCESS;
+}
+
+int16_t BulkTransfer::transfer(bool is_read, uint64_t local_voff,
+                               uint64_t remote_voff, uint64_t length,
+                               bulk_stats *stats) {
+  std::vector<bool> busy(window, false);
+  uint64_t posted = 0, chunks = 0;
+  uint32_t inflight = 0;
+  bool failed = false;
+
+  uint64_t start = now_ns();
+  /* stop posting on the first error but reap what is in flight, the
+  slots live in this object */
+  while ((posted < length && !failed) || inflight > 0) {
+    for (uint32_t i = 0; i < window; i++) {
+      if (busy[i]) {
+        if (slots[i].pending.load(std::memory_order_acquire) > 0) {
+          continue;
+        }
+        if (slots[i].failed.load()) {
+          failed = true;
+        }
+        busy[i] = false;
+        inflight--;
+      }
+      if (posted == length || failed) {
+        continue;
+      }
+
+      rdma_mem_info info;
+      if (next_chunk(local_voff + posted, remote_voff + posted,
+                     length - posted, info)) {
+        failed = true;
+        continue;
+      }
+      slots[i].failed.store(false);
+      info.req = &slots[i];
+      busy[i] = true;
+      inflight++;
+      if (is_read ? conn->rdma_read(info) : conn->rdma_write(info)) {
+        /* the slot is reaped like any other, once nothing of it is
+        pending, so no chunk of it can still land after we return */
+        slots[i].failed.store(true);
+        continue;
+      }
+      posted += info.length;
+      chunks++;
+    }
+  }
+
+  if (stats) {
+    stats->bytes = failed ? 0 : length;
+    stats->chunks = chunks;
+    stats->seconds = (now_ns() - start) / 1e9;
+    stats->mbps = stats->seconds > 0 ? stats->bytes / stats->seconds / 1e6 : 0;
+  }
+  return failed ? FAILURE : SUCCESS;
+}
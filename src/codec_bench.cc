@@ -0,0 +1,212 @@
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "be_codec.h"
+#include "bench_util.h"
+
+/* Compares the batch big-endian codec of be_codec.h to encoding the
+same array one field at a time with m_write_N / m_read_N.
+
+  codecbench [<bench options>]
+
+  -b, --sizes     values per array, "4,64,1024" or "4:4096"
+                  (default 4,16,64,256,1024)
+  -d, --duration  milliseconds per configuration (default 200)
+  -f, --format    csv (default) or json, one line per configuration
+  -w, --output    file instead of stdout
+
+One row per direction, width, implementation and size: suite is write
+or read, op is loop_4 / loop_8 for the field at a time loop or the
+be_codec_impl name the cpu can run with the width, e.g. avx2_8. size is
+the array in bytes, one op codes all of it. Every routine is checked
+against the loop before it is timed. */
+
+/* ops between two clock reads */
+#define CODEC_BATCH  64
+
+static struct option codec_options[] = {
+  { name : "sizes",     has_arg : 1, flag : NULL, val : 'b' },
+  { name : "duration",  has_arg : 1, flag : NULL, val : 'd' },
+  { name : "format",    has_arg : 1, flag : NULL, val : 'f' },
+  { name : "output",    has_arg : 1, flag : NULL, val : 'w' },
+  {0}
+};
+
+struct codec_params {
+  std::vector<uint32_t> sizes;
+  int                   duration_ms;
+  bench_format          format;
+  const char            *output;
+};
+
+static int16_t parse_codec_params(int argc, char *argv[], codec_params *cp) {
+  parse_size_list("4,16,64,256,1024", cp->sizes);
+  cp->duration_ms = 200;
+  cp->format = BENCH_CSV;
+  cp->output = NULL;
+
+  while (1) {
+    int ch = getopt_long(argc, argv, "b:d:f:w:", codec_options, NULL);
+    if (ch == -1) {
+      break;
+    }
+    switch (ch) {
+      case 'b': {
+        if (!parse_size_list(optarg, cp->sizes)) {
+          fprintf(stderr, "Bad size list %s\n", optarg);
+          return FAILURE;
+        }
+      } break;
+      case 'd': {
+        cp->duration_ms = atoi(optarg);
+        if (cp->duration_ms <= 0) {
+          fprintf(stderr, "Duration must be positive\n");
+          return FAILURE;
+        }
+      } break;
+      case 'f': {
+        if (!parse_format(optarg, &cp->format)) {
+          fprintf(stderr, "Format is csv or json\n");
+          return FAILURE;
+        }
+      } break;
+      case 'w': { cp->output = optarg; } break;
+    default:
+      return FAILURE;
+      break;
+    }
+  }
+  return SUCCESS;
+}
+
+/* calls fn with the op number until duration_ms passed */
+template <typename F>
+static void run_timed(int duration_ms, bench_result *r, F fn) {
+  uint64_t ops = 0;
+  uint64_t start = now_ns(), now;
+  uint64_t deadline = start + (uint64_t)duration_ms * 1000000;
+  do {
+    for (int i = 0; i < CODEC_BATCH; i++) {
+      fn(ops + i);
+    }
+    ops += CODEC_BATCH;
+    now = now_ns();
+  } while (now < deadline);
+  r->ops = ops;
+  r->seconds = (now - start) / 1e9;
+}
+
+/* keeps the compiler from dropping the coded arrays */
+static volatile uint64_t codec_sink;
+
+/* one width, T is uint32_t or uint64_t */
+template <typename T>
+static int16_t run_width(const codec_params &cp, BenchReport &report,
+                         void (*write_array)(byte *, const T *, size_t),
+                         void (*read_array)(T *, const byte *, size_t),
+                         void (*write_one)(byte *, uint64_t),
+                         T (*read_one)(const byte *)) {
+  static const char *impls[] = {"scalar", "ssse3", "avx2"};
+  const size_t w = sizeof(T);
+  bench_result r;
+  r.depth = r.threads = r.conns = 1;
+  r.errors = 0;
+  r.target_kops = 0;
+  r.lat = NULL;
+
+  for (uint32_t size : cp.sizes) {
+    std::vector<T> values(size), decoded(size);
+    std::vector<byte> wire(size * w), expect(size * w);
+    for (auto &v : values) {
+      v = (T)(((uint64_t)rand() << 32) | (uint64_t)rand());
+    }
+    for (uint32_t i = 0; i < size; i++) {
+      write_one(&expect[i * w], values[i]);
+    }
+    std::string loop = "loop_" + std::to_string(w);
+    r.size = size * w;
+
+    r.suite = "write";
+    r.op = loop;
+    run_timed(cp.duration_ms, &r, [&](uint64_t op) {
+      values[0] = (T)op;
+      for (uint32_t i = 0; i < size; i++) {
+        write_one(&wire[i * w], values[i]);
+      }
+      codec_sink = wire[0];
+    });
+    report.row(r);
+    r.suite = "read";
+    run_timed(cp.duration_ms, &r, [&](uint64_t op) {
+      wire[0] = (byte)op;
+      for (uint32_t i = 0; i < size; i++) {
+        decoded[i] = read_one(&wire[i * w]);
+      }
+      codec_sink = decoded[0];
+    });
+    report.row(r);
+
+    for (const char *impl : impls) {
+      if (be_codec_select(impl)) {
+        continue;
+      }
+      /* the timed runs wrote the op number over the first value */
+      values[0] = read_one(&expect[0]);
+      write_array(wire.data(), values.data(), size);
+      read_array(decoded.data(), expect.data(), size);
+      if (memcmp(wire.data(), expect.data(), wire.size()) ||
+          memcmp(decoded.data(), values.data(), size * w)) {
+        fprintf(stderr, "%s codec of %u x %zu bytes differs from the loop\n",
+                impl, size, w);
+        return FAILURE;
+      }
+      std::string name = std::string(impl) + "_" + std::to_string(w);
+
+      r.suite = "write";
+      r.op = name;
+      run_timed(cp.duration_ms, &r, [&](uint64_t op) {
+        values[0] = (T)op;
+        write_array(wire.data(), values.data(), size);
+        codec_sink = wire[0];
+      });
+      report.row(r);
+      r.suite = "read";
+      run_timed(cp.duration_ms, &r, [&](uint64_t op) {
+        wire[0] = (byte)op;
+        read_array(decoded.data(), wire.data(), size);
+        codec_sink = decoded[0];
+      });
+      report.row(r);
+    }
+  }
+  return SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+  codec_params cp;
+  if (parse_codec_params(argc, argv, &cp)) {
+    std::cerr << "Can't parse bench parameters!" << std::endl;
+    return 1;
+  }
+  perf_clock_calibrate();
+
+  FILE *out = NULL;
+  if (cp.output && !(out = fopen(cp.output, "w"))) {
+    fprintf(stderr, "Couldn't open %s\n", cp.output);
+    return 1;
+  }
+  BenchReport report(cp.format, out);
+  const char *dispatched = be_codec_impl();
+  report.note("dispatched codec: %s", dispatched);
+  int ret = run_width<uint32_t>(cp, report, m_write_4_array, m_read_4_array,
+                                m_write_4, m_read_4) ||
+            run_width<uint64_t>(cp, report, m_write_8_array, m_read_8_array,
+                                m_write_8, m_read_8);
+  be_codec_select(dispatched);
+  if (out) {
+    fclose(out);
+  }
+  return ret == SUCCESS ? 0 : 1;
+}
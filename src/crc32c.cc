@@ -0,0 +1,215 @@
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#endif
+
+/* reflected Castagnoli polynomial */
+#define CRC32C_POLY   0x82f63b78
+/* stream lengths of the three-way hardware loop */
+#define CRC32C_LONG   8192
+#define CRC32C_SHORT  256
+
+typedef uint32_t (*crc_fn)(uint32_t crc, const void *data, size_t len);
+
+/********** table **********/
+static uint32_t crc32c_table[8][256];
+
+static void init_crc32c_table() {
+  for (uint32_t n = 0; n < 256; n++) {
+    uint32_t crc = n;
+    for (int k = 0; k < 8; k++) {
+      crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    }
+    crc32c_table[0][n] = crc;
+  }
+  for (uint32_t n = 0; n < 256; n++) {
+    uint32_t crc = crc32c_table[0][n];
+    for (int k = 1; k < 8; k++) {
+      crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+      crc32c_table[k][n] = crc;
+    }
+  }
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const void *data, size_t len) {
+  const uint8_t *next = (const uint8_t *)data;
+
+  crc = ~crc;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (len >= 8) {
+    uint64_t w;
+    memcpy(&w, next, 8);
+    w ^= crc;
+    crc = crc32c_table[7][w & 0xff] ^
+          crc32c_table[6][(w >> 8) & 0xff] ^
+          crc32c_table[5][(w >> 16) & 0xff] ^
+          crc32c_table[4][(w >> 24) & 0xff] ^
+          crc32c_table[3][(w >> 32) & 0xff] ^
+          crc32c_table[2][(w >> 40) & 0xff] ^
+          crc32c_table[1][(w >> 48) & 0xff] ^
+          crc32c_table[0][w >> 56];
+    next += 8;
+    len -= 8;
+  }
+#endif
+  while (len--) {
+    crc = crc32c_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+#if CRC32C_X86
+/********** shift tables **********/
+/* crc(A . B) = shift(crc(A), len(B)) ^ crc(B) when crc(B) starts from 0.
+shift over a fixed length is linear in the crc bits, a 32x32 matrix over
+GF(2), turned into four byte tables for speed */
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec) {
+  uint32_t sum = 0;
+  while (vec) {
+    if (vec & 1) {
+      sum ^= *mat;
+    }
+    vec >>= 1;
+    mat++;
+  }
+  return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat) {
+  for (int n = 0; n < 32; n++) {
+    square[n] = gf2_matrix_times(mat, mat[n]);
+  }
+}
+
+/* operator appending len zero bytes, len is a power of two */
+static void crc32c_zeros_op(uint32_t *even, size_t len) {
+  uint32_t odd[32];
+  uint32_t row = 1;
+
+  /* one zero bit */
+  odd[0] = CRC32C_POLY;
+  for (int n = 1; n < 32; n++) {
+    odd[n] = row;
+    row <<= 1;
+  }
+  gf2_matrix_square(even, odd);  /* two bits */
+  gf2_matrix_square(odd, even);  /* four bits */
+  do {
+    gf2_matrix_square(even, odd);
+    len >>= 1;
+    if (len == 0) {
+      return;
+    }
+    gf2_matrix_square(odd, even);
+    len >>= 1;
+  } while (len);
+  memcpy(even, odd, sizeof(odd));
+}
+
+static void crc32c_zeros(uint32_t zeros[][256], size_t len) {
+  uint32_t op[32];
+
+  crc32c_zeros_op(op, len);
+  for (uint32_t n = 0; n < 256; n++) {
+    zeros[0][n] = gf2_matrix_times(op, n);
+    zeros[1][n] = gf2_matrix_times(op, n << 8);
+    zeros[2][n] = gf2_matrix_times(op, n << 16);
+    zeros[3][n] = gf2_matrix_times(op, n << 24);
+  }
+}
+
+static inline uint32_t crc32c_shift(uint32_t zeros[][256], uint32_t crc) {
+  return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+         zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+/********** sse4.2 **********/
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const void *data, size_t len) {
+  const uint8_t *next = (const uint8_t *)data;
+  uint64_t crc0 = ~crc, crc1, crc2;
+
+  while (len && ((uintptr_t)next & 7)) {
+    crc0 = _mm_crc32_u8((uint32_t)crc0, *next++);
+    len--;
+  }
+
+  /* three independent streams keep the crc32 unit busy */
+  while (len >= CRC32C_LONG * 3) {
+    const uint8_t *end = next + CRC32C_LONG;
+    crc1 = 0;
+    crc2 = 0;
+    do {
+      crc0 = _mm_crc32_u64(crc0, *(const uint64_t *)next);
+      crc1 = _mm_crc32_u64(crc1, *(const uint64_t *)(next + CRC32C_LONG));
+      crc2 = _mm_crc32_u64(crc2, *(const uint64_t *)(next + CRC32C_LONG * 2));
+      next += 8;
+    } while (next < end);
+    crc0 = crc32c_shift(crc32c_long, (uint32_t)crc0) ^ crc1;
+    crc0 = crc32c_shift(crc32c_long, (uint32_t)crc0) ^ crc2;
+    next += CRC32C_LONG * 2;
+    len -= CRC32C_LONG * 3;
+  }
+  while (len >= CRC32C_SHORT * 3) {
+    const uint8_t *end = next + CRC32C_SHORT;
+    crc1 = 0;
+    crc2 = 0;
+    do {
+      crc0 = _mm_crc32_u64(crc0, *(const uint64_t *)next);
+      crc1 = _mm_crc32_u64(crc1, *(const uint64_t *)(next + CRC32C_SHORT));
+      crc2 = _mm_crc32_u64(crc2, *(const uint64_t *)(next + CRC32C_SHORT * 2));
+      next += 8;
+    } while (next < end);
+    crc0 = crc32c_shift(crc32c_short, (uint32_t)crc0) ^ crc1;
+    crc0 = crc32c_shift(crc32c_short, (uint32_t)crc0) ^ crc2;
+    next += CRC32C_SHORT * 2;
+    len -= CRC32C_SHORT * 3;
+  }
+
+  while (len >= 8) {
+    crc0 = _mm_crc32_u64(crc0, *(const uint64_t *)next);
+    next += 8;
+    len -= 8;
+  }
+  while (len--) {
+    crc0 = _mm_crc32_u8((uint32_t)crc0, *next++);
+  }
+  return ~(uint32_t)crc0;
+}
+#endif
+
+/********** dispatch **********/
+struct crc_impl {
+  crc_fn      fn;
+  const char  *name;
+};
+
+static crc_impl pick_crc_impl() {
+  init_crc32c_table();
+#if CRC32C_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc32c_zeros(crc32c_long, CRC32C_LONG);
+    crc32c_zeros(crc32c_short, CRC32C_SHORT);
+    return {crc32c_hw, "sse4.2"};
+  }
+#endif
+  return {crc32c_sw, "table"};
+}
+
+static const crc_impl crc_func = pick_crc_impl();
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+  return crc_func.fn(crc, data, len);
+}
+
+const char *crc32c_impl() {
+  return crc_func.name;
+}
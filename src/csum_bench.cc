@@ -0,0 +1,255 @@
+#include <getopt.h>
+#include <netinet/ip.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "bench_util.h"
+#include "inet_checksum.h"
+
+/* Compares the Internet checksum of lib/perf, which the raw ethernet
+packets are built with, to the word at a time loop it replaced, and the
+RFC 1624 update of a header field to recomputing the whole header.
+
+  csumbench [<bench options>]
+
+  -b, --sizes     buffer sizes, "20,64,4096" or "64:65536"
+                  (default 20,64,256,1500,9000)
+  -d, --duration  milliseconds per configuration (default 200)
+  -f, --format    csv (default) or json, one line per configuration
+  -w, --output    file instead of stdout
+
+The csum suite has one row per implementation and size, op is legacy
+or one of the inet_csum_impl names the cpu can run. Sizes under
+INET_CSUM_VECTOR_MIN only get the scalar row, the vector ones would
+time the same loop. The ipv4 suite rewrites the destination address of
+a 20 byte header per op, full recomputes the checksum with
+inet_csum_ipv4 and incremental patches it with inet_csum_replace4.
+Every routine is checked against the legacy loop before it is timed. */
+
+/* ops between two clock reads */
+#define CSUM_BATCH  256
+
+static struct option csum_options[] = {
+  { name : "sizes",     has_arg : 1, flag : NULL, val : 'b' },
+  { name : "duration",  has_arg : 1, flag : NULL, val : 'd' },
+  { name : "format",    has_arg : 1, flag : NULL, val : 'f' },
+  { name : "output",    has_arg : 1, flag : NULL, val : 'w' },
+  {0}
+};
+
+struct csum_params {
+  std::vector<uint32_t> sizes;
+  int                   duration_ms;
+  bench_format          format;
+  const char            *output;
+};
+
+static int16_t parse_csum_params(int argc, char *argv[], csum_params *cp) {
+  parse_size_list("20,64,256,1500,9000", cp->sizes);
+  cp->duration_ms = 200;
+  cp->format = BENCH_CSV;
+  cp->output = NULL;
+
+  while (1) {
+    int ch = getopt_long(argc, argv, "b:d:f:w:", csum_options, NULL);
+    if (ch == -1) {
+      break;
+    }
+    switch (ch) {
+      case 'b': {
+        if (!parse_size_list(optarg, cp->sizes)) {
+          fprintf(stderr, "Bad size list %s\n", optarg);
+          return FAILURE;
+        }
+      } break;
+      case 'd': {
+        cp->duration_ms = atoi(optarg);
+        if (cp->duration_ms <= 0) {
+          fprintf(stderr, "Duration must be positive\n");
+          return FAILURE;
+        }
+      } break;
+      case 'f': {
+        if (!parse_format(optarg, &cp->format)) {
+          fprintf(stderr, "Format is csv or json\n");
+          return FAILURE;
+        }
+      } break;
+      case 'w': { cp->output = optarg; } break;
+    default:
+      return FAILURE;
+      break;
+    }
+  }
+  return SUCCESS;
+}
+
+/* the routine raw_ethernet_resources.c used, an odd last byte is dropped */
+static uint16_t legacy_checksum(const void *buf, size_t hdr_len) {
+  unsigned long sum = 0;
+  const uint16_t *ip1 = (const uint16_t *)buf;
+  while (hdr_len > 1) {
+    sum += *ip1++;
+    if (sum & 0x80000000)
+      sum = (sum & 0xFFFF) + (sum >> 16);
+    hdr_len -= 2;
+  }
+  while (sum >> 16)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  return (uint16_t)~sum;
+}
+
+/* calls fn with the op number until duration_ms passed */
+template <typename F>
+static void run_timed(int duration_ms, bench_result *r, F fn) {
+  uint64_t ops = 0;
+  uint64_t start = now_ns(), now;
+  uint64_t deadline = start + (uint64_t)duration_ms * 1000000;
+  do {
+    for (int i = 0; i < CSUM_BATCH; i++) {
+      fn(ops + i);
+    }
+    ops += CSUM_BATCH;
+    now = now_ns();
+  } while (now < deadline);
+  r->ops = ops;
+  r->seconds = (now - start) / 1e9;
+}
+
+/* keeps the compiler from dropping the checksums */
+static volatile uint16_t csum_sink;
+
+static int16_t run_csum_suite(const csum_params &cp, BenchReport &report) {
+  static const char *impls[] = {"scalar", "sse2", "avx2"};
+  const char *dispatched = inet_csum_impl();
+  bench_result r;
+  r.suite = "csum";
+  r.depth = r.threads = r.conns = 1;
+  r.errors = 0;
+  r.target_kops = 0;
+  r.lat = NULL;
+
+  for (uint32_t size : cp.sizes) {
+    /* size + 2 keeps room for the op number written at the front */
+    std::vector<uint8_t> buf(size + 2);
+    for (auto &b : buf) {
+      b = rand();
+    }
+    uint8_t *p = buf.data();
+    uint16_t *front = (uint16_t *)p;
+    r.size = size;
+
+    r.op = "legacy";
+    run_timed(cp.duration_ms, &r, [&](uint64_t op) {
+      *front = (uint16_t)op;
+      csum_sink = legacy_checksum(p, size);
+    });
+    report.row(r);
+
+    for (const char *impl : impls) {
+      /* below INET_CSUM_VECTOR_MIN every impl runs the scalar loop */
+      if ((size < INET_CSUM_VECTOR_MIN && strcmp(impl, "scalar")) ||
+          inet_csum_select(impl)) {
+        continue;
+      }
+      /* legacy can't sum an odd tail, compare the even part */
+      *front = 0;
+      if (inet_checksum(p, size & ~1u) != legacy_checksum(p, size & ~1u)) {
+        fprintf(stderr, "%s checksum of %u bytes differs from legacy\n", impl, size);
+        return FAILURE;
+      }
+      r.op = impl;
+      run_timed(cp.duration_ms, &r, [&](uint64_t op) {
+        *front = (uint16_t)op;
+        csum_sink = inet_checksum(p, size);
+      });
+      report.row(r);
+    }
+  }
+  inet_csum_select(dispatched);
+  return SUCCESS;
+}
+
+static int16_t run_ipv4_suite(const csum_params &cp, BenchReport &report) {
+  struct iphdr hdr;
+  bench_result r;
+  r.suite = "ipv4";
+  r.size = sizeof(hdr);
+  r.depth = r.threads = r.conns = 1;
+  r.errors = 0;
+  r.target_kops = 0;
+  r.lat = NULL;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.version = 4;
+  hdr.ihl = 5;
+  hdr.tot_len = htons(1024);
+  hdr.ttl = 64;
+  hdr.protocol = IPPROTO_UDP;
+  hdr.saddr = htonl(0x0a000001);
+  hdr.daddr = htonl(0x0a000002);
+  hdr.check = inet_checksum(&hdr, sizeof(hdr));
+
+  /* a few thousand flows worth of rewrites must land where a full
+  recompute does */
+  for (uint32_t i = 0; i < 4096; i++) {
+    uint32_t daddr = htonl(0x0a000002 + i * 7919);
+    uint16_t check = inet_csum_replace4(hdr.check, hdr.daddr, daddr);
+    hdr.daddr = daddr;
+    hdr.check = 0;
+    hdr.check = inet_checksum(&hdr, sizeof(hdr));
+    if (check != hdr.check || inet_csum_ipv4(&hdr) != 0 ||
+        legacy_checksum(&hdr, sizeof(hdr)) != 0) {
+      fprintf(stderr, "incremental checksum differs for daddr %08x\n", ntohl(daddr));
+      return FAILURE;
+    }
+  }
+
+  r.op = "legacy";
+  run_timed(cp.duration_ms, &r, [&](uint64_t op) {
+    hdr.daddr = (uint32_t)op;
+    hdr.check = 0;
+    hdr.check = legacy_checksum(&hdr, sizeof(hdr));
+  });
+  report.row(r);
+
+  r.op = "full";
+  run_timed(cp.duration_ms, &r, [&](uint64_t op) {
+    hdr.daddr = (uint32_t)op;
+    hdr.check = 0;
+    hdr.check = inet_csum_ipv4(&hdr);
+  });
+  report.row(r);
+
+  r.op = "incremental";
+  run_timed(cp.duration_ms, &r, [&](uint64_t op) {
+    hdr.check = inet_csum_replace4(hdr.check, hdr.daddr, (uint32_t)op);
+    hdr.daddr = (uint32_t)op;
+  });
+  report.row(r);
+  csum_sink = hdr.check;
+  return SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+  csum_params cp;
+  if (parse_csum_params(argc, argv, &cp)) {
+    std::cerr << "Can't parse bench parameters!" << std::endl;
+    return 1;
+  }
+  perf_clock_calibrate();
+
+  FILE *out = NULL;
+  if (cp.output && !(out = fopen(cp.output, "w"))) {
+    fprintf(stderr, "Couldn't open %s\n", cp.output);
+    return 1;
+  }
+  BenchReport report(cp.format, out);
+  report.note("dispatched checksum: %s", inet_csum_impl());
+  int ret = run_csum_suite(cp, report) || run_ipv4_suite(cp, report);
+  if (out) {
+    fclose(out);
+  }
+  return ret == SUCCESS ? 0 : 1;
+}
@@ -0,0 +1,131 @@
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "bench_util.h"
+
+/* Throughput against the number of rdma ops kept in flight. The server
+pins a block and idles, the client reads and writes it with a window of
+1, 2, 4 .. tx_depth ops. Reads stop scaling at the negotiated
+outstanding reads, writes at what the link takes. */
+
+#define DEPTH_BENCH_SIZE   (64 * 1024)
+#define DEPTH_BENCH_ITERS  4096
+
+/* keep depth ops in flight until iters completed, seconds taken */
+static double run_window(ConnectionProc *conn, bool read, rdma_mem_info &base,
+                         int depth, int iters) {
+  /* each slot has at most one op in flight */
+  std::vector<rdma_request> reqs(depth);
+  std::vector<bool> busy(depth, false);
+  int posted = 0, done = 0, inflight = 0;
+  bool failed = false;
+
+  uint64_t start = now_ns();
+  /* on a failure stop posting but reap every busy slot, the cq thread
+  still writes to reqs until then */
+  while ((done < iters && !failed) || inflight > 0) {
+    for (int i = 0; i < depth; i++) {
+      if (busy[i]) {
+        if (reqs[i].pending.load(std::memory_order_acquire) > 0) {
+          continue;
+        }
+        if (reqs[i].failed.load()) {
+          failed = true;
+        }
+        busy[i] = false;
+        inflight--;
+        done++;
+      }
+      if (posted < iters && !failed) {
+        rdma_mem_info info = base;
+        info.req = &reqs[i];
+        busy[i] = true;
+        inflight++;
+        if (read ? conn->rdma_read(info) : conn->rdma_write(info)) {
+          /* a half posted stripe still completes on reqs[i] */
+          reqs[i].failed.store(true);
+          continue;
+        }
+        posted++;
+      }
+    }
+  }
+  if (failed) {
+    return -1;
+  }
+  return (now_ns() - start) / 1e9;
+}
+
+static int run_sweep(ConnectionProc *conn, int tx_depth) {
+  rdma_mem_info info;
+  uint64_t local_voff;
+
+  if (conn->pin_memory((ibv_access_flags)IBV_ACCESS_LOCAL_WRITE,
+                       FIX_BLOCK_LENGTH, &local_voff)) {
+    fprintf(stderr, "Couldn't pin the local block\n");
+    return FAILURE;
+  }
+  memset(&info, 0, sizeof(info));
+  info.length = DEPTH_BENCH_SIZE;
+  /* the server's block is the first one it pinned */
+  while (conn->lookup_remote_mr(0, info)) {
+    if (!conn->is_alive()) {
+      return FAILURE;
+    }
+  }
+  info.local_address = (uint64_t)conn->get_mem_magr()->get_local_address(local_voff);
+  info.src_mr = conn->get_mem_magr()->get_pinned_mr(local_voff, FIX_BLOCK_LENGTH);
+
+  printf("# outstanding reads %d, %d byte ops\n", conn->get_out_reads(),
+         DEPTH_BENCH_SIZE);
+  printf("%-6s %-6s %12s %12s\n", "op", "depth", "MB/s", "Kops/s");
+  for (int read = 1; read >= 0; read--) {
+    for (int depth = 1; depth <= tx_depth; depth *= 2) {
+      double sec = run_window(conn, read, info, depth, DEPTH_BENCH_ITERS);
+      if (sec < 0) {
+        fprintf(stderr, "%s failed at depth %d\n", read ? "read" : "write", depth);
+        return FAILURE;
+      }
+      printf("%-6s %-6d %12.2f %12.2f\n", read ? "read" : "write", depth,
+             (double)DEPTH_BENCH_SIZE * DEPTH_BENCH_ITERS / sec / 1e6,
+             DEPTH_BENCH_ITERS / sec / 1e3);
+    }
+  }
+  return SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+  EnvironmentProc    user_env;
+  if (user_env.parse_params(argc, argv)) {
+    std::cerr << "Can't parse input parameters!" << std::endl;
+    return 1;
+  }
+  if (user_env.check_env()) {
+    std::cerr << "Checking enviroment fail!" << std::endl;
+    return 1;
+  }
+
+  ConnectionProc *conn = bench_connect(&user_env);
+  if (conn == nullptr) {
+    std::cerr << "Connection failed!" << std::endl;
+    return 1;
+  }
+
+  if (user_env.is_server()) {
+    if (conn->pin_memory((ibv_access_flags)(IBV_ACCESS_LOCAL_WRITE |
+                                            IBV_ACCESS_REMOTE_READ |
+                                            IBV_ACCESS_REMOTE_WRITE))) {
+      fprintf(stderr, "Couldn't pin the target block\n");
+      return 1;
+    }
+    while (conn->is_alive()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return 0;
+  }
+
+  int ret = run_sweep(conn, user_env.get_params()->tx_depth);
+  conn->stop();
+  return ret == SUCCESS ? 0 : 1;
+}
@@ -1,8 +1,10 @@
 #include <assert.h>
 #include <getopt.h>
+#include <sched.h>
 
 #include "env_basic.h"
 #include "rdma_com.h"
+#include "rdma_channel.h"
 
 static const char *portStates[] = {"Nop", "Down", "Init", "Armed", "", "Active Defer"};
 static const struct option long_options[] = {
@@ -14,6 +16,14 @@ static const struct option long_options[] = {
   { name : "source_port",  has_arg : 1, flag : NULL, val : 'k' },
   { name : "server",  has_arg : 0, flag : NULL, val : 'Z' },
   { name : "client",  has_arg : 0, flag : NULL, val : 'P' },
+  { name : "qp",  has_arg : 1, flag : NULL, val : 'q' },
+  { name : "tx-depth",  has_arg : 1, flag : NULL, val : 't' },
+  { name : "rx-depth",  has_arg : 1, flag : NULL, val : 'r' },
+  { name : "mtu",  has_arg : 1, flag : NULL, val : 'm' },
+  { name : "outs",  has_arg : 1, flag : NULL, val : 'o' },
+  { name : "odp",  has_arg : 0, flag : NULL, val : 'O' },
+  { name : "odp-implicit",  has_arg : 0, flag : NULL, val : 'I' },
+  { name : "dm-limit",  has_arg : 1, flag : NULL, val : 'D' },
   {0}
 };
 
@@ -26,13 +36,43 @@ void EnvironmentProc::init_env_params() {
   env_params.machine = SERVER;
 
   env_params.cache_line_size = DEF_CACHE_LINE_SIZE;
+  env_params.num_of_qps = DEF_NUM_QPS;
+
+  env_params.tx_depth = DEF_TX_BW;
+  env_params.rx_depth = DEF_TX_BW;
+  env_params.mtu = 0;
+  env_params.out_reads = 0;
+  env_params.mem_reg_mode = MEM_REG_PINNED;
+  env_params.dm_limit = -1;
+}
+
+/* the device caps both ends of rdma cm's initiator_depth and
+responder_resources, see ctx_set_out_reads in perftest */
+static int set_out_reads(ibv_context *context, int num_user_reads) {
+  int max_reads = 0;
+  ibv_device_attr attr;
+
+  if (!ibv_query_device(context, &attr)) {
+    max_reads = std::min(attr.max_qp_rd_atom, attr.max_qp_init_rd_atom);
+  }
+  /* rdma_conn_param carries them in a byte */
+  max_reads = std::min(max_reads, (int)UINT8_MAX);
+
+  if (num_user_reads > max_reads) {
+    fprintf(stderr, " Number of outstanding reads is above max = %d\n", max_reads);
+    fprintf(stderr, " Changing to that max value\n");
+    num_user_reads = max_reads;
+  } else if (num_user_reads <= 0) {
+    num_user_reads = max_reads;
+  }
+  return num_user_reads;
 }
 
 int16_t EnvironmentProc::parse_params(int16_t argc, char *argv[]) {
   int ch;
   char *not_int_ptr = NULL;
   while (1) {
-    ch = getopt_long(argc, argv, "p:d:i:c:J:j:K:k:ZP", long_options, NULL);
+    ch = getopt_long(argc, argv, "p:d:i:c:J:j:K:k:ZPq:t:r:m:o:OID:", long_options, NULL);
 
     if (ch == -1) {
       break;
@@ -53,6 +93,20 @@ int16_t EnvironmentProc::parse_params(int16_t argc, char *argv[]) {
       case 'k': {} break;
       case 'Z': { env_params.machine = SERVER; } break;
       case 'P': { env_params.machine = CLIENT; }  break;
+      case 'q': {
+        CHECK_VALUE(env_params.num_of_qps, int, "num of QPs", not_int_ptr);
+        if (env_params.num_of_qps < 1 || env_params.num_of_qps > RDMA_MAX_QPS) {
+          fprintf(stderr, "num of QPs must be in [1, %d]\n", RDMA_MAX_QPS);
+          return FAILURE;
+        }
+      } break;
+      case 't': { CHECK_VALUE_POSITIVE(env_params.tx_depth, int, "Tx depth", not_int_ptr); } break;
+      case 'r': { CHECK_VALUE_POSITIVE(env_params.rx_depth, int, "Rx depth", not_int_ptr); } break;
+      case 'm': { CHECK_VALUE_NON_NEGATIVE(env_params.mtu, int, "MTU", not_int_ptr); } break;
+      case 'o': { CHECK_VALUE_NON_NEGATIVE(env_params.out_reads, int, "Outstanding reads", not_int_ptr); } break;
+      case 'O': { env_params.mem_reg_mode = MEM_REG_ODP; } break;
+      case 'I': { env_params.mem_reg_mode = MEM_REG_IMPLICIT_ODP; } break;
+      case 'D': { CHECK_VALUE_NON_NEGATIVE(env_params.dm_limit, int64_t, "Device memory limit", not_int_ptr); } break;
     default:
       return FAILURE;
       break;
@@ -63,6 +117,9 @@ int16_t EnvironmentProc::parse_params(int16_t argc, char *argv[]) {
 }
 
 int16_t EnvironmentProc::check_env() {
+  /* now_ns falls back to clock_gettime if the counter is unusable */
+  perf_clock_calibrate();
+
   ibv_device *ib_dev = ctx_find_dev(&env_params.ib_devname);
   if (!ib_dev) {
     std::cerr << "Unable to find the Infiniband/RoCE device!" << std::endl;
@@ -100,6 +157,9 @@ int16_t EnvironmentProc::check_env() {
     return FAILURE;
   }
 
+  env_params.curr_mtu = set_mtu(env_context, env_params.ib_port, env_params.mtu);
+  env_params.out_reads = set_out_reads(env_context, env_params.out_reads);
+
   return SUCCESS;
 }
 
@@ -122,8 +182,9 @@ static void *poll_cq(void *ctx) {
       assert(false);
     }
 
+    /* the cq belongs to one connection, wr_id identifies the request */
+    ConnectionProc *conn = static_cast<ConnectionProc *>(ev_ctx);
     while ((num_comp = ibv_poll_cq(ev_cq, 1, &wc)) > 0){
-        ConnectionProc *conn = (ConnectionProc *)(uintptr_t)wc.wr_id;
         conn->on_completion(&wc);
     }
     if (num_comp < 0){
@@ -136,25 +197,68 @@ static void *poll_cq(void *ctx) {
   return NULL;
 }
 
+bool ConnectionProc::is_meta_slot(uint64_t wr_id) {
+  uint64_t recv = (uint64_t)conn_ctx.meta_recv;
+
+  return (wr_id >= recv &&
+          wr_id < recv + sizeof(MetaMessage) * conn_params.wr_cq_number) ||
+         is_meta_send_slot(wr_id);
+}
+
+bool ConnectionProc::is_meta_send_slot(uint64_t wr_id) {
+  uint64_t send = (uint64_t)conn_ctx.meta_send;
+
+  return wr_id >= send && wr_id < send + sizeof(MetaMessage) * META_SEND_DEPTH;
+}
+
 void ConnectionProc::on_completion(ibv_wc *wc) {
   // TODO mzy: local completion callback
   if (wc->status != IBV_WC_SUCCESS){
     fprintf(stderr, " error wc status %d\n", wc->status);
+    metrics.errors.add();
+    /* opcode is undefined on error, release the waiter by wr_id */
+    if (is_meta_send_slot(wc->wr_id)) {
+      /* flushed or failed, the slot is free all the same */
+      conn_ctx.meta_send_inflight.fetch_sub(1);
+    } else if (wc->wr_id && !is_meta_slot(wc->wr_id)) {
+      rdma_request *req = (rdma_request *)(uintptr_t)wc->wr_id;
+      req->failed.store(true);
+      req->pending.fetch_sub(1, std::memory_order_release);
+      /* flushed unsignaled wrs complete here too, never counted in
+      signaled, only a req tells a signaled wr apart */
+      metrics.completed.add();
+    }
     return;
   }
 
   switch (wc->opcode) {
   case IBV_WC_RECV: {
-    fprintf(stdout, "wc opcode IBV_WC_RECV\n");
-
+    MetaMessage *msg = (MetaMessage *)(uintptr_t)wc->wr_id;
+    on_meta_message(msg);
+    post_meta_recv_wr(msg);
+  } break;
+  case IBV_WC_SEND: {
+    /* the meta send slot can be reused */
+    conn_ctx.meta_send_inflight.fetch_sub(1);
   } break;
   case IBV_WC_RECV_RDMA_WITH_IMM: {
-    fprintf(stdout, "wc opcode IBV_WC_RECV_RDMA_WITH_IMM\n");
-
+    /* frames are consumed in place before the recv slot is reposted */
+    if (msg_channel) {
+      msg_channel->on_imm(ntohl(wc->imm_data));
+    } else {
+      fprintf(stderr, "write with imm but no message channel\n");
+    }
+    post_meta_recv_wr((MetaMessage *)(uintptr_t)wc->wr_id);
   } break;
-  case IBV_WC_RDMA_READ: {
-    fprintf(stdout, "wc opcode IBV_WC_RDMA_READ\n");
-
+  case IBV_WC_RDMA_READ:
+  case IBV_WC_RDMA_WRITE:
+  case IBV_WC_COMP_SWAP:
+  case IBV_WC_FETCH_ADD: {
+    rdma_request *req = (rdma_request *)(uintptr_t)wc->wr_id;
+    if (req) {
+      req->pending.fetch_sub(1, std::memory_order_release);
+    }
+    metrics.completed.add();
   } break;
   default:
     fprintf(stdout, "unprocessed wc opcode %d\n", wc->opcode);
@@ -162,43 +266,107 @@ void ConnectionProc::on_completion(ibv_wc *wc) {
   }
 }
 
+void ConnectionProc::on_meta_message(MetaMessage *msg) {
+  switch (msg->type) {
+  case MetaMessage::META_RECV_MR: {
+    assert(msg->count <= META_MAX_REGIONS);
+    remote_mem.update(msg->data.regions, msg->count, msg->reset != 0);
+  } break;
+  case MetaMessage::META_RECV_RING: {
+    remote_ring = msg->data.ring;
+    remote_ring_ready.store(true, std::memory_order_release);
+  } break;
+  case MetaMessage::META_RECV_QP: {
+    assert(msg->count <= RDMA_MAX_QPS);
+    {
+      /* the peer was established first, nothing may be sent before we
+      are, on_established connects them */
+      std::lock_guard<std::mutex> lock(conn_ctx.meta_mutex);
+      if (!conn_params.connected) {
+        memcpy(conn_ctx.peer_qps, msg->data.qps, msg->count * sizeof(qp_desc));
+        conn_ctx.peer_qps_num = msg->count;
+        break;
+      }
+    }
+    if (connect_qps(msg->data.qps, msg->count)) {
+      fprintf(stderr, "connecting extra QPs failed, staying on one\n");
+    }
+  } break;
+  case MetaMessage::META_RECV_QP_READY: {
+    /* the peer's lanes are rts against ours, which may not be yet */
+    std::lock_guard<std::mutex> lock(conn_ctx.meta_mutex);
+    conn_ctx.qps_peer_ready = true;
+    update_qps_ready();
+  } break;
+  default:
+    fprintf(stdout, "unprocessed meta type %d\n", msg->type);
+    break;
+  }
+}
+
 void ConnectionProc::register_message_memory() {
-  /* Meta Message */
-  conn_ctx.meta_send = (MetaMessage *)malloc(sizeof(MetaMessage));
-  conn_ctx.meta_recv = (MetaMessage *)malloc(sizeof(MetaMessage));
-  conn_ctx.meta_send_mr = ibv_reg_mr(conn_ctx.pd, conn_ctx.meta_send, sizeof(MetaMessage), 0);
-  conn_ctx.meta_recv_mr = ibv_reg_mr(conn_ctx.pd, conn_ctx.meta_recv, sizeof(MetaMessage), IBV_ACCESS_LOCAL_WRITE);
+  /* Meta Message, one recv slot for each posted recv wr */
+  size_t recv_len = sizeof(MetaMessage) * conn_params.wr_cq_number;
+  size_t send_len = sizeof(MetaMessage) * META_SEND_DEPTH;
+
+  conn_ctx.meta_send = (MetaMessage *)malloc(send_len);
+  conn_ctx.meta_recv = (MetaMessage *)malloc(recv_len);
+  conn_ctx.meta_send_mr = ibv_reg_mr(conn_ctx.pd, conn_ctx.meta_send, send_len, 0);
+  conn_ctx.meta_recv_mr = ibv_reg_mr(conn_ctx.pd, conn_ctx.meta_recv, recv_len, IBV_ACCESS_LOCAL_WRITE);
+  conn_ctx.meta_send_next = 0;
+  conn_ctx.meta_send_inflight.store(0);
 }
 
-int16_t ConnectionProc::post_meta_recv_wr() {
+int16_t ConnectionProc::post_meta_recv_wr(MetaMessage *msg) {
 	ibv_recv_wr wr;
 	ibv_recv_wr *bad_wr;
 	ibv_sge list;
 
-	list.addr   = (uint64_t)conn_ctx.meta_recv;
+	list.addr   = (uint64_t)msg;
 	list.length = sizeof(MetaMessage);
 	list.lkey   = conn_ctx.meta_recv_mr->lkey;
 
 	wr.next = NULL;
-	wr.wr_id = (uint64_t)this;
+	wr.wr_id = (uint64_t)msg;
 	wr.sg_list = &list;
 	wr.num_sge = 1;
 
 	return ibv_post_recv(conn_ctx.qp, &wr, &bad_wr);
 }
 
-int16_t ConnectionProc::post_meta_send_wr() {
+MetaMessage *ConnectionProc::get_meta_send_slot(
+    std::unique_lock<std::mutex> &lock) {
+  /* signaled sends complete in order, so once fewer than META_SEND_DEPTH
+  are in flight the oldest slot is free again. The completions come from
+  the poller, which sends meta messages itself: wait with meta_mutex
+  released, and never on the poller */
+  while (conn_ctx.meta_send_inflight.load() >= META_SEND_DEPTH) {
+    if (!is_alive() || (conn_ctx.cq_poller_running &&
+        pthread_equal(pthread_self(), conn_ctx.cq_poller_thread))) {
+      return NULL;
+    }
+    lock.unlock();
+    sched_yield();
+    lock.lock();
+  }
+
+  MetaMessage *msg = conn_ctx.meta_send + conn_ctx.meta_send_next;
+  conn_ctx.meta_send_next = (conn_ctx.meta_send_next + 1) % META_SEND_DEPTH;
+  return msg;
+}
+
+int16_t ConnectionProc::post_meta_send_wr(MetaMessage *msg) {
   ibv_send_wr wr;
   ibv_send_wr *bad_wr;
   ibv_sge list;
 
   memset(&wr, 0, sizeof(wr));
 
-	list.addr   = (uint64_t)conn_ctx.meta_send;
+	list.addr   = (uint64_t)msg;
 	list.length = sizeof(MetaMessage);
 	list.lkey   = conn_ctx.meta_send_mr->lkey;
 
-  wr.wr_id = (uint64_t)this;
+  wr.wr_id = (uint64_t)msg;
   wr.opcode = IBV_WR_SEND;
   wr.sg_list = &list;
   wr.num_sge = 1;
@@ -210,21 +378,65 @@ int16_t ConnectionProc::post_meta_send_wr() {
 
   assert (conn_params.connected);
 
-  return ibv_post_send(conn_ctx.qp, &wr, &bad_wr);
+  conn_ctx.meta_send_inflight.fetch_add(1);
+  if (ibv_post_send(conn_ctx.qp, &wr, &bad_wr)) {
+    conn_ctx.meta_send_inflight.fetch_sub(1);
+    return FAILURE;
+  }
+  return SUCCESS;
 }
 
 void ConnectionProc::destroy_connection() {
 
-  rdma_destroy_qp(conn_ctx.cm_id);
+  for (int i = 1; i < conn_params.num_of_qps; i++) {
+    if (conn_ctx.qps[i]) {
+      ibv_destroy_qp(conn_ctx.qps[i]);
+      conn_ctx.qps[i] = NULL;
+    }
+  }
+  if (conn_ctx.qp) {
+    rdma_destroy_qp(conn_ctx.cm_id);
+    conn_ctx.qp = NULL;
+  }
 
-  ibv_dereg_mr(conn_ctx.meta_send_mr);
-  ibv_dereg_mr(conn_ctx.meta_recv_mr);
+  /* a connection that failed half way has not registered them */
+  if (conn_ctx.meta_send_mr) {
+    ibv_dereg_mr(conn_ctx.meta_send_mr);
+    conn_ctx.meta_send_mr = NULL;
+  }
+  if (conn_ctx.meta_recv_mr) {
+    ibv_dereg_mr(conn_ctx.meta_recv_mr);
+    conn_ctx.meta_recv_mr = NULL;
+  }
 
   free(conn_ctx.meta_send);
   free(conn_ctx.meta_recv);
+  conn_ctx.meta_send = NULL;
+  conn_ctx.meta_recv = NULL;
 
 
   rdma_destroy_id(conn_ctx.cm_id);
+  conn_ctx.cm_id = NULL;
+}
+
+void ConnectionProc::release() {
+  if (conn_ctx.cq_poller_running) {
+    /* it blocks in ibv_get_cq_event, a cancellation point */
+    pthread_cancel(conn_ctx.cq_poller_thread);
+    pthread_join(conn_ctx.cq_poller_thread, NULL);
+    conn_ctx.cq_poller_running = false;
+  }
+  if (conn_ctx.cm_id) {
+    destroy_connection();
+  }
+  if (conn_ctx.cq) {
+    ibv_destroy_cq(conn_ctx.cq);
+    conn_ctx.cq = NULL;
+  }
+  if (conn_ctx.comp_channel) {
+    ibv_destroy_comp_channel(conn_ctx.comp_channel);
+    conn_ctx.comp_channel = NULL;
+  }
 }
 
 int16_t ConnectionProc::build_connection(rdma_cm_id *id) {
@@ -237,14 +449,25 @@ int16_t ConnectionProc::build_connection(rdma_cm_id *id) {
   }
 
   conn_ctx.pd = ibv_alloc_pd(conn_ctx.context);
+  if (!local_mem.set_reg_mode(conn_ctx.pd,
+                              (mem_reg_mode)conn_params.env->mem_reg_mode)) {
+    fprintf(stderr, "Falling back to pinned memory registration\n");
+  }
+  if (conn_params.env->dm_limit >= 0) {
+    local_mem.set_dm_limit(conn_params.env->dm_limit);
+  }
   conn_ctx.comp_channel = ibv_create_comp_channel(conn_ctx.context);
-  conn_ctx.cq = ibv_create_cq(conn_ctx.context, conn_params.wr_cq_number,
-                              NULL, conn_ctx.comp_channel, 0);
+  /* send queues of every qp and the recv queue of the first share it */
+  conn_ctx.cq = ibv_create_cq(conn_ctx.context,
+                              conn_params.tx_depth * conn_params.num_of_qps +
+                              conn_params.wr_cq_number,
+                              this, conn_ctx.comp_channel, 0);
 
   ibv_req_notify_cq(conn_ctx.cq, 0);
 
   /* 2. create complete queue polling thread */
-  pthread_create(&conn_ctx.cq_poller_thread, NULL, poll_cq, &conn_ctx);
+  conn_ctx.cq_poller_running =
+      pthread_create(&conn_ctx.cq_poller_thread, NULL, poll_cq, &conn_ctx) == 0;
 
   /* 3. build attributed queue pair */
   ibv_qp_init_attr qp_attr;
@@ -254,16 +477,18 @@ int16_t ConnectionProc::build_connection(rdma_cm_id *id) {
   qp_attr.recv_cq = conn_ctx.cq;
   qp_attr.qp_type = IBV_QPT_RC;
 
-  qp_attr.cap.max_send_wr = conn_params.wr_cq_number;
+  qp_attr.cap.max_send_wr = conn_params.tx_depth;
   qp_attr.cap.max_recv_wr = conn_params.wr_cq_number;
   qp_attr.cap.max_send_sge = 1;
   qp_attr.cap.max_recv_sge = 1;
+  qp_attr.cap.max_inline_data = RDMA_MAX_INLINE_DATA;
 
   qp_attr.sq_sig_all = 0;
 
   if (rdma_create_qp(id, conn_ctx.pd, &qp_attr)) {
     return FAILURE;
   }
+  conn_params.max_inline_data = qp_attr.cap.max_inline_data;
 
   /* 4. set connection context and meta mr */
   id->context = this;
@@ -271,11 +496,15 @@ int16_t ConnectionProc::build_connection(rdma_cm_id *id) {
   conn_ctx.qp = id->qp;
   conn_params.connected = 0;
 
+  if (create_extra_qps(qp_attr)) {
+    return FAILURE;
+  }
+
   register_message_memory();
 
   /* 5. prepare full recv wr for meta */
   for (int32_t i = 0; i < conn_params.wr_cq_number; ++i) {
-    post_meta_recv_wr();
+    post_meta_recv_wr(conn_ctx.meta_recv + i);
   }
 
   /* other meta in class */
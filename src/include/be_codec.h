@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "env_basic.h"
+
+/* Batch big-endian codec for header fields packed in arrays. Encoding
+and decoding are the same byte swap of every 4 or 8 byte lane, done 32
+bytes at a time with AVX2, 16 with SSSE3 pshufb or one lane at a time
+otherwise. The instruction set is picked at load time from cpuid, so
+the build needs no -m flags. Buffers may be unaligned, src and dst may
+be the same but must not overlap otherwise. */
+
+/* num host values to big-endian bytes */
+void m_write_4_array(byte *dst, const uint32_t *src, size_t num);
+void m_write_8_array(byte *dst, const uint64_t *src, size_t num);
+/* num big-endian values to host order */
+void m_read_4_array(uint32_t *dst, const byte *src, size_t num);
+void m_read_8_array(uint64_t *dst, const byte *src, size_t num);
+
+/* "avx2", "ssse3" or "scalar" */
+const char *be_codec_impl();
+/* forces one of the above for every thread, for comparing them,
+1 when the cpu can't run it */
+int be_codec_select(const char *name);
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "latency_hist.h"
+#include "rdma_com.h"
+
+/* Shared pieces of the benchmark drivers: one result row per run
+printed as csv or json lines, list options and bringing a connection up
+in its own thread. */
+
+/********** results **********/
+enum bench_format {
+  BENCH_CSV = 0,
+  BENCH_JSON
+};
+
+/* one row per measured configuration, every driver fills what applies */
+struct bench_result {
+  std::string suite;
+  std::string op;
+  uint32_t    size;
+  int         depth;
+  int         threads;
+  int         conns;
+  uint64_t    ops;
+  uint64_t    errors;
+  double      seconds;
+  /* offered load of an open loop run, 0 for closed loop */
+  double      target_kops;
+  const LatencyHistogram *lat;
+};
+
+class BenchReport {
+public:
+  /* out NULL writes to stdout */
+  BenchReport(bench_format format, FILE *out = NULL)
+      : format(format), out(out ? out : stdout), header_done(false),
+        lat_valid(true) {}
+
+  void row(const bench_result &r);
+  /* comment lines are skipped by csv readers, json gets {"note": ..} */
+  void note(const char *fmt, ...);
+
+  /* Measures the cross-core counter skew, notes it and flags the
+  latencies of every row after it lat_valid 0 when it is above
+  threshold_ns. Threads migrate and the send suite stamps on two
+  threads, so no row is exempt. */
+  void check_clock(int64_t threshold_ns);
+
+private:
+  bench_format format;
+  FILE         *out;
+  bool         header_done;
+  bool         lat_valid;
+};
+
+#define BENCH_SKEW_NS  100
+
+/********** options **********/
+/* "8,64,4096" or a power of two range "2:1048576", false on bad input */
+bool parse_size_list(const char *arg, std::vector<uint32_t> &out);
+bool parse_int_list(const char *arg, std::vector<int> &out);
+bool parse_format(const char *arg, bench_format *format);
+
+/********** connection **********/
+/* Builds a server or client from env and runs it on a detached thread,
+env must outlive the connection. Start every listener before waiting on
+any of them when a server takes several connections. */
+ConnectionProc *bench_start(EnvironmentProc *env);
+/* spins until conn is up, false if it died on the way */
+bool bench_wait(ConnectionProc *conn);
+/* both of the above, NULL and nothing left behind if the connection
+didn't come up */
+ConnectionProc *bench_connect(EnvironmentProc *env);
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "rdma_com.h"
+
+/* Moves a range of pinned memory of any length to or from the peer.
+Both sides address the range by virtual offset, it may span any number
+of Pinned_Fix_Memory blocks. The range is cut in chunks of at most
+chunk_len, a multiple of the largest mtu, which never cross a block on
+either side, and up to window chunks are kept in flight. A chunk clipped
+at a block end is short, so when the two offsets sit at different
+places within their blocks every block boundary of either side adds a
+short packet, not only the end of the transfer. One BulkTransfer per
+thread. */
+
+/* default chunk and window, a few chunks cover the bandwidth delay
+product of a 200 Gb/s link */
+#define BULK_CHUNK_LEN  (256 * 1024)
+#define BULK_WINDOW     16
+#define BULK_MTU_ALIGN  4096
+
+struct bulk_stats {
+  uint64_t  bytes;
+  uint64_t  chunks;
+  double    seconds;
+  double    mbps;   /* MB/s achieved over the whole transfer */
+};
+
+class BulkTransfer {
+public:
+  BulkTransfer(ConnectionProc *conn, uint32_t chunk_len = BULK_CHUNK_LEN,
+               uint32_t window = BULK_WINDOW);
+  ~BulkTransfer() {};
+
+  /* blocks until every chunk completed, FAILURE if a chunk could not be
+  posted or completed in error. stats may be NULL */
+  int16_t write(uint64_t local_voff, uint64_t remote_voff, uint64_t length,
+                bulk_stats *stats = NULL);
+  int16_t read(uint64_t local_voff, uint64_t remote_voff, uint64_t length,
+               bulk_stats *stats = NULL);
+
+private:
+  ConnectionProc  *conn;
+  uint32_t        chunk_len;
+  uint32_t        window;
+  std::vector<rdma_request> slots;  /* one chunk in flight each */
+
+  int16_t transfer(bool is_read, uint64_t local_voff, uint64_t remote_voff,
+                   uint64_t length, bulk_stats *stats);
+  /* describe the next chunk at the two offsets, at most len bytes */
+  int16_t next_chunk(uint64_t local_voff, uint64_t remote_voff, uint64_t len,
+                     rdma_mem_info &info);
+};
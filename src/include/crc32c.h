@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC32C (Castagnoli), the checksum of iSCSI and ext4. With SSE4.2 the
+crc32 instruction does 8 bytes a cycle per stream but has a latency of
+3, so large buffers are cut in three streams computed side by side and
+folded together with precomputed shift tables. Without it a slicing-by-8
+table does the job. The implementation is picked at load time. */
+
+/* crc of the previous data, 0 to start */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+/* "sse4.2" or "table" */
+const char *crc32c_impl();
@@ -27,6 +27,16 @@ struct env_basic_param {
 
   MachineType machine;
   int32_t     cache_line_size;
+  int32_t     num_of_qps;
+
+  int32_t     tx_depth;     /* send queue depth of each qp */
+  int32_t     rx_depth;     /* posted meta recvs */
+  int32_t     mtu;          /* requested, 0 for the port's active mtu */
+  enum ibv_mtu  curr_mtu;   /* resolved by check_env */
+  int32_t     out_reads;    /* outstanding rdma reads, 0 for the device max */
+  int32_t     mem_reg_mode; /* mem_reg_mode of the pinned blocks */
+  int64_t     dm_limit;     /* device memory bytes for small regions, -1
+                            for whatever the nic has */
 };
 
 class EnvironmentProc {
@@ -38,6 +48,8 @@ public:
   int16_t check_env();
 
   env_basic_param *get_params() { return &env_params; }
+  /* the device check_env opened */
+  ibv_context *get_context() { return env_context; }
   bool is_server() {
     return env_params.machine == SERVER;
   }
@@ -51,42 +63,50 @@ private:
 
 #define byte unsigned char
 #define RDMA_MESSAGE_MAGIC  (uint32_t)491237815
-#define RDMA_MESSAGE_HEAD_LEN  4 + 4
+#define RDMA_MESSAGE_HEAD_LEN  (4 + 4)
+/* Big-endian wire helpers: one unaligned load/store plus a bswap
+instead of byte shifts, memcpy of a constant size compiles to a single
+mov. Batch variants for arrays live in be_codec.h. */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define m_to_be_2(n) __builtin_bswap16(n)
+#define m_to_be_4(n) __builtin_bswap32(n)
+#define m_to_be_8(n) __builtin_bswap64(n)
+#else
+#define m_to_be_2(n) (n)
+#define m_to_be_4(n) (n)
+#define m_to_be_8(n) (n)
+#endif
+
 static inline void m_write_1(byte *b, uint64_t n) {
   b[0] = static_cast<byte>(n);
 }
 static inline void m_write_2(byte *b, uint64_t n) {
-  b[0] = static_cast<byte>(n >> 8);
-  b[1] = static_cast<byte>(n);
+  uint16_t v = m_to_be_2(static_cast<uint16_t>(n));
+  memcpy(b, &v, 2);
 }
 static inline void m_write_4(byte *b, uint64_t n) {
-  b[0] = static_cast<byte>(n >> 24);
-  b[1] = static_cast<byte>(n >> 16);
-  b[2] = static_cast<byte>(n >> 8);
-  b[3] = static_cast<byte>(n);
+  uint32_t v = m_to_be_4(static_cast<uint32_t>(n));
+  memcpy(b, &v, 4);
 }
 static inline void m_write_8(byte *b, uint64_t n) {
-  m_write_4(b, (uint64_t)(n >> 32));
-  m_write_4(b + 4, (uint64_t)(n));
+  uint64_t v = m_to_be_8(n);
+  memcpy(b, &v, 8);
 }
 static inline uint8_t m_read_1(const byte *b) {
   return (static_cast<uint8_t>(b[0]));
 }
 static inline uint16_t m_read_2(const byte *b) {
-  return ((static_cast<uint16_t>(b[0]) << 8) |
-          (static_cast<uint16_t>(b[1])));
+  uint16_t v;
+  memcpy(&v, b, 2);
+  return m_to_be_2(v);
 }
 static inline uint32_t m_read_4(const byte *b) {
-  return ((static_cast<uint32_t>(b[0]) << 24) |
-          (static_cast<uint32_t>(b[1]) << 16) |
-          (static_cast<uint32_t>(b[2]) << 8) |
-          (static_cast<uint32_t>(b[3])));
+  uint32_t v;
+  memcpy(&v, b, 4);
+  return m_to_be_4(v);
 }
 static inline uint64_t m_read_8(const byte *b) {
-  uint64_t u64;
-  u64 = m_read_4(b);
-  u64 <<= 32;
-  u64 |= m_read_4(b + 4);
-  return u64;
+  uint64_t v;
+  memcpy(&v, b, 8);
+  return m_to_be_8(v);
 }
-
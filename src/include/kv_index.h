@@ -0,0 +1,134 @@
+#pragma once
+
+#include "rdma_com.h"
+
+/* One-sided key-value lookup: the server lays a two-choice cuckoo hash
+out in pinned blocks, the client resolves a key with rdma reads only,
+the server CPU is not involved on the read path.
+
+  index:  [kv_index_meta][kv_bucket 0][kv_bucket 1] ...
+  item:   [version][key][length][value ...][version]
+
+Buckets are one cache line and guarded by a head/tail version pair, a
+reader that sees different versions has raced with the writer and
+retries. Key 0 marks an empty slot.
+
+Items are guarded the same way, their version counts the rewrites of
+the item's memory. Replaced and removed items are reused for items of
+the same size only, so a reader holding a stale slot still finds the
+version words where it expects them and retries on a torn item or a
+foreign key. */
+
+#define KV_INDEX_MAGIC  (uint64_t)0x6b76696e64657831
+#define KV_BUCKET_SLOTS 3
+#define KV_MAX_KICKS    64
+#define KV_MAX_RETRIES  16
+#define KV_ITEM_HEAD_LEN  (8 + 8 + 8)
+#define KV_ITEM_TAIL_LEN  8
+
+struct kv_slot {
+  uint64_t key;
+  uint64_t item;  /* voff << 24 | item length, 0 if empty */
+};
+
+struct alignas(64) kv_bucket {
+  uint64_t version_head;
+  kv_slot  slots[KV_BUCKET_SLOTS];
+  uint64_t version_tail;
+};
+static_assert(sizeof(kv_bucket) == 64, "kv_bucket must be one cache line");
+
+struct alignas(64) kv_index_meta {
+  uint64_t magic;
+  uint64_t bucket_num;
+  uint64_t bucket_voff;  /* voff of bucket 0 */
+};
+
+static inline uint64_t kv_item_pack(uint64_t voff, uint64_t len) {
+  return (voff << 24) | (len & 0xffffff);
+}
+static inline uint64_t kv_item_voff(uint64_t item) { return item >> 24; }
+static inline uint32_t kv_item_len(uint64_t item) { return item & 0xffffff; }
+
+/* the two candidate buckets of a key */
+static inline uint64_t kv_hash(uint64_t key, uint64_t seed) {
+  key ^= seed;
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  key ^= key >> 33;
+  return key;
+}
+
+class KVIndexServer {
+public:
+  KVIndexServer(ConnectionProc *conn) : conn(conn), bucket_num(0),
+      bucket_voff(0), item_voff(0), item_end(0) {};
+  ~KVIndexServer() {};
+
+  /* pin the index, root_voff is what clients open */
+  int16_t create(uint64_t num, uint64_t *root_voff);
+
+  /* value length is limited by one pinned block */
+  int16_t put(uint64_t key, const byte *value, uint32_t len);
+  int16_t remove(uint64_t key);
+
+private:
+  ConnectionProc  *conn;
+  uint64_t        bucket_num;
+  uint64_t        bucket_voff;
+  /* item heap, bump allocated, freed items are kept by size */
+  uint64_t        item_voff;
+  uint64_t        item_end;
+  std::map<uint64_t, std::vector<uint64_t> > free_items;
+  std::mutex      write_mutex;
+
+  uint64_t bucket_of(uint64_t key, int which) {
+    return kv_hash(key, which ? 0x9e3779b97f4a7c15ULL : 0) % bucket_num;
+  }
+  /* buckets span several blocks, so they are not contiguous locally */
+  kv_bucket *bucket(uint64_t b) {
+    return (kv_bucket *)conn->get_mem_magr()->get_local_address(
+        bucket_voff + b * sizeof(kv_bucket));
+  }
+  int16_t alloc_item(uint64_t len, uint64_t *voff);
+  /* item is a packed slot item, no longer referenced by any slot */
+  void free_item(uint64_t item);
+  void write_slot(uint64_t b, int s, uint64_t key, uint64_t item);
+  bool find(uint64_t key, uint64_t *b, int *s);
+  bool find_empty(uint64_t b, int *s);
+  bool make_room(uint64_t b, int *s);
+};
+
+class KVIndexClient {
+public:
+  KVIndexClient(ConnectionProc *conn, uint64_t root_voff) : conn(conn),
+      root_voff(root_voff), bucket_num(0), bucket_voff(0), scratch_voff(0),
+      scratch(NULL), scratch_mr(NULL) {};
+  ~KVIndexClient() {};
+
+  /* pin the local scratch block and read the index meta */
+  int16_t open();
+
+  /* resolve key with two reads, value gets at most *len bytes and *len
+  is set to the stored length. Not thread safe, one client per thread */
+  int16_t get(uint64_t key, byte *value, uint32_t *len);
+
+private:
+  ConnectionProc  *conn;
+  uint64_t        root_voff;
+  uint64_t        bucket_num;
+  uint64_t        bucket_voff;
+  uint64_t        scratch_voff;
+  byte            *scratch;
+  ibv_mr          *scratch_mr;
+
+  uint64_t bucket_of(uint64_t key, int which) {
+    return kv_hash(key, which ? 0x9e3779b97f4a7c15ULL : 0) % bucket_num;
+  }
+  int16_t post_read(uint64_t voff, uint32_t len, uint64_t local_off,
+                    rdma_request *req);
+  bool match_bucket(const kv_bucket *b, uint64_t key, uint64_t *item,
+                    bool *torn);
+};
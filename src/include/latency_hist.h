@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+/********** LatencyHistogram **********/
+/* Log-linear buckets over nanoseconds. Values below 2^LAT_HIST_SUB_BITS
+are exact, every power of two above is split into 2^LAT_HIST_SUB_BITS
+linear buckets, so a reported value is within 1/64 of the recorded one
+and the whole 64 bit range costs ~30 KB. record is a shift and an add,
+no locking, keep one histogram per thread and merge at the end. */
+#define LAT_HIST_SUB_BITS   6
+#define LAT_HIST_SUB_COUNT  (1 << LAT_HIST_SUB_BITS)
+#define LAT_HIST_BUCKETS    (LAT_HIST_SUB_COUNT * (64 - LAT_HIST_SUB_BITS + 1))
+
+class LatencyHistogram {
+public:
+  LatencyHistogram();
+
+  void record(uint64_t ns, uint64_t count = 1) {
+    buckets[bucket_index(ns)] += count;
+    total += count;
+    sum += ns * count;
+    if (ns < min_ns) min_ns = ns;
+    if (ns > max_ns) max_ns = ns;
+  }
+  void merge(const LatencyHistogram &other);
+  void reset();
+
+  uint64_t count() const { return total; }
+  uint64_t min() const { return total ? min_ns : 0; }
+  uint64_t max() const { return max_ns; }
+  double mean() const { return total ? (double)sum / total : 0; }
+  /* p in [0, 100], the value below which p percent of the samples fall */
+  uint64_t percentile(double p) const;
+
+  static size_t bucket_index(uint64_t ns) {
+    if (ns < LAT_HIST_SUB_COUNT) {
+      return ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    int shift = msb - LAT_HIST_SUB_BITS;
+    return ((size_t)(shift + 1) << LAT_HIST_SUB_BITS) +
+           ((ns >> shift) - LAT_HIST_SUB_COUNT);
+  }
+  /* middle of the bucket */
+  static uint64_t bucket_value(size_t index);
+
+private:
+  std::vector<uint64_t> buckets;
+  uint64_t total;
+  uint64_t sum;
+  uint64_t min_ns;
+  uint64_t max_ns;
+};
+
+/* The same buckets for a histogram another thread reads while it is
+filled, see MetricsExporter. Still one writer: record is a relaxed load
+and store, no locked instruction on the hot path. Readers see counts
+that are at most a few records behind. */
+class AtomicHistogram {
+public:
+  AtomicHistogram() : buckets(new std::atomic<uint64_t>[LAT_HIST_BUCKETS]) {
+    for (size_t i = 0; i < LAT_HIST_BUCKETS; i++) {
+      buckets[i].store(0, std::memory_order_relaxed);
+    }
+  }
+  ~AtomicHistogram() { delete[] buckets; }
+
+  void record(uint64_t ns) {
+    std::atomic<uint64_t> &b = buckets[LatencyHistogram::bucket_index(ns)];
+    b.store(b.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+  /* cumulative counts per bucket, any thread */
+  void snapshot(std::vector<uint64_t> &counts) const;
+
+private:
+  AtomicHistogram(const AtomicHistogram &) = delete;
+  AtomicHistogram &operator=(const AtomicHistogram &) = delete;
+
+  std::atomic<uint64_t> *buckets;
+};
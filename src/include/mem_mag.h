@@ -2,6 +2,7 @@
 
 #include <vector>
 #include <unordered_map>
+#include <map>
 #include <list>
 #include <atomic>
 #include <mutex>
@@ -14,10 +15,29 @@ class RDMAClient;
 
 const uint64_t FIX_BLOCK_LENGTH = (1024 * 1024); // 1 MB
 const uint64_t MAX_MEMORY_LENGTH =	((uint64_t)(16) * (uint64_t)(1024 * 1024 * 1024)); // 16 GB
+/* voffs of small regions start past the fixed blocks */
+const uint64_t SMALL_VOFF_BASE = MAX_MEMORY_LENGTH;
+const uint64_t SMALL_REGION_ALIGN = 64;
+
+/* how Pinned_Fix_Memory registers its blocks */
+enum mem_reg_mode {
+	MEM_REG_PINNED = 0,		/* ibv_reg_mr pins every page up front */
+	MEM_REG_ODP,					/* IBV_ACCESS_ON_DEMAND mr per block, faulted in on use */
+	MEM_REG_IMPLICIT_ODP	/* one on demand mr over the whole address space */
+};
+
+/* compact descriptor of a registered region, as advertised to the peer */
+struct remote_mr {
+	uint64_t	voff;	/* virtual offset in the owner's MemoryMagr */
+	uint64_t	addr;
+	uint32_t	length;
+	uint32_t	rkey;
+};
 
 struct pinned_block {
 	pinned_block(uint64_t voff, uint64_t len) : virtual_offset(voff),
-		local_mem(NULL), mem_length(len), mr(NULL), pinned(false) {};
+		local_mem(NULL), mem_length(len), mr(NULL), pinned(false),
+		shared_mr(false) {};
 	~pinned_block() {};
 
 	uint64_t	virtual_offset;
@@ -25,25 +45,29 @@ struct pinned_block {
 	uint64_t	mem_length;
 	ibv_mr	*mr;
 	bool 	pinned;
+	bool	shared_mr;	/* mr is the implicit odp one, not ours to deregister */
 
 	ibv_mr *reg_local_mr(ibv_pd *pd, ibv_access_flags flags) {
 		if (!pinned && local_mem) {
 			mr = ibv_reg_mr(pd, local_mem, mem_length, flags);
-			pinned = true;
+			pinned = mr != NULL;
 		}
 		return mr;
 	}
 	void unreg_local_mr() {
-		if (pinned && mr) {
+		if (pinned && mr && !shared_mr) {
 			ibv_dereg_mr(mr);
-			pinned = false;
 		}
+		pinned = false;
 	}
 
   ibv_mr *reg_alloc_local(ibv_pd *pd, ibv_access_flags flags, uint64_t alig) {
     assert(local_mem == NULL);
     assert(mem_length > 0);
     local_mem = (byte *)aligned_alloc(alig, mem_length);
+    if (local_mem == NULL) {
+      return NULL;
+    }
     return reg_local_mr(pd, flags);
 	}
 	void unreg_free_local() {
@@ -60,7 +84,8 @@ struct pinned_block {
 class Pinned_Fix_Memory {
 public:
 	Pinned_Fix_Memory(uint64_t block_len, uint64_t max) : next_offset(0),
-      max_size(max), block_length(block_len), align_str(DEF_CACHE_LINE_SIZE) {
+      max_size(max), block_length(block_len), align_str(DEF_CACHE_LINE_SIZE),
+      reg_mode(MEM_REG_PINNED), implicit_mr(NULL) {
 		blocks.resize(max / block_len);
 	};
 	~Pinned_Fix_Memory();
@@ -70,10 +95,15 @@ public:
 	uint64_t 	max_size;
 	uint64_t 	block_length;
   uint64_t  align_str;
+	mem_reg_mode	reg_mode;
+	ibv_mr	*implicit_mr;	/* MEM_REG_IMPLICIT_ODP, covers every block */
 
 	/* function */
 	// bool allocate_block(uint64_t offset, ibv_pd *pd, ibv_access_flags flags);
-	bool allocate_next_block(ibv_pd *pd, ibv_access_flags flags);
+	bool allocate_next_block(ibv_pd *pd, ibv_access_flags flags, uint64_t *voff = NULL);
+	/* num blocks contiguous in the virtual offset space */
+	bool allocate_next_blocks(ibv_pd *pd, ibv_access_flags flags, uint64_t num,
+														uint64_t *voff = NULL);
 	// bool push_block(uint64_t offset, ibv_pd *pd, ibv_access_flags flags);
 	// bool push_next_block(ibv_pd *pd, ibv_access_flags flags);
 
@@ -83,9 +113,20 @@ public:
 		}
 		return NULL;
 	}
+	/* describe a pinned block, false if it is not registered (yet) */
+	bool get_region(size_t block_num, remote_mr *desc);
+	byte *get_block_address(size_t block_num) {
+		if (blocks[block_num]) {
+			return blocks[block_num]->local_mem;
+		}
+		return NULL;
+	}
 private:
 	std::mutex mem_mutex;
 	std::vector<pinned_block *>	blocks;
+
+	/* unregister, free and forget num installed blocks from first */
+	void release_blocks(uint64_t first, uint64_t num);
 };
 
 // TODO mzy: variable length
@@ -106,22 +147,116 @@ private:
 	std::list<pinned_block *>	virtual_outsets;
 };
 
+/* a small region, from device memory or host memory */
+struct small_region {
+	uint64_t	voff;
+	uint64_t	length;
+	ibv_mr	*mr;
+	ibv_dm	*dm;		/* NULL for host memory */
+	byte	*host;	/* NULL for device memory */
+};
+
+/* Small regions for hot words (counters, doorbells, ring tails) the peer
+hits with atomics and small reads. They come from the nic's device
+memory while it has some, which saves the pcie round trip to host memory
+on every access, and from host memory otherwise. Device memory is not
+mapped to the cpu: its mr is zero based, the peer addresses it by
+offset, and locally it is only reached with copies. */
+class Pinned_Small_Memory {
+public:
+	Pinned_Small_Memory() : next_offset(SMALL_VOFF_BASE), dm_queried(false),
+		dm_left(0), dm_limit(UINT64_MAX) {};
+	~Pinned_Small_Memory();
+
+	/* device false skips device memory */
+	bool allocate(ibv_pd *pd, ibv_access_flags flags, uint64_t len, bool device,
+								uint64_t *voff);
+	/* use at most limit bytes of device memory, 0 puts every region in
+	host memory as if the nic had none. Before the first allocate */
+	void set_dm_limit(uint64_t limit) { dm_limit = limit; }
+	/* region holding voff, NULL if none */
+	small_region *find(uint64_t voff);
+	bool get_region(uint64_t voff, remote_mr *desc);
+	void get_regions(std::vector<remote_mr> &regions);
+
+private:
+	std::mutex mem_mutex;
+	uint64_t	next_offset;
+	bool	dm_queried;
+	uint64_t	dm_left;	/* device memory this process may still try */
+	uint64_t	dm_limit;
+	std::map<uint64_t, small_region> regions;	/* keyed by voff */
+
+	bool alloc_device(ibv_pd *pd, ibv_access_flags flags, small_region &r);
+	bool alloc_host(ibv_pd *pd, ibv_access_flags flags, small_region &r);
+};
+
 class MemoryMagr {
 public:
 	MemoryMagr() : p_fix_memory(FIX_BLOCK_LENGTH, MAX_MEMORY_LENGTH) {};
 	~MemoryMagr() {};
 
-	/* allocate and make mr for a memory block */
+	/* allocate and make mr for a memory block, fixed len may span several
+	blocks which are then contiguous in voff */
 	bool allocate_pinned_memory(ibv_pd *pd, ibv_access_flags flags,
-															uint64_t len = FIX_BLOCK_LENGTH, bool fixed = true);
+															uint64_t len = FIX_BLOCK_LENGTH, bool fixed = true,
+															uint64_t *voff = NULL);
 	// /* make mr for an allocated memory block */
 	// bool pin_memory(ibv_pd *pd, ibv_access_flags flags,
 	//								 byte *buf, uint64_t len = FIX_BLOCK_LENGTH, bool fixed = true);
 	/* get mr for pinned memory block */
 	ibv_mr *get_pinned_mr(uint64_t voff, uint64_t len, bool fixed = true);
+	/* local address of a pinned virtual offset, NULL if not pinned */
+	byte *get_local_address(uint64_t voff);
+	/* describe the pinned block at voff for advertisement */
+	bool get_pinned_region(uint64_t voff, remote_mr *desc);
+	/* snapshot all pinned blocks, returns the number of regions */
+	size_t get_pinned_regions(std::vector<remote_mr> &regions);
+
+	/* small region of len bytes, see Pinned_Small_Memory. The region API
+	above covers it, get_local_address is NULL for device memory */
+	bool allocate_small_memory(ibv_pd *pd, ibv_access_flags flags, uint64_t len,
+														 uint64_t *voff, bool device = true);
+	bool is_device_memory(uint64_t voff);
+	/* see Pinned_Small_Memory::set_dm_limit */
+	void set_dm_limit(uint64_t limit) { p_small_memory.set_dm_limit(limit); }
+	/* cpu access to a small region of either kind, offsets and lengths
+	are multiples of 4 on device memory */
+	bool read_small_memory(uint64_t voff, void *dst, uint64_t len);
+	bool write_small_memory(uint64_t voff, const void *src, uint64_t len);
+
+	/* switch the fixed blocks to mode before the first one is allocated,
+	false if the device lacks the odp capabilities, the mode stays then.
+	With MEM_REG_IMPLICIT_ODP every block gets the access of the implicit
+	mr, the flags passed to allocate_pinned_memory are ignored */
+	bool set_reg_mode(ibv_pd *pd, mem_reg_mode mode);
+	mem_reg_mode get_reg_mode() { return p_fix_memory.reg_mode; }
+	/* fault [voff, voff + len) of the fixed blocks in ahead of use,
+	asynchronously unless sync. Nothing to do for pinned blocks */
+	bool prefetch(ibv_pd *pd, uint64_t voff, uint64_t len, bool write = true,
+								bool sync = false);
 
 protected:
 	/* data */
 	Pinned_Fix_Memory p_fix_memory;
+	Pinned_Small_Memory p_small_memory;
 	// Pinned_Var_Memory p_var_memory;
 };
+
+/* Cache of the regions a peer advertised, looked up by the peer's
+virtual offset to fill the remote side of rdma_mem_info. */
+class Remote_Memory {
+public:
+	Remote_Memory() {};
+	~Remote_Memory() {};
+
+	/* merge advertised regions, reset drops everything cached before */
+	void update(const remote_mr *mrs, uint32_t num, bool reset);
+	/* find the region holding [voff, voff + len) */
+	bool lookup(uint64_t voff, uint64_t len, remote_mr *mr);
+	size_t size();
+
+private:
+	std::mutex mem_mutex;
+	std::map<uint64_t, remote_mr> regions; /* keyed by voff */
+};
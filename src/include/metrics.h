@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "latency_hist.h"
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+class ConnectionProc;
+struct counter_context;
+
+/* Live counters. Writers bump them with relaxed atomics, padded so two
+counters never share a cache line, nothing else happens on the hot
+path, the exporter thread only loads them. */
+struct metric_counter {
+  std::atomic<uint64_t> value;
+  char    pad[CACHE_LINE_SIZE - sizeof(std::atomic<uint64_t>)];
+
+  metric_counter() : value(0) {}
+  void add(uint64_t n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+  uint64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+/* kept by every ConnectionProc, counted in work requests: an op striped
+over several qps is one per chunk */
+struct conn_metrics {
+  metric_counter signaled;    /* signaled wrs posted, each gets a cqe */
+  metric_counter completed;   /* rdma and atomic cqes */
+  metric_counter bytes;       /* payload of every posted wr */
+  metric_counter errors;      /* failed posts and error cqes */
+};
+
+/* Samples the registered connections and histograms every interval
+and writes one json line per sample:
+
+  {"ts_ms":..,"interval_s":..,"ops":..,"kops":..,"mbps":..,"inflight":..,
+   "errors":..,"cpu_util":..,"lat_count":..,"lat_p50_us":..,"lat_p99_us":..,
+   "lat_p999_us":..,"lat_max_us":..,"conns":[{"name":..,"kops":..,..}],
+   "port":{"port_xmit_data":{"delta":..,"rate":..},..}}
+
+ops are completed work requests, see conn_metrics. Rates, errors and
+latencies cover the interval, inflight is what the cqs still owe
+(signaled minus completed), cpu_util is the busy share of all cpus from
+/proc/stat, port has the hca counters of add_port_counters for the same
+interval. Register everything before start. */
+class MetricsExporter {
+public:
+  MetricsExporter() : fd(-1), counters(NULL), running(false) {}
+  ~MetricsExporter();
+
+  /* "unix:<path>" connects to a listening stream socket and reconnects
+  when it goes away, anything else is a file the lines are appended to */
+  int16_t open(const char *target);
+  void add_connection(const std::string &name, ConnectionProc *conn);
+  /* latencies of all histograms go into one distribution */
+  void add_histogram(const AtomicHistogram *hist);
+  /* names as for perftest's --report_counters, comma separated */
+  int16_t add_port_counters(const char *dev_name, int port, const char *names);
+
+  int16_t start(int interval_ms);
+  void stop();
+
+private:
+  struct conn_source {
+    std::string     name;
+    ConnectionProc  *conn;
+    uint64_t        ops;
+    uint64_t        bytes;
+    uint64_t        errors;
+  };
+  struct hist_source {
+    const AtomicHistogram *hist;
+    std::vector<uint64_t> prev;
+  };
+
+  std::string   target;
+  int           fd;
+  std::vector<conn_source> conns;
+  std::vector<hist_source> hists;
+  counter_context *counters;
+  uint64_t      cpu_busy;
+  uint64_t      cpu_total;
+
+  std::thread   thread;
+  std::mutex    mutex;
+  std::condition_variable cv;
+  bool          running;
+
+  void run(int interval_ms);
+  void sample(double seconds);
+  void emit(const std::string &line);
+  bool reconnect();
+};
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <tuple>
+
+#include "env_basic.h"
+
+/* Compile-time message layout. A message is declared once as the list
+of its wire types
+
+  typedef msg_schema<uint16_t, uint16_t, uint32_t, uint64_t> rpc_head;
+
+offsets and sizes are constants, and write<I>/read<I> or the whole
+tuple encode/decode inline to straight big-endian loads and stores
+through the m_write_N/m_read_N helpers, no parsing at run time. Name
+the indices with an enum next to the schema. */
+
+/* how one wire type is stored */
+template <typename T> struct wire_field;
+
+template <> struct wire_field<uint8_t> {
+  static constexpr size_t size = 1;
+  static inline void write(byte *b, uint8_t v) { m_write_1(b, v); }
+  static inline uint8_t read(const byte *b) { return m_read_1(b); }
+};
+template <> struct wire_field<uint16_t> {
+  static constexpr size_t size = 2;
+  static inline void write(byte *b, uint16_t v) { m_write_2(b, v); }
+  static inline uint16_t read(const byte *b) { return m_read_2(b); }
+};
+template <> struct wire_field<uint32_t> {
+  static constexpr size_t size = 4;
+  static inline void write(byte *b, uint32_t v) { m_write_4(b, v); }
+  static inline uint32_t read(const byte *b) { return m_read_4(b); }
+};
+template <> struct wire_field<uint64_t> {
+  static constexpr size_t size = 8;
+  static inline void write(byte *b, uint64_t v) { m_write_8(b, v); }
+  static inline uint64_t read(const byte *b) { return m_read_8(b); }
+};
+
+template <typename... Ts> struct msg_schema;
+
+/* type and byte offset of field I */
+template <size_t I, typename S> struct schema_field;
+
+template <typename T, typename... Rest>
+struct schema_field<0, msg_schema<T, Rest...>> {
+  typedef T type;
+  static constexpr size_t offset = 0;
+};
+
+template <size_t I, typename T, typename... Rest>
+struct schema_field<I, msg_schema<T, Rest...>> {
+  typedef typename schema_field<I - 1, msg_schema<Rest...>>::type type;
+  static constexpr size_t offset =
+      wire_field<T>::size + schema_field<I - 1, msg_schema<Rest...>>::offset;
+};
+
+/* unrolled field by field, the recursion is gone after inlining */
+template <size_t I, typename S> struct schema_codec {
+  static inline void encode(byte *b, const typename S::values &v) {
+    schema_codec<I - 1, S>::encode(b, v);
+    S::template write<I - 1>(b, std::get<I - 1>(v));
+  }
+  static inline void decode(const byte *b, typename S::values &v) {
+    schema_codec<I - 1, S>::decode(b, v);
+    std::get<I - 1>(v) = S::template read<I - 1>(b);
+  }
+};
+
+template <typename S> struct schema_codec<0, S> {
+  static inline void encode(byte *b, const typename S::values &v) {}
+  static inline void decode(const byte *b, typename S::values &v) {}
+};
+
+template <> struct msg_schema<> {
+  static constexpr size_t count = 0;
+  static constexpr size_t size = 0;
+};
+
+template <typename T, typename... Rest>
+struct msg_schema<T, Rest...> {
+  typedef std::tuple<T, Rest...> values;
+
+  static constexpr size_t count = 1 + sizeof...(Rest);
+  static constexpr size_t size = wire_field<T>::size + msg_schema<Rest...>::size;
+
+  template <size_t I>
+  static constexpr size_t offset() {
+    return schema_field<I, msg_schema>::offset;
+  }
+
+  template <size_t I>
+  static inline void write(byte *b, typename schema_field<I, msg_schema>::type v) {
+    wire_field<typename schema_field<I, msg_schema>::type>::write(
+        b + schema_field<I, msg_schema>::offset, v);
+  }
+
+  template <size_t I>
+  static inline typename schema_field<I, msg_schema>::type read(const byte *b) {
+    return wire_field<typename schema_field<I, msg_schema>::type>::read(
+        b + schema_field<I, msg_schema>::offset);
+  }
+
+  static inline void encode(byte *b, const values &v) {
+    schema_codec<count, msg_schema>::encode(b, v);
+  }
+  static inline void decode(const byte *b, values &v) {
+    schema_codec<count, msg_schema>::decode(b, v);
+  }
+};
+
+/********** RdmaMessage frame **********/
+/* [magic][length] data [magic], or [magic][length | RDMA_MESSAGE_CRC]
+data [crc32c of data][magic] */
+typedef msg_schema<uint32_t, uint32_t> rdma_msg_head;
+enum { MSG_HEAD_MAGIC = 0, MSG_HEAD_LENGTH };
+typedef msg_schema<uint32_t> rdma_msg_crc;
+enum { MSG_CRC_VALUE = 0 };
+typedef msg_schema<uint32_t> rdma_msg_tail;
+enum { MSG_TAIL_MAGIC = 0 };
+
+#define RDMA_MESSAGE_CRC  0x80000000u
+
+static_assert(rdma_msg_head::size == RDMA_MESSAGE_HEAD_LEN,
+              "RDMA_MESSAGE_HEAD_LEN out of sync with rdma_msg_head");
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <functional>
+
+#include "crc32c.h"
+#include "rdma_com.h"
+
+/* Message channel over RDMA write with immediate. Each side owns a ring
+in pinned memory, the peer writes RdmaMessage frames
+
+  [RDMA_MESSAGE_MAGIC][length][data ...][RDMA_MESSAGE_MAGIC]
+
+straight into it and signals a batch with the immediate, no recv buffer
+and no copy on the receiving side. Frames are 8 byte aligned and never
+wrap, the sender skips the ring tail instead.
+
+  imm: [frame count : 8][batch offset / 8 : 24]
+
+The receiver returns consumed bytes by writing its monotonic head into
+the sender's credit word, which lives behind the sender's own ring.
+
+In CHANNEL_POLL mode there is no immediate and no cqe at all: frames go
+as unsignaled plain writes and the receiver spins on its ring head until
+the trailing magic of the next frame has landed, relying on the write
+being placed in address order. Consumed frames are zeroed so stale magic
+is never mistaken for a new frame, and a wrap marker header tells the
+receiver the sender skipped the ring tail.
+
+With set_checksum the sender adds a crc32c of the data to every frame
+and flags it in the length word, the receiver verifies any flagged frame
+and drops it on mismatch. The crc is computed when the batch is flushed,
+data written through reserve is final by then.
+
+A frame with a broken header or trailing magic leaves the ring position
+unknown, the receiver fails the channel and disconnects. Nothing is sent
+once the channel failed or the connection is no longer alive, a sender
+waiting for credit gives up then. */
+
+#define RDMA_CHANNEL_RING_LEN   (FIX_BLOCK_LENGTH - DEF_CACHE_LINE_SIZE)
+#define RDMA_CHANNEL_MAX_BATCH  255
+#define RDMA_CHANNEL_MAX_FRAME  (RDMA_CHANNEL_RING_LEN / 4)
+/* frame length of the wrap marker in CHANNEL_POLL mode */
+#define RDMA_CHANNEL_WRAP       0xffffffff
+/* CHANNEL_POLL signals one write in this many to reclaim the send queue,
+at most every tx_depth / 2 so unsignaled writes never fill it */
+#define RDMA_CHANNEL_SIGNAL_PERIOD  64
+
+enum channel_mode {
+  CHANNEL_IMM = 0,  /* write with immediate, on_imm per batch */
+  CHANNEL_POLL      /* unsignaled writes, the receiver calls poll */
+};
+
+static inline uint64_t rdma_frame_len(uint64_t length, bool crc = false) {
+  return (rdma_msg_head::size + length + (crc ? rdma_msg_crc::size : 0) +
+          rdma_msg_tail::size + 7) & ~(uint64_t)7;
+}
+
+/* data is only valid until the handler returns */
+typedef std::function<void(byte *data, uint32_t length)> msg_handler;
+
+class RdmaChannel {
+public:
+  RdmaChannel(ConnectionProc *conn, msg_handler handler,
+              channel_mode mode = CHANNEL_IMM) : conn(conn),
+      handler(handler), mode(mode), checksum(false), ring(NULL), stage(NULL),
+      stage_mr(NULL), send_tail(0), batch_start(0), batch_count(0),
+      write_count(0), signal_period(RDMA_CHANNEL_SIGNAL_PERIOD),
+      recv_head(0), credit_sent(0), crc_errors(0), failed(false) {};
+  ~RdmaChannel() {};
+
+  /* pin the ring, attach to the connection and advertise the ring */
+  int16_t open();
+  /* crc32c on the frames we send from now on */
+  void set_checksum(bool on) { checksum = on; }
+  /* frames dropped for a crc mismatch */
+  uint64_t get_crc_errors() { return crc_errors; }
+  /* the peer's ring is known, sending is possible */
+  bool ready() { return conn->get_remote_ring(&remote); }
+  /* a corrupted frame arrived or the connection went down */
+  bool is_failed() { return failed.load() || !conn->is_alive(); }
+
+  /* reserve a frame in the current batch and return its data area, NULL
+  if length is larger than RDMA_CHANNEL_MAX_FRAME. Not locked, the caller
+  serializes senders */
+  byte *reserve(uint32_t length);
+  /* write the pending batch at once, with one immediate in CHANNEL_IMM */
+  int16_t flush();
+  /* locked reserve + copy of head and data into one frame, the frame
+  stays in the batch unless flush_now */
+  int16_t post(const byte *head, uint32_t head_len, const byte *data,
+               uint32_t length, bool flush_now);
+  /* post with the flush decided by flush_if under the send lock, after
+  the frame went into the batch. flush_if runs even if posting failed */
+  int16_t post_if(const byte *head, uint32_t head_len, const byte *data,
+                  uint32_t length, const std::function<bool()> &flush_if);
+  /* reserve + copy + flush */
+  int16_t send(const byte *data, uint32_t length);
+  int16_t send(const RdmaMessage &msg);
+
+  /* receiver side, called from on_completion */
+  void on_imm(uint32_t imm);
+  /* receiver side in CHANNEL_POLL mode, hands at most max_frames frames
+  to the handler and returns how many, never blocks */
+  int poll(int max_frames = RDMA_CHANNEL_MAX_BATCH);
+
+private:
+  ConnectionProc  *conn;
+  msg_handler     handler;
+  channel_mode    mode;
+  bool            checksum;
+  ring_desc       local;
+  ring_desc       remote;
+
+  byte            *ring;      /* written by the peer */
+  byte            *stage;     /* local image of the peer's ring */
+  ibv_mr          *stage_mr;
+  std::mutex      send_mutex;
+
+  /* sender, monotonic byte counters */
+  uint64_t        send_tail;
+  uint64_t        batch_start;
+  uint32_t        batch_count;
+  uint64_t        write_count;
+  uint32_t        signal_period;
+  /* receiver */
+  uint64_t        recv_head;
+  uint64_t        credit_sent;
+  uint64_t        crc_errors;
+  std::atomic_bool  failed;
+
+  uint64_t credit() {
+    return __atomic_load_n((uint64_t *)(ring + local.ring_size), __ATOMIC_ACQUIRE);
+  }
+  int16_t flush_batch();
+  void seal_batch();
+  /* reserve + copy, send_mutex must be held */
+  int16_t post_locked(const byte *head, uint32_t head_len, const byte *data,
+                      uint32_t length);
+  /* data of a flagged frame matches its crc */
+  bool check_frame(byte *data, uint32_t length);
+  int16_t wait_space(uint64_t len);
+  void return_credit();
+  /* the ring can't be trusted any more, see the class comment */
+  void fail(uint64_t offset);
+};
@@ -1,18 +1,58 @@
 #pragma once
 
 #include "env_basic.h"
+#include "mem_mag.h"
+#include "metrics.h"
+#include "msg_schema.h"
 
 #define RDMA_SERVER_IP "172.18.158.94"
 #define RDMA_TIMEOUT_IN_MS 1000
+/* small writes go inline with the wqe, no dma read of the payload */
+#define RDMA_MAX_INLINE_DATA 64
+
+/* regions carried by one META_RECV_MR message */
+#define META_MAX_REGIONS 16
+/* meta messages which may be in flight on the send side */
+#define META_SEND_DEPTH 16
+/* qps of one connection, the first one is connected by rdma cm */
+#define RDMA_MAX_QPS 16
+/* rdma ops at least this long are striped across the qps, in chunks
+aligned to RDMA_STRIPE_ALIGN */
+#define RDMA_STRIPE_MIN (64 * 1024)
+#define RDMA_STRIPE_ALIGN 4096
+
+class RdmaChannel;
+
+/* message ring a peer may write frames into, see RdmaChannel */
+struct ring_desc {
+  uint64_t ring_voff;
+  uint64_t ring_size;
+  uint64_t credit_voff;  /* where the peer returns consumed bytes */
+};
+
+/* an extra qp the peer connects to */
+struct qp_desc {
+  uint32_t qpn;
+  uint32_t psn;
+};
 
 struct MetaMessage{
   enum MetaType: uint16_t {
     META_RECV_MR = 0,
-    META_RECV_MESSAGE
+    META_RECV_MESSAGE,
+    META_RECV_RING,
+    META_RECV_QP,       /* the peer's qps, connect ours to them */
+    META_RECV_QP_READY  /* the peer's extra qps are ready to send */
   } type;
+  /* META_RECV_MR: the peer drops its cached regions before merging */
+  uint16_t reset;
+  /* META_RECV_MR, META_RECV_QP: number of valid entries in data */
+  uint32_t count;
   union {
-    struct ibv_mr mr;
+    remote_mr regions[META_MAX_REGIONS];
     uint64_t messages;
+    ring_desc ring;
+    qp_desc qps[RDMA_MAX_QPS];
   } data;
 };
 
@@ -25,12 +65,11 @@ struct RdmaMessage {
   // byte number
   RdmaMessage(uint32_t l, uint32_t c_l) : length(l) {
     // TODO mzy: avoid doing malloc every time
-    rdma_pck = (byte *)malloc(length + 12);
-    data = rdma_pck + 8;
-    m_write_4(rdma_pck, RDMA_MESSAGE_MAGIC);
-    m_write_4(rdma_pck + 4, length);
-    m_write_4(rdma_pck + RDMA_MESSAGE_HEAD_LEN + length, RDMA_MESSAGE_MAGIC);
-    pck_len = length + 12;
+    pck_len = rdma_msg_head::size + length + rdma_msg_tail::size;
+    rdma_pck = (byte *)malloc(pck_len);
+    data = rdma_pck + rdma_msg_head::size;
+    rdma_msg_head::encode(rdma_pck, rdma_msg_head::values(RDMA_MESSAGE_MAGIC, length));
+    rdma_msg_tail::write<MSG_TAIL_MAGIC>(data + length, RDMA_MESSAGE_MAGIC);
   }
   ~RdmaMessage() {
     free(rdma_pck);
@@ -45,7 +84,12 @@ struct conn_parameter {
   env_basic_param *env;
   bool  connected;
   int   num_of_qps;
-  int   wr_cq_number;
+  int   active_qps;   /* connected on both sides */
+  int   wr_cq_number; /* meta recv slots, the recv queue depth */
+  int   tx_depth;     /* send queue depth of each qp */
+  int   out_reads;    /* initiator_depth and responder_resources */
+  enum ibv_mtu  path_mtu;
+  uint32_t  max_inline_data;  /* granted by the qp */
 };
 
 struct conn_context {
@@ -58,15 +102,31 @@ struct conn_context {
 	ibv_pd				*pd;
   ibv_cq				*cq;
   ibv_qp				*qp;
+  /* qps[0] is qp, owned by the cm id, the others are striping lanes
+  connected by hand over the meta channel */
+  ibv_qp        *qps[RDMA_MAX_QPS];
+  uint32_t      qp_psn[RDMA_MAX_QPS];
+  /* ops are striped once our lanes are rts and the peer said its are,
+  the flags and the early peer qps are guarded by meta_mutex */
+  std::atomic_bool  qps_ready;
+  bool          qps_local_ready;
+  bool          qps_peer_ready;
+  /* a META_RECV_QP which arrived before we were established */
+  qp_desc       peer_qps[RDMA_MAX_QPS];
+  uint32_t      peer_qps_num;
 	// ibv_cq				*send_cq;
 	// ibv_cq				*recv_cq;
-  /* Meta Message memory */
+  /* Meta Message memory, wr_cq_number recv and META_SEND_DEPTH send slots */
   ibv_mr *meta_recv_mr;
   ibv_mr *meta_send_mr;
   MetaMessage *meta_recv;
   MetaMessage *meta_send;
+  uint32_t  meta_send_next;
+  std::atomic<uint32_t> meta_send_inflight;
+  std::mutex  meta_mutex;
   /* cq polling thread */
   pthread_t cq_poller_thread;
+  bool      cq_poller_running;
 };
 
 struct conn_callback {
@@ -74,8 +134,22 @@ struct conn_callback {
 
 };
 
+/* completion token of posted rdma ops, travels as the wr_id */
+struct rdma_request {
+  rdma_request() : pending(0), failed(false) {};
+
+  std::atomic<int32_t> pending;  /* posted but not completed */
+  std::atomic_bool  failed;
+
+  /* spin until every op posted with this token has completed */
+  bool wait() {
+    while (pending.load(std::memory_order_acquire) > 0) {}
+    return !failed.load();
+  }
+};
+
 struct rdma_mem_info {
-  struct ibv_mr *dst_mr;
+  remote_mr dst_mr;     /* filled by ConnectionProc::lookup_remote_mr */
   struct ibv_mr *src_mr;
   uint32_t length;
   uint32_t offset;
@@ -83,11 +157,35 @@ struct rdma_mem_info {
   bool use_imm_data;
   uint32_t imm_data;
   uint64_t local_address;
+
+  rdma_request *req;    /* NULL if nobody waits for the completion */
+  bool unsignaled;      /* no cqe, req must be NULL */
+
+  /* atomics: 8 byte aligned remote word, the old value lands at
+  local_address */
+  uint64_t compare_add;
+  uint64_t swap;
 };
 
 class ConnectionProc {
 public:
-  ConnectionProc() {};
+  ConnectionProc() : thread_alive(false), msg_channel(NULL),
+                     remote_ring_ready(false) {
+    conn_ctx.cm_id_control = NULL;
+    conn_ctx.cm_id = NULL;
+    conn_ctx.cm_channel = NULL;
+    conn_ctx.context = NULL;
+    conn_ctx.comp_channel = NULL;
+    conn_ctx.pd = NULL;
+    conn_ctx.cq = NULL;
+    conn_ctx.qp = NULL;
+    memset(conn_ctx.qps, 0, sizeof(conn_ctx.qps));
+    conn_ctx.meta_recv_mr = NULL;
+    conn_ctx.meta_send_mr = NULL;
+    conn_ctx.meta_recv = NULL;
+    conn_ctx.meta_send = NULL;
+    conn_ctx.cq_poller_running = false;
+  };
   virtual ~ConnectionProc() {};
 
   virtual int16_t run() = 0;
@@ -106,29 +204,115 @@ public:
   bool is_server() {
     return (conn_params.env->machine == SERVER);
   }
+  bool is_connected() {
+    return __atomic_load_n(&conn_params.connected, __ATOMIC_ACQUIRE);
+  }
+  /* rdma reads this side may have in flight per qp */
+  int get_out_reads() { return conn_params.out_reads; }
+  /* wrs one qp takes before ibv_post_send fails */
+  int get_tx_depth() { return conn_params.tx_depth; }
+  /* qps the rdma ops are striped over */
+  int get_active_qps() { return conn_params.active_qps; }
+  /* live counters, see MetricsExporter */
+  conn_metrics *get_metrics() { return &metrics; }
+
+  /* local memory registered on this connection's pd */
+  MemoryMagr *get_mem_magr() { return &local_mem; }
+  /* pin new local blocks, advertise them to the peer if connected */
+  int16_t pin_memory(ibv_access_flags flags, uint64_t len = FIX_BLOCK_LENGTH,
+                     uint64_t *voff = NULL);
+  /* pin a small region, in device memory when the nic has some left,
+  see Pinned_Small_Memory. Advertised like pin_memory */
+  int16_t pin_small_memory(ibv_access_flags flags, uint64_t len, uint64_t *voff,
+                           bool device = true);
+  /* fault local blocks in ahead of use in on demand paging mode */
+  int16_t prefetch_memory(uint64_t voff, uint64_t len, bool write = true) {
+    return local_mem.prefetch(conn_ctx.pd, voff, len, write) ? SUCCESS : FAILURE;
+  }
+  /* fill info.dst_mr and info.offset for the peer's virtual offset voff */
+  int16_t lookup_remote_mr(uint64_t voff, rdma_mem_info &info);
+
+  /* Directly rdma read/write, Note: the memory must be registered by reletive mr.
+  With several qps, ops of RDMA_STRIPE_MIN and more which carry a req and
+  no imm are split across them, req completes once every chunk did. The
+  chunks land in any order, only req->wait() orders them with later ops.
+  FAILURE means nothing was posted. A stripe that fails half way returns
+  SUCCESS, its req reports the failure once the posted chunks complete */
+  int16_t rdma_write(rdma_mem_info &info);
+  int16_t rdma_read(rdma_mem_info &info);
+  /* send wrs an op of length puts on its busiest qp, what a send queue
+  of tx_depth must fit per op in flight */
+  int send_wrs_per_qp(uint32_t length);
+  /* 64 bit atomics on a remote word pinned with IBV_ACCESS_REMOTE_ATOMIC,
+  info.length is 8. Atomic against other rdma atomics only, not against
+  plain writes or the owner's cpu */
+  int16_t rdma_fetch_add(rdma_mem_info &info, uint64_t add);
+  int16_t rdma_cmp_swap(rdma_mem_info &info, uint64_t compare, uint64_t swap);
+
+  /* frames written with immediate go to this channel */
+  void set_channel(RdmaChannel *ch) { msg_channel = ch; }
+  /* tell the peer where it may write frames */
+  int16_t advertise_ring(const ring_desc &ring);
+  /* the ring the peer advertised, false until it arrived */
+  bool get_remote_ring(ring_desc *ring) {
+    if (!remote_ring_ready.load(std::memory_order_acquire)) {
+      return false;
+    }
+    *ring = remote_ring;
+    return true;
+  }
 protected:
   /* variables */
   conn_parameter  conn_params;
   conn_context    conn_ctx;
   conn_callback   conn_calls;
   std::atomic_bool  thread_alive;
+  MemoryMagr      local_mem;
+  Remote_Memory   remote_mem;  /* regions advertised by the peer */
+  RdmaChannel     *msg_channel;
+  ring_desc       remote_ring;
+  std::atomic_bool  remote_ring_ready;
+  conn_metrics    metrics;
 
   /* functions */
   virtual int16_t on_connection(rdma_cm_id *id) = 0;
   virtual int16_t on_disconnect(rdma_cm_id *id) = 0;
   virtual int16_t on_event(rdma_cm_event *event) = 0;
 
-  // /* deal with received meta message */
-  // void on_meta_message();
+  /* deal with received meta message */
+  void on_meta_message(MetaMessage *msg);
 
   void register_message_memory();
   int16_t build_connection(rdma_cm_id *id);
   void destroy_connection();
-
-  /* recv "meta_recv" message from the remote */
-  int16_t post_meta_recv_wr();
-  /* send "meta_send" message to the remote */
-  int16_t post_meta_send_wr();
+  /* free what build_connection made of a connection that never came
+  up, once its cm events are done. The cq poller is cancelled */
+  void release();
+  /* the connection is established, advertise what we have */
+  int16_t on_established();
+
+  /* recv a "meta_recv" slot message from the remote */
+  int16_t post_meta_recv_wr(MetaMessage *msg);
+  /* send a "meta_send" slot message to the remote */
+  int16_t post_meta_send_wr(MetaMessage *msg);
+  /* wait for a free "meta_send" slot, lock holds meta_mutex and is
+  dropped while waiting. NULL once the connection is going down, or on
+  the poller, which would have to complete the sends itself */
+  MetaMessage *get_meta_send_slot(std::unique_lock<std::mutex> &lock);
+
+  /* send the whole local region table, the peer replaces its cache */
+  int16_t advertise_local_regions();
+  /* send regions in META_MAX_REGIONS batches */
+  int16_t advertise_regions(const remote_mr *regions, size_t num, bool reset);
+
+  /* create the qps after the first one on the same pd and cq */
+  int16_t create_extra_qps(ibv_qp_init_attr &qp_attr);
+  /* send our qps to the peer */
+  int16_t advertise_qps();
+  /* bring the extra qps to rts against the peer's, then ack */
+  int16_t connect_qps(const qp_desc *remote, uint32_t num);
+  /* start striping if both sides are ready, meta_mutex must be held */
+  void update_qps_ready();
 
 
   // /* get imm_data of RDMA based on the imm_code and user_data, imm_code no more than
@@ -136,15 +320,20 @@ protected:
   // uint32_t get_rdma_imm_data(uint32_t imm_code, uint32_t user_data);
 
 
-  /* Directly rdma read/write, Note: the memory must be registered by reletive mr */
-  int16_t rdma_write(rdma_mem_info &info);
-  int16_t rdma_read(rdma_mem_info &info);
+  /* wr_id of a meta recv/send slot, anything else is an rdma_request */
+  bool is_meta_slot(uint64_t wr_id);
+  bool is_meta_send_slot(uint64_t wr_id);
 
   typedef enum DmaType {
     RDMA_REMOTE_WRITE = 1,  // RDMA remote write
-    RDMA_REMOTE_READ = 2  // RDMA remote read
+    RDMA_REMOTE_READ = 2,  // RDMA remote read
+    RDMA_REMOTE_FETCH_ADD = 3,  // RDMA atomic fetch and add
+    RDMA_REMOTE_CMP_SWAP = 4  // RDMA atomic compare and swap
   } DmaType_t;
   int16_t rdma_op(DmaType_t dma_type, rdma_mem_info &info);
+  /* one wr for length bytes at offset of info */
+  int16_t post_rdma_wr(ibv_qp *qp, DmaType_t dma_type, rdma_mem_info &info,
+                       uint32_t offset, uint32_t length);
 };
 
 class RDMAServer : public ConnectionProc {
@@ -160,7 +349,10 @@ protected:
   virtual int16_t on_disconnect(rdma_cm_id *id);
   virtual int16_t on_event(rdma_cm_event *event);
 
-  int16_t on_connect_request(rdma_cm_id *id);
+  /* peer carries the client's initiator_depth and responder_resources */
+  int16_t on_connect_request(rdma_cm_id *id, const rdma_conn_param *peer);
+  /* listen, accept and serve cm events on the id run created */
+  int16_t run_events();
 };
 
 class RDMAClient : public ConnectionProc {
@@ -178,4 +370,6 @@ protected:
 
   int16_t on_addr_resolved(rdma_cm_id *id);
   int16_t on_route_resolved(rdma_cm_id *id);
+  /* resolve, connect and serve cm events on the id run created */
+  int16_t run_events();
 };
\ No newline at end of file
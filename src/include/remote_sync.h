@@ -0,0 +1,108 @@
+#pragma once
+
+#include "rdma_com.h"
+
+/* Coordination on the peer's memory with rdma atomics only, the peer
+CPU is not involved. Every word lives in a block the owner pinned with
+IBV_ACCESS_REMOTE_ATOMIC and zeroed before advertising it. The words are
+only coherent among rdma atomics, they must not be written with plain
+rdma writes or by the owner's CPU while in use. */
+
+/* blocking atomics on remote words, shared by the primitives below */
+class RemoteAtomics {
+public:
+  RemoteAtomics(ConnectionProc *conn) : conn(conn), scratch(NULL),
+      scratch_mr(NULL), next_slot(0) {};
+  ~RemoteAtomics() {};
+
+  /* pin the local block the old values land in */
+  int16_t open();
+
+  /* *old gets the value before the operation */
+  int16_t fetch_add(uint64_t voff, uint64_t add, uint64_t *old);
+  int16_t cmp_swap(uint64_t voff, uint64_t compare, uint64_t swap,
+                   uint64_t *old);
+  /* an atomic read, a fetch_add of 0 */
+  int16_t read(uint64_t voff, uint64_t *value) {
+    return fetch_add(voff, 0, value);
+  }
+
+private:
+  ConnectionProc  *conn;
+  uint64_t        *scratch;
+  ibv_mr          *scratch_mr;
+  /* every call takes its own 8 byte slot of the block, at most
+  FIX_BLOCK_LENGTH / 8 calls may be in flight across threads */
+  std::atomic<uint64_t> next_slot;
+
+  int16_t atomic_op(bool cas, uint64_t voff, uint64_t compare_add,
+                    uint64_t swap, uint64_t *old);
+};
+
+/* sequence numbers handed out by a remote word */
+class RemoteCounter {
+public:
+  RemoteCounter(RemoteAtomics *atomics, uint64_t voff) : atomics(atomics),
+      voff(voff) {};
+
+  /* reserve n numbers, *seq is the first */
+  int16_t next(uint64_t *seq, uint64_t n = 1) {
+    return atomics->fetch_add(voff, n, seq);
+  }
+  int16_t get(uint64_t *value) { return atomics->read(voff, value); }
+
+private:
+  RemoteAtomics *atomics;
+  uint64_t      voff;
+};
+
+/* test and set lock, the word holds the owner id, 0 when free */
+class RemoteSpinLock {
+public:
+  RemoteSpinLock(RemoteAtomics *atomics, uint64_t voff, uint64_t owner) :
+      atomics(atomics), voff(voff), owner(owner) { assert(owner != 0); };
+
+  int16_t try_lock(bool *acquired);
+  /* spins with exponential backoff */
+  int16_t lock();
+  int16_t unlock();
+
+private:
+  RemoteAtomics *atomics;
+  uint64_t      voff;
+  uint64_t      owner;
+};
+
+/* FIFO lock, the word is [next ticket : 32][now serving : 32]. One
+fetch_add takes a ticket, the holder polls until it is served */
+class RemoteTicketLock {
+public:
+  RemoteTicketLock(RemoteAtomics *atomics, uint64_t voff) :
+      atomics(atomics), voff(voff), ticket(0) {};
+
+  int16_t lock();
+  int16_t unlock();
+
+private:
+  RemoteAtomics *atomics;
+  uint64_t      voff;
+  uint32_t      ticket;   /* held ticket between lock and unlock */
+};
+
+/* slots 0 .. num - 1 tracked by a remote bitmap of 64 bit words */
+class RemoteSlotAllocator {
+public:
+  RemoteSlotAllocator(RemoteAtomics *atomics, uint64_t bitmap_voff,
+                      uint64_t num) : atomics(atomics),
+      bitmap_voff(bitmap_voff), num(num), hint(0) {};
+
+  /* FAILURE if every slot is taken or on a transport error */
+  int16_t alloc(uint64_t *slot);
+  int16_t free(uint64_t slot);
+
+private:
+  RemoteAtomics *atomics;
+  uint64_t      bitmap_voff;
+  uint64_t      num;
+  uint64_t      hint;   /* word to try first, spreads the callers */
+};
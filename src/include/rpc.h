@@ -0,0 +1,103 @@
+#pragma once
+
+#include <unordered_map>
+
+#include "rdma_channel.h"
+#include "worker_pool.h"
+
+/* Request/response layer on top of RdmaChannel. Every frame starts with
+
+  [type : 2][opcode : 2][status : 4][id : 8]
+
+type is RdmaMessage::MSG_CMD for a request and MSG_DONE for its
+response, id matches a response to the pending call. Requests run on
+the WorkerPool, never on the thread that received them. Responses stay
+in the channel batch while other requests are queued or running and go
+out with the last one in flight, or once RPC_RESPONSE_BATCH of them
+piled up.
+
+In CHANNEL_POLL mode a blocking call polls the channel itself whenever
+no other thread does, so it may be made from the only polling thread,
+but not from a handler running without a pool. */
+
+typedef msg_schema<uint16_t, uint16_t, uint32_t, uint64_t> rpc_head;
+enum { RPC_HEAD_TYPE = 0, RPC_HEAD_OPCODE, RPC_HEAD_STATUS, RPC_HEAD_ID };
+
+#define RPC_HEAD_LEN        rpc_head::size
+#define RPC_RESPONSE_BATCH  32
+
+enum rpc_status : int32_t {
+  RPC_OK = 0,
+  RPC_NO_HANDLER = -1,
+  RPC_FAILED = -2
+};
+
+/* runs on a worker, fills reply and returns the status for the caller */
+typedef std::function<int32_t(const byte *data, uint32_t length,
+                              std::vector<byte> &reply)> rpc_handler;
+/* runs on the receiving thread, data is only valid until it returns */
+typedef std::function<void(int32_t status, const byte *data,
+                           uint32_t length)> rpc_callback;
+
+class RpcEndpoint {
+public:
+  /* pool NULL runs handlers on the receiving thread */
+  RpcEndpoint(ConnectionProc *conn, WorkerPool *pool,
+              channel_mode mode = CHANNEL_IMM);
+  ~RpcEndpoint() {};
+
+  /* register every handler before open */
+  void register_handler(uint16_t opcode, rpc_handler handler) {
+    handlers[opcode] = handler;
+  }
+  int16_t open() { return channel.open(); }
+  /* crc32c on the frames we send, see RdmaChannel::set_checksum */
+  void set_checksum(bool on) { channel.set_checksum(on); }
+  bool ready() { return channel.ready(); }
+
+  /* cb gets the response, leave flush false to batch several calls */
+  int16_t call_async(uint16_t opcode, const byte *data, uint32_t length,
+                     rpc_callback cb, bool flush = true);
+  /* blocking call, status is the handler's return. FAILURE if the
+  channel fails before the response arrived */
+  int16_t call(uint16_t opcode, const byte *data, uint32_t length,
+               std::vector<byte> &reply, int32_t *status);
+  int16_t flush() { return channel.flush(); }
+
+  /* CHANNEL_POLL mode receive, see RdmaChannel::poll. Returns 0 while
+  another thread polls */
+  int poll();
+
+private:
+  RdmaChannel   channel;
+  channel_mode  mode;
+  WorkerPool    *pool;
+  std::unordered_map<uint16_t, rpc_handler> handlers;
+
+  std::mutex    call_mutex;
+  std::unordered_map<uint64_t, rpc_callback> pending;
+  std::atomic<uint64_t> next_id;
+  /* requests received and not answered yet, queued or running */
+  std::atomic<uint32_t> in_flight;
+  /* responses held back in the batch, guarded by the channel send lock */
+  uint32_t      unflushed;
+  std::atomic_bool  polling;
+
+  /* a request handed to the pool, data follows inline */
+  struct rpc_task {
+    RpcEndpoint *endpoint;
+    uint16_t    opcode;
+    uint64_t    id;
+    uint32_t    length;
+    byte        data[0];
+  };
+  static void run_rpc_task(void *arg);
+
+  /* call_async which hands out the id */
+  int16_t start_call(uint16_t opcode, const byte *data, uint32_t length,
+                     rpc_callback cb, bool flush, uint64_t *id);
+  void on_frame(byte *data, uint32_t length);
+  void serve(uint16_t opcode, uint64_t id, const byte *data, uint32_t length);
+  int16_t post_frame(uint16_t type, uint16_t opcode, int32_t status, uint64_t id,
+                     const byte *data, uint32_t length, bool flush);
+};
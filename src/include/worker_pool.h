@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+/* Worker threads for tasks that must not run in on_completion, see the
+note above poll_cq.
+
+Every worker owns a Chase-Lev deque, it pushes and pops at the bottom
+and idle workers steal from the top of the others. A thread outside the
+pool (a cq poller) gets its own deque on its first dispatch, which it
+only pushes to and the workers steal from, so handing a task off never
+takes a lock. Only when all source deques are taken or a deque is full
+the task goes through the locked overflow queue. The deque of a thread
+that exits is handed to the next new source. */
+
+#define WORK_DEQUE_SIZE   4096
+#define MAX_WORK_SOURCES  64
+/* rounds a worker looks for work before it sleeps */
+#define WORK_SPIN_ROUNDS  1024
+
+/* zero allocation task, arg is owned by the caller until fn returns */
+typedef void (*work_fn)(void *arg);
+struct work_item {
+  work_fn fn;
+  void    *arg;
+};
+
+/* convenience task, costs an allocation per dispatch */
+typedef std::function<void()> work_task;
+
+/* bounded Chase-Lev deque (Le et al., PPoPP'13) */
+class WorkDeque {
+public:
+  explicit WorkDeque(size_t capacity);
+  ~WorkDeque();
+
+  /* owner only, false if full */
+  bool push(const work_item &w);
+  /* owner only, newest first */
+  bool pop(work_item *w);
+  /* any thread, oldest first */
+  bool steal(work_item *w);
+  size_t size();
+
+private:
+  struct slot {
+    std::atomic<work_fn> fn;
+    std::atomic<void *>  arg;
+  };
+  slot    *buffer;
+  int64_t mask;
+  /* padded apart, thieves hammer top while the owner moves bottom, no
+  alignas since c++11 new does not honour it */
+  char    pad0[CACHE_LINE_SIZE];
+  std::atomic<int64_t> top;
+  char    pad1[CACHE_LINE_SIZE];
+  std::atomic<int64_t> bottom;
+};
+
+/* the node of the cpu the caller runs on, 0 without numa information */
+int current_numa_node();
+
+class WorkerPool {
+public:
+  /* numa_node >= 0 binds every worker to the cpus of that node, pass
+  current_numa_node() from the poller to keep its tasks on its node */
+  explicit WorkerPool(uint32_t num, int numa_node = -1);
+  ~WorkerPool();
+
+  /* run fn(arg) on a worker */
+  void dispatch(work_fn fn, void *arg);
+  void dispatch(work_task task);
+  /* tasks queued but not picked up yet, approximate */
+  size_t pending();
+
+private:
+  friend struct work_tls;
+
+  /* unique over the process, a pool at the address of a destroyed one
+  is told apart by it */
+  uint64_t                  id;
+  std::vector<std::thread>  workers;
+  std::vector<WorkDeque *>  worker_queues;
+  std::atomic<WorkDeque *>  source_queues[MAX_WORK_SOURCES];
+  /* the feeding thread exited, the deque is free to adopt */
+  std::atomic_bool          source_free[MAX_WORK_SOURCES];
+  std::atomic<uint32_t>     num_sources;
+  int                       numa_node;
+
+  /* overflow queue and parking */
+  std::deque<work_item>     tasks;
+  std::mutex                task_mutex;
+  std::condition_variable   task_cond;
+  std::atomic<uint32_t>     sleeping;
+  std::atomic_bool          stopping;
+
+  void worker_loop(uint32_t idx);
+  bool find_work(uint32_t idx, work_item *w);
+  bool pop_overflow(work_item *w);
+  WorkDeque *local_queue();
+  WorkDeque *adopt_source(uint32_t slot, WorkDeque *q);
+  void wake_one();
+};
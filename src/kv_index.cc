@@ -0,0 +1,339 @@
+#include "kv_index.h"
+
+#define KV_ACCESS_FLAGS \
+  (ibv_access_flags)(IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ)
+/* client scratch block: [meta][bucket][bucket][item ...] */
+#define KV_SCRATCH_BUCKETS  sizeof(kv_index_meta)
+#define KV_SCRATCH_ITEM     (KV_SCRATCH_BUCKETS + 2 * sizeof(kv_bucket))
+
+static inline uint64_t kv_item_size(uint64_t vlen) {
+  return KV_ITEM_HEAD_LEN + ((vlen + 7) & ~(uint64_t)7) + KV_ITEM_TAIL_LEN;
+}
+
+/********** server **********/
+int16_t KVIndexServer::create(uint64_t num, uint64_t *root_voff) {
+  MemoryMagr *mem = conn->get_mem_magr();
+  uint64_t len = sizeof(kv_index_meta) + num * sizeof(kv_bucket);
+  uint64_t voff;
+
+  len = (len + FIX_BLOCK_LENGTH - 1) / FIX_BLOCK_LENGTH * FIX_BLOCK_LENGTH;
+  if (num == 0 || conn->pin_memory(KV_ACCESS_FLAGS, len, &voff)) {
+    return FAILURE;
+  }
+  for (uint64_t off = voff; off < voff + len; off += FIX_BLOCK_LENGTH) {
+    memset(mem->get_local_address(off), 0, FIX_BLOCK_LENGTH);
+  }
+
+  bucket_num = num;
+  bucket_voff = voff + sizeof(kv_index_meta);
+
+  kv_index_meta *meta = (kv_index_meta *)mem->get_local_address(voff);
+  meta->bucket_num = bucket_num;
+  meta->bucket_voff = bucket_voff;
+  std::atomic_thread_fence(std::memory_order_release);
+  meta->magic = KV_INDEX_MAGIC;
+
+  *root_voff = voff;
+  return SUCCESS;
+}
+
+int16_t KVIndexServer::alloc_item(uint64_t len, uint64_t *voff) {
+  if (len > FIX_BLOCK_LENGTH) {
+    return FAILURE;
+  }
+  auto it = free_items.find(len);
+  if (it != free_items.end() && !it->second.empty()) {
+    *voff = it->second.back();
+    it->second.pop_back();
+    return SUCCESS;
+  }
+  /* items never straddle two blocks */
+  if (item_end == 0 || item_voff + len > item_end) {
+    if (conn->pin_memory(KV_ACCESS_FLAGS, FIX_BLOCK_LENGTH, &item_voff)) {
+      return FAILURE;
+    }
+    item_end = item_voff + FIX_BLOCK_LENGTH;
+  }
+  *voff = item_voff;
+  item_voff += len;
+  /* a fresh item starts at version 0 */
+  memset(conn->get_mem_magr()->get_local_address(*voff), 0, 8);
+  return SUCCESS;
+}
+
+void KVIndexServer::free_item(uint64_t item) {
+  free_items[kv_item_len(item)].push_back(kv_item_voff(item));
+}
+
+/* x86 keeps stores in order, the fences pin the compiler ordering. The
+tail is bumped before and the head after the update, a reader fetching
+the line head first can only see head == tail when it is not torn. */
+void KVIndexServer::write_slot(uint64_t b, int s, uint64_t key, uint64_t item) {
+  kv_bucket *bk = bucket(b);
+  uint64_t v = bk->version_head + 1;
+
+  bk->version_tail = v;
+  std::atomic_thread_fence(std::memory_order_release);
+  bk->slots[s].key = key;
+  bk->slots[s].item = item;
+  std::atomic_thread_fence(std::memory_order_release);
+  bk->version_head = v;
+}
+
+bool KVIndexServer::find(uint64_t key, uint64_t *b, int *s) {
+  for (int which = 0; which < 2; which++) {
+    uint64_t idx = bucket_of(key, which);
+    kv_bucket *bk = bucket(idx);
+    for (int i = 0; i < KV_BUCKET_SLOTS; i++) {
+      if (bk->slots[i].key == key) {
+        *b = idx;
+        *s = i;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+bool KVIndexServer::find_empty(uint64_t b, int *s) {
+  kv_bucket *bk = bucket(b);
+  for (int i = 0; i < KV_BUCKET_SLOTS; i++) {
+    if (bk->slots[i].key == 0) {
+      *s = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Cuckoo displacement: walk victims to an empty slot first, then move
+them back to front so every key stays reachable during the moves. On
+success slot s of bucket b holds a stale copy and may be overwritten. */
+bool KVIndexServer::make_room(uint64_t b, int *s) {
+  struct kick_step {
+    uint64_t b;
+    int s;
+  };
+  std::vector<kick_step> path;
+  uint64_t cur = b;
+
+  for (int depth = 0; depth < KV_MAX_KICKS; depth++) {
+    int vs = -1;
+    for (int i = 0; i < KV_BUCKET_SLOTS && vs < 0; i++) {
+      int cand = (depth + i) % KV_BUCKET_SLOTS;
+      bool visited = false;
+      for (auto &st : path) {
+        visited |= (st.b == cur && st.s == cand);
+      }
+      if (!visited) {
+        vs = cand;
+      }
+    }
+    if (vs < 0) {
+      return false;
+    }
+
+    uint64_t vkey = bucket(cur)->slots[vs].key;
+    uint64_t b1 = bucket_of(vkey, 0);
+    uint64_t alt = (cur == b1) ? bucket_of(vkey, 1) : b1;
+    path.push_back({cur, vs});
+
+    int e;
+    if (find_empty(alt, &e)) {
+      uint64_t db = alt;
+      int ds = e;
+      for (auto it = path.rbegin(); it != path.rend(); ++it) {
+        kv_slot sl = bucket(it->b)->slots[it->s];
+        write_slot(db, ds, sl.key, sl.item);
+        db = it->b;
+        ds = it->s;
+      }
+      *s = path[0].s;
+      return true;
+    }
+    cur = alt;
+  }
+  return false;
+}
+
+int16_t KVIndexServer::put(uint64_t key, const byte *value, uint32_t len) {
+  std::lock_guard<std::mutex> lock(write_mutex);
+  uint64_t size = kv_item_size(len);
+  uint64_t voff, b;
+  int s;
+
+  if (key == 0 || bucket_num == 0 || alloc_item(size, &voff)) {
+    return FAILURE;
+  }
+
+  /* an update writes a new item and frees the old one once no slot
+  points to it. The version is bumped like a bucket's, tail before and
+  head after the payload */
+  byte *it = conn->get_mem_magr()->get_local_address(voff);
+  uint64_t version;
+  uint64_t vlen = len;
+  memcpy(&version, it, 8);
+  version++;
+  memcpy(it + size - KV_ITEM_TAIL_LEN, &version, 8);
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(it + 8, &key, 8);
+  memcpy(it + 16, &vlen, 8);
+  memcpy(it + KV_ITEM_HEAD_LEN, value, len);
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(it, &version, 8);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  uint64_t item = kv_item_pack(voff, size);
+  if (find(key, &b, &s)) {
+    uint64_t old = bucket(b)->slots[s].item;
+    write_slot(b, s, key, item);
+    free_item(old);
+    return SUCCESS;
+  }
+  for (int which = 0; which < 2; which++) {
+    b = bucket_of(key, which);
+    if (find_empty(b, &s)) {
+      write_slot(b, s, key, item);
+      return SUCCESS;
+    }
+  }
+  b = bucket_of(key, 0);
+  if (make_room(b, &s)) {
+    write_slot(b, s, key, item);
+    return SUCCESS;
+  }
+  /* table is too full */
+  free_item(item);
+  return FAILURE;
+}
+
+int16_t KVIndexServer::remove(uint64_t key) {
+  std::lock_guard<std::mutex> lock(write_mutex);
+  uint64_t b;
+  int s;
+
+  if (bucket_num == 0 || !find(key, &b, &s)) {
+    return FAILURE;
+  }
+  uint64_t old = bucket(b)->slots[s].item;
+  write_slot(b, s, 0, 0);
+  free_item(old);
+  return SUCCESS;
+}
+
+/********** client **********/
+int16_t KVIndexClient::open() {
+  if (conn->pin_memory(KV_ACCESS_FLAGS, FIX_BLOCK_LENGTH, &scratch_voff)) {
+    return FAILURE;
+  }
+  scratch = conn->get_mem_magr()->get_local_address(scratch_voff);
+  scratch_mr = conn->get_mem_magr()->get_pinned_mr(scratch_voff, FIX_BLOCK_LENGTH);
+
+  rdma_request req;
+  if (post_read(root_voff, sizeof(kv_index_meta), 0, &req) || !req.wait()) {
+    return FAILURE;
+  }
+
+  kv_index_meta *meta = (kv_index_meta *)scratch;
+  if (meta->magic != KV_INDEX_MAGIC) {
+    return FAILURE;
+  }
+  bucket_num = meta->bucket_num;
+  bucket_voff = meta->bucket_voff;
+  return SUCCESS;
+}
+
+int16_t KVIndexClient::post_read(uint64_t voff, uint32_t len, uint64_t local_off,
+                                 rdma_request *req) {
+  rdma_mem_info info;
+
+  memset(&info, 0, sizeof(info));
+  info.length = len;
+  if (conn->lookup_remote_mr(voff, info)) {
+    return FAILURE;
+  }
+  info.src_mr = scratch_mr;
+  info.local_address = (uint64_t)(scratch + local_off);
+  info.req = req;
+
+  return conn->rdma_read(info);
+}
+
+bool KVIndexClient::match_bucket(const kv_bucket *b, uint64_t key,
+                                 uint64_t *item, bool *torn) {
+  if (b->version_head != b->version_tail) {
+    *torn = true;
+    return false;
+  }
+  for (int i = 0; i < KV_BUCKET_SLOTS; i++) {
+    if (b->slots[i].key == key) {
+      *item = b->slots[i].item;
+      return true;
+    }
+  }
+  return false;
+}
+
+/* A key being displaced between its two buckets can be missed once,
+which a cache treats as an ordinary miss. */
+int16_t KVIndexClient::get(uint64_t key, byte *value, uint32_t *len) {
+  if (key == 0 || bucket_num == 0) {
+    return FAILURE;
+  }
+  uint64_t b1 = bucket_of(key, 0);
+  uint64_t b2 = bucket_of(key, 1);
+  const kv_bucket *lb = (const kv_bucket *)(scratch + KV_SCRATCH_BUCKETS);
+  byte *it = scratch + KV_SCRATCH_ITEM;
+
+  for (int retry = 0; retry < KV_MAX_RETRIES; retry++) {
+    /* 1st read: both candidate buckets in one round trip */
+    rdma_request breq;
+    if (post_read(bucket_voff + b1 * sizeof(kv_bucket), sizeof(kv_bucket),
+                  KV_SCRATCH_BUCKETS, &breq) ||
+        post_read(bucket_voff + b2 * sizeof(kv_bucket), sizeof(kv_bucket),
+                  KV_SCRATCH_BUCKETS + sizeof(kv_bucket), &breq)) {
+      breq.wait();
+      return FAILURE;
+    }
+    if (!breq.wait()) {
+      return FAILURE;
+    }
+
+    uint64_t item = 0;
+    bool torn = false;
+    if (!match_bucket(lb, key, &item, &torn) &&
+        !match_bucket(lb + 1, key, &item, &torn)) {
+      if (torn) {
+        continue;
+      }
+      return FAILURE;
+    }
+
+    /* 2nd read: the item itself */
+    uint32_t size = kv_item_len(item);
+    if (size < KV_ITEM_HEAD_LEN + KV_ITEM_TAIL_LEN ||
+        size > FIX_BLOCK_LENGTH - KV_SCRATCH_ITEM) {
+      return FAILURE;
+    }
+    rdma_request ireq;
+    if (post_read(kv_item_voff(item), size, KV_SCRATCH_ITEM, &ireq) ||
+        !ireq.wait()) {
+      return FAILURE;
+    }
+
+    uint64_t head, tail, ikey, vlen;
+    memcpy(&head, it, 8);
+    memcpy(&ikey, it + 8, 8);
+    memcpy(&vlen, it + 16, 8);
+    memcpy(&tail, it + size - KV_ITEM_TAIL_LEN, 8);
+    if (head != tail || ikey != key || kv_item_size(vlen) != size) {
+      /* torn, or freed and reused for another key under our feet */
+      continue;
+    }
+
+    memcpy(value, it + KV_ITEM_HEAD_LEN, std::min((uint64_t)*len, vlen));
+    *len = (uint32_t)vlen;
+    return SUCCESS;
+  }
+  return FAILURE;
+}
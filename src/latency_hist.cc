@@ -0,0 +1,62 @@
+#include <algorithm>
+
+#include "latency_hist.h"
+
+/********** LatencyHistogram **********/
+LatencyHistogram::LatencyHistogram() : buckets(LAT_HIST_BUCKETS, 0) {
+  reset();
+}
+
+void LatencyHistogram::reset() {
+  std::fill(buckets.begin(), buckets.end(), 0);
+  total = 0;
+  sum = 0;
+  min_ns = UINT64_MAX;
+  max_ns = 0;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other) {
+  for (size_t i = 0; i < LAT_HIST_BUCKETS; i++) {
+    buckets[i] += other.buckets[i];
+  }
+  total += other.total;
+  sum += other.sum;
+  min_ns = std::min(min_ns, other.min_ns);
+  max_ns = std::max(max_ns, other.max_ns);
+}
+
+uint64_t LatencyHistogram::bucket_value(size_t index) {
+  if (index < LAT_HIST_SUB_COUNT) {
+    return index;
+  }
+  int shift = (int)(index >> LAT_HIST_SUB_BITS) - 1;
+  uint64_t sub = index & (LAT_HIST_SUB_COUNT - 1);
+  uint64_t low = (LAT_HIST_SUB_COUNT + sub) << shift;
+  return low + ((1ull << shift) >> 1);
+}
+
+uint64_t LatencyHistogram::percentile(double p) const {
+  if (!total) {
+    return 0;
+  }
+  uint64_t rank = (uint64_t)(p / 100.0 * total + 0.5);
+  rank = std::max<uint64_t>(1, std::min(rank, total));
+
+  uint64_t seen = 0;
+  for (size_t i = 0; i < LAT_HIST_BUCKETS; i++) {
+    seen += buckets[i];
+    if (seen >= rank) {
+      /* the bucket middle can lie outside what was recorded */
+      return std::max(min_ns, std::min(max_ns, bucket_value(i)));
+    }
+  }
+  return max_ns;
+}
+
+/********** AtomicHistogram **********/
+void AtomicHistogram::snapshot(std::vector<uint64_t> &counts) const {
+  counts.resize(LAT_HIST_BUCKETS);
+  for (size_t i = 0; i < LAT_HIST_BUCKETS; i++) {
+    counts[i] = buckets[i].load(std::memory_order_relaxed);
+  }
+}
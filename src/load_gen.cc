@@ -0,0 +1,602 @@
+#include <getopt.h>
+#include <string.h>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "bench_util.h"
+
+/* Load generator in the shape our services run: T client threads, each
+multiplexing C connections of its own, T * C in total.
+
+  loadgen <env options> [-- <load options>]
+
+  -T, --threads   client threads (default 1)
+  -C, --conns     connections per thread (default 1)
+  -l, --loop      closed (default): every connection keeps depth ops in
+                  flight; open: ops arrive as a Poisson process at rate
+  -R, --rate      open loop arrivals per second over all threads
+  -S, --schedule  open loop arrivals, poisson (default) or fixed, one
+                  every 1 / rate per thread
+  -D, --depth     ops in flight per connection, the cap in open loop
+                  (default 16)
+  -x, --reads     percent of the ops that are reads (default 50)
+  -b, --size      bytes per op (default 4096)
+  -d, --duration  milliseconds (default 5000)
+  -f, --format    csv (default) or json
+  -w, --output    file instead of stdout
+  -M, --metrics   stream live json samples to a file or unix:<path>
+  -i, --interval  milliseconds between live samples (default 1000)
+  -c, --counters  hca port counters added to the live samples, e.g.
+                  port_xmit_data,port_rcv_data,out_of_buffer,np_cnp_sent
+  -k, --skew-ns   largest cross-core clock skew for valid latencies
+                  (default 100)
+
+Connection i uses port K + i, the server runs with the same -T and -C
+so it listens on all of them, pins a block per connection and idles.
+Ops go to a random size aligned offset in that block. One row per
+thread and aggregate rows for reads, writes and all ops.
+
+Latency is taken from the time an op was meant to be sent. In closed
+loop that is when it was posted. In open loop it is its slot in the
+arrival schedule, so an arrival that found every slot of its thread busy
+carries the wait. Measuring from the post instead hides exactly the ops
+a stall delayed (coordinated omission), the "service" row has that view
+for comparison. */
+
+#define LOAD_CONNECT_TRIES  100
+
+static struct option load_options[] = {
+  { name : "threads",   has_arg : 1, flag : NULL, val : 'T' },
+  { name : "conns",     has_arg : 1, flag : NULL, val : 'C' },
+  { name : "loop",      has_arg : 1, flag : NULL, val : 'l' },
+  { name : "rate",      has_arg : 1, flag : NULL, val : 'R' },
+  { name : "schedule",  has_arg : 1, flag : NULL, val : 'S' },
+  { name : "depth",     has_arg : 1, flag : NULL, val : 'D' },
+  { name : "reads",     has_arg : 1, flag : NULL, val : 'x' },
+  { name : "size",      has_arg : 1, flag : NULL, val : 'b' },
+  { name : "duration",  has_arg : 1, flag : NULL, val : 'd' },
+  { name : "format",    has_arg : 1, flag : NULL, val : 'f' },
+  { name : "output",    has_arg : 1, flag : NULL, val : 'w' },
+  { name : "metrics",   has_arg : 1, flag : NULL, val : 'M' },
+  { name : "interval",  has_arg : 1, flag : NULL, val : 'i' },
+  { name : "counters",  has_arg : 1, flag : NULL, val : 'c' },
+  { name : "skew-ns",   has_arg : 1, flag : NULL, val : 'k' },
+  {0}
+};
+
+struct load_params {
+  int           threads;
+  int           conns;
+  bool          open_loop;
+  double        rate;
+  bool          fixed_schedule;
+  int           depth;
+  int           read_percent;
+  uint32_t      size;
+  int           duration_ms;
+  bench_format  format;
+  const char    *output;
+  const char    *metrics;
+  int           interval_ms;
+  const char    *counters;
+  int64_t       skew_ns;
+};
+
+enum load_op {
+  LOAD_IDLE = 0,
+  LOAD_READ,
+  LOAD_WRITE
+};
+
+/* one connection of a thread and its slots */
+struct load_conn {
+  ConnectionProc            *conn = nullptr;
+  rdma_mem_info             base;
+  std::vector<rdma_request> reqs;
+  std::vector<uint64_t>     start;      /* posted */
+  std::vector<uint64_t>     intended;   /* due by the schedule */
+  std::vector<uint8_t>      op;
+  int                       inflight;
+};
+
+struct load_worker {
+  std::vector<load_conn>  conns;
+  LatencyHistogram        lat[2];       /* reads, writes, from intended */
+  LatencyHistogram        service[2];   /* from posted */
+  uint64_t                ops[2];
+  uint64_t                errors;
+  /* open loop arrivals that were due but not posted when it stopped */
+  uint64_t                missed;
+  /* what the metrics exporter samples, NULL without -M */
+  AtomicHistogram         *live;
+};
+
+static int16_t parse_load_params(int argc, char *argv[], load_params *lp) {
+  lp->threads = 1;
+  lp->conns = 1;
+  lp->open_loop = false;
+  lp->rate = 0;
+  lp->fixed_schedule = false;
+  lp->depth = 16;
+  lp->read_percent = 50;
+  lp->size = 4096;
+  lp->duration_ms = 5000;
+  lp->format = BENCH_CSV;
+  lp->output = NULL;
+  lp->metrics = NULL;
+  lp->interval_ms = 1000;
+  lp->counters = NULL;
+  lp->skew_ns = BENCH_SKEW_NS;
+
+  /* see tc_bench.cc, argv[0] stands for the "--" */
+  optind = 0;
+  while (1) {
+    int ch = getopt_long(argc, argv, "T:C:l:R:S:D:x:b:d:f:w:M:i:c:k:", load_options, NULL);
+    if (ch == -1) {
+      break;
+    }
+    switch (ch) {
+      case 'T': { lp->threads = atoi(optarg); } break;
+      case 'C': { lp->conns = atoi(optarg); } break;
+      case 'l': {
+        if (!strcmp(optarg, "open")) {
+          lp->open_loop = true;
+        } else if (strcmp(optarg, "closed")) {
+          fprintf(stderr, "Loop is open or closed\n");
+          return FAILURE;
+        }
+      } break;
+      case 'R': { lp->rate = atof(optarg); } break;
+      case 'S': {
+        if (!strcmp(optarg, "fixed")) {
+          lp->fixed_schedule = true;
+        } else if (strcmp(optarg, "poisson")) {
+          fprintf(stderr, "Schedule is poisson or fixed\n");
+          return FAILURE;
+        }
+      } break;
+      case 'D': { lp->depth = atoi(optarg); } break;
+      case 'x': { lp->read_percent = atoi(optarg); } break;
+      case 'b': { lp->size = (uint32_t)strtoul(optarg, NULL, 0); } break;
+      case 'd': { lp->duration_ms = atoi(optarg); } break;
+      case 'f': {
+        if (!parse_format(optarg, &lp->format)) {
+          fprintf(stderr, "Format is csv or json\n");
+          return FAILURE;
+        }
+      } break;
+      case 'w': { lp->output = optarg; } break;
+      case 'M': { lp->metrics = optarg; } break;
+      case 'i': { lp->interval_ms = atoi(optarg); } break;
+      case 'c': { lp->counters = optarg; } break;
+      case 'k': { lp->skew_ns = atoll(optarg); } break;
+    default:
+      return FAILURE;
+      break;
+    }
+  }
+
+  if (lp->threads <= 0 || lp->conns <= 0 || lp->depth <= 0 ||
+      lp->duration_ms <= 0 || lp->interval_ms <= 0) {
+    fprintf(stderr, "Threads, conns, depth, duration and interval must be positive\n");
+    return FAILURE;
+  }
+  if (lp->read_percent < 0 || lp->read_percent > 100) {
+    fprintf(stderr, "Reads is a percentage\n");
+    return FAILURE;
+  }
+  if (!lp->size || lp->size > FIX_BLOCK_LENGTH) {
+    fprintf(stderr, "Size must be in [1, %lu]\n", FIX_BLOCK_LENGTH);
+    return FAILURE;
+  }
+  if (lp->open_loop && lp->rate <= 0) {
+    fprintf(stderr, "Open loop needs a positive rate\n");
+    return FAILURE;
+  }
+  return SUCCESS;
+}
+
+/* Connection i listens or connects on port K + i. A client that came
+before its listener is rejected, so it tries again for a while. */
+static ConnectionProc *load_connect(EnvironmentProc *base, int i,
+                                    std::vector<EnvironmentProc *> &envs) {
+  EnvironmentProc *env = new EnvironmentProc(*base);
+  env->get_params()->server_port += i;
+  envs.push_back(env);
+  for (int tries = 0; tries < LOAD_CONNECT_TRIES; tries++) {
+    ConnectionProc *conn = bench_connect(env);
+    if (conn) {
+      return conn;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  return nullptr;
+}
+
+static int16_t setup_conn(ConnectionProc *conn, int depth, load_conn *lc) {
+  uint64_t local_voff;
+
+  lc->conn = conn;
+  if (conn->pin_memory((ibv_access_flags)IBV_ACCESS_LOCAL_WRITE,
+                       FIX_BLOCK_LENGTH, &local_voff)) {
+    fprintf(stderr, "Couldn't pin the local block\n");
+    return FAILURE;
+  }
+  memset(&lc->base, 0, sizeof(lc->base));
+  while (conn->lookup_remote_mr(0, lc->base)) {
+    if (!conn->is_alive()) {
+      return FAILURE;
+    }
+  }
+  lc->base.local_address =
+      (uint64_t)conn->get_mem_magr()->get_local_address(local_voff);
+  lc->base.src_mr = conn->get_mem_magr()->get_pinned_mr(local_voff, FIX_BLOCK_LENGTH);
+  lc->reqs = std::vector<rdma_request>(depth);
+  lc->start.assign(depth, 0);
+  lc->intended.assign(depth, 0);
+  lc->op.assign(depth, LOAD_IDLE);
+  lc->inflight = 0;
+  return SUCCESS;
+}
+
+/* completions of one connection, returns how many slots it freed */
+static int reap(load_conn &lc, load_worker *w) {
+  int freed = 0;
+  if (!lc.inflight) {
+    return 0;
+  }
+  uint64_t now = 0;
+  for (size_t i = 0; i < lc.op.size(); i++) {
+    if (lc.op[i] == LOAD_IDLE ||
+        lc.reqs[i].pending.load(std::memory_order_acquire) > 0) {
+      continue;
+    }
+    if (!now) {
+      now = now_ns();
+    }
+    int k = lc.op[i] == LOAD_READ ? 0 : 1;
+    if (lc.reqs[i].failed.load()) {
+      lc.reqs[i].failed.store(false);
+      w->errors++;
+    } else {
+      w->lat[k].record(now - lc.intended[i]);
+      if (w->live) {
+        w->live->record(now - lc.intended[i]);
+      }
+      w->service[k].record(now - lc.start[i]);
+      w->ops[k]++;
+    }
+    lc.op[i] = LOAD_IDLE;
+    lc.inflight--;
+    freed++;
+  }
+  return freed;
+}
+
+/* posts one op into a free slot of lc, false if there is none.
+intended 0 means now. */
+static bool issue(load_conn &lc, bool read, uint32_t size, uint32_t offset,
+                  uint64_t intended, load_worker *w) {
+  for (size_t i = 0; i < lc.op.size(); i++) {
+    if (lc.op[i] != LOAD_IDLE) {
+      continue;
+    }
+    rdma_mem_info info = lc.base;
+    info.length = size;
+    info.offset = offset;
+    info.req = &lc.reqs[i];
+    lc.start[i] = now_ns();
+    lc.intended[i] = intended ? intended : lc.start[i];
+    if (read ? lc.conn->rdma_read(info) : lc.conn->rdma_write(info)) {
+      w->errors++;
+      return true;
+    }
+    lc.op[i] = read ? LOAD_READ : LOAD_WRITE;
+    lc.inflight++;
+    return true;
+  }
+  return false;
+}
+
+static void load_thread(const load_params *lp, int id,
+                        const std::atomic_bool *stop, load_worker *w) {
+  std::mt19937_64 rng(now_ns() + id);
+  std::uniform_int_distribution<int> percent(0, 99);
+  std::uniform_int_distribution<uint32_t> slot(0, FIX_BLOCK_LENGTH / lp->size - 1);
+  /* arrivals per ns of this thread, unused in closed loop */
+  std::exponential_distribution<double> poisson(
+      lp->open_loop ? lp->rate / lp->threads / 1e9 : 1.0);
+  double fixed_gap = lp->open_loop ? lp->threads * 1e9 / lp->rate : 0;
+  /* fractional ns carried over so a fixed schedule keeps the rate */
+  double next_exact;
+  size_t nconn = w->conns.size();
+  size_t rr = 0;
+  uint64_t next_ns = now_ns();
+  next_exact = (double)next_ns;
+
+  while (!stop->load(std::memory_order_relaxed)) {
+    for (auto &lc : w->conns) {
+      reap(lc, w);
+    }
+
+    if (!lp->open_loop) {
+      /* closed loop, refill every free slot */
+      for (auto &lc : w->conns) {
+        for (int n = lp->depth - lc.inflight; n > 0; n--) {
+          issue(lc, percent(rng) < lp->read_percent, lp->size,
+                slot(rng) * lp->size, 0, w);
+        }
+      }
+      continue;
+    }
+
+    /* open loop, every arrival that is due goes to the next connection
+    with a free slot, round robin. One that finds none stays due and
+    keeps its place in the schedule. */
+    while (now_ns() >= next_ns) {
+      bool read = percent(rng) < lp->read_percent;
+      uint32_t offset = slot(rng) * lp->size;
+      size_t k = 0;
+      for (; k < nconn; k++) {
+        if (issue(w->conns[(rr + k) % nconn], read, lp->size, offset,
+                  next_ns, w)) {
+          break;
+        }
+      }
+      if (k == nconn) {
+        break;
+      }
+      rr = (rr + k + 1) % nconn;
+      next_exact += lp->fixed_schedule ? fixed_gap : poisson(rng);
+      next_ns = (uint64_t)next_exact;
+    }
+  }
+
+  if (lp->open_loop) {
+    uint64_t end = now_ns();
+    for (w->missed = 0; next_ns <= end; w->missed++) {
+      next_exact += lp->fixed_schedule ? fixed_gap : poisson(rng);
+      next_ns = (uint64_t)next_exact;
+    }
+  }
+
+  for (auto &lc : w->conns) {
+    while (lc.inflight) {
+      reap(lc, w);
+    }
+  }
+}
+
+static void fill_result(const load_params *lp, const char *op, int threads,
+                        uint64_t ops, uint64_t errors, double seconds,
+                        const LatencyHistogram *lat, bench_result *r) {
+  r->suite = "loadgen";
+  r->op = op;
+  r->size = lp->size;
+  r->depth = lp->depth;
+  r->threads = threads;
+  r->conns = threads * lp->conns;
+  r->ops = ops;
+  r->errors = errors;
+  r->seconds = seconds;
+  r->target_kops = lp->open_loop ? lp->rate * threads / lp->threads / 1e3 : 0;
+  r->lat = lat;
+}
+
+static int run_load(EnvironmentProc *env, load_params &lp, BenchReport &report,
+                    std::vector<load_worker> &workers,
+                    std::vector<EnvironmentProc *> &envs) {
+  for (int t = 0; t < lp.threads; t++) {
+    workers[t].conns.resize(lp.conns);
+    workers[t].ops[0] = workers[t].ops[1] = workers[t].errors = 0;
+    workers[t].missed = 0;
+    workers[t].live = NULL;
+    for (int c = 0; c < lp.conns; c++) {
+      ConnectionProc *conn = load_connect(env, t * lp.conns + c, envs);
+      if (!conn || setup_conn(conn, lp.depth, &workers[t].conns[c])) {
+        fprintf(stderr, "Connection %d failed\n", t * lp.conns + c);
+        return FAILURE;
+      }
+      /* a striped op takes a wr on every lane it spans */
+      int wrs = conn->send_wrs_per_qp(lp.size);
+      if (lp.depth * wrs > conn->get_tx_depth()) {
+        fprintf(stderr, "Depth %d x %d wrs per op is above tx depth %d\n",
+                lp.depth, wrs, conn->get_tx_depth());
+        return FAILURE;
+      }
+    }
+  }
+
+  report.note("loadgen %d threads x %d conns, %s loop, %d%% reads, %u bytes",
+              lp.threads, lp.conns,
+              !lp.open_loop ? "closed" : lp.fixed_schedule ? "open fixed" :
+                                                             "open poisson",
+              lp.read_percent, lp.size);
+
+  MetricsExporter exporter;
+  if (lp.metrics) {
+    if (exporter.open(lp.metrics)) {
+      return FAILURE;
+    }
+    if (lp.counters &&
+        exporter.add_port_counters(ibv_get_device_name(env->get_context()->device),
+                                   env->get_params()->ib_port, lp.counters)) {
+      fprintf(stderr, "Couldn't open the port counters %s\n", lp.counters);
+      return FAILURE;
+    }
+    for (int t = 0; t < lp.threads; t++) {
+      workers[t].live = new AtomicHistogram();
+      exporter.add_histogram(workers[t].live);
+      for (int c = 0; c < lp.conns; c++) {
+        exporter.add_connection("conn" + std::to_string(t * lp.conns + c),
+                                workers[t].conns[c].conn);
+      }
+    }
+    exporter.start(lp.interval_ms);
+  }
+
+  std::atomic_bool stop(false);
+  std::vector<std::thread> ts;
+  uint64_t start = now_ns();
+  for (int t = 0; t < lp.threads; t++) {
+    ts.emplace_back(load_thread, &lp, t, &stop, &workers[t]);
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(lp.duration_ms));
+  stop.store(true);
+  for (auto &t : ts) {
+    t.join();
+  }
+  double seconds = (now_ns() - start) / 1e9;
+  exporter.stop();
+  for (auto &w : workers) {
+    delete w.live;
+  }
+
+  LatencyHistogram all, by_op[2], one, service;
+  uint64_t ops[2] = {0, 0}, errors = 0, missed = 0;
+  bench_result r;
+  char name[32];
+  for (int t = 0; t < lp.threads; t++) {
+    load_worker &w = workers[t];
+    one.reset();
+    one.merge(w.lat[0]);
+    one.merge(w.lat[1]);
+    snprintf(name, sizeof(name), "thread%d", t);
+    fill_result(&lp, name, 1, w.ops[0] + w.ops[1], w.errors, seconds, &one, &r);
+    report.row(r);
+
+    for (int k = 0; k < 2; k++) {
+      by_op[k].merge(w.lat[k]);
+      service.merge(w.service[k]);
+      ops[k] += w.ops[k];
+    }
+    errors += w.errors;
+    missed += w.missed;
+  }
+  all.merge(by_op[0]);
+  all.merge(by_op[1]);
+  fill_result(&lp, "read", lp.threads, ops[0], 0, seconds, &by_op[0], &r);
+  report.row(r);
+  fill_result(&lp, "write", lp.threads, ops[1], 0, seconds, &by_op[1], &r);
+  report.row(r);
+  fill_result(&lp, "all", lp.threads, ops[0] + ops[1], errors, seconds, &all, &r);
+  report.row(r);
+  if (lp.open_loop) {
+    fill_result(&lp, "service", lp.threads, ops[0] + ops[1], errors, seconds,
+                &service, &r);
+    report.row(r);
+    if (missed) {
+      report.note("%lu arrivals were still waiting for a slot at the end",
+                  missed);
+    }
+  }
+  return SUCCESS;
+}
+
+/* disconnects whatever came up and frees it along with the envs */
+static void close_conns(std::vector<load_worker> &workers,
+                        std::vector<EnvironmentProc *> &envs) {
+  for (auto &w : workers) {
+    for (auto &lc : w.conns) {
+      if (lc.conn && lc.conn->is_alive()) {
+        lc.conn->stop();
+      }
+    }
+  }
+  for (auto &w : workers) {
+    for (auto &lc : w.conns) {
+      if (!lc.conn) {
+        continue;
+      }
+      while (lc.conn->is_alive()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      delete lc.conn;
+      lc.conn = nullptr;
+    }
+  }
+  for (auto e : envs) {
+    delete e;
+  }
+  envs.clear();
+}
+
+static int run_client(EnvironmentProc *env, load_params &lp, BenchReport &report) {
+  std::vector<EnvironmentProc *> envs;
+  std::vector<load_worker> workers(lp.threads);
+  int ret = run_load(env, lp, report, workers, envs);
+  close_conns(workers, envs);
+  return ret;
+}
+
+/* listens on every port first, a client may connect in any order */
+static int run_server(EnvironmentProc *env, load_params &lp) {
+  int total = lp.threads * lp.conns;
+  std::vector<EnvironmentProc *> envs;
+  std::vector<ConnectionProc *> conns;
+
+  for (int i = 0; i < total; i++) {
+    EnvironmentProc *e = new EnvironmentProc(*env);
+    e->get_params()->server_port += i;
+    envs.push_back(e);
+    conns.push_back(bench_start(e));
+  }
+  for (auto conn : conns) {
+    if (!bench_wait(conn) ||
+        conn->pin_memory((ibv_access_flags)(IBV_ACCESS_LOCAL_WRITE |
+                                            IBV_ACCESS_REMOTE_READ |
+                                            IBV_ACCESS_REMOTE_WRITE))) {
+      /* listeners still waiting for a client keep their env, the
+      process is about to exit anyway */
+      fprintf(stderr, "Couldn't set up a connection\n");
+      return FAILURE;
+    }
+  }
+  /* done once the last client connection is gone */
+  for (auto conn : conns) {
+    while (conn->is_alive()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    delete conn;
+  }
+  for (auto e : envs) {
+    delete e;
+  }
+  return SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+  EnvironmentProc    user_env;
+  load_params        lp;
+  if (user_env.parse_params(argc, argv)) {
+    std::cerr << "Can't parse input parameters!" << std::endl;
+    return 1;
+  }
+  if (parse_load_params(argc - optind + 1, argv + optind - 1, &lp)) {
+    std::cerr << "Can't parse load parameters!" << std::endl;
+    return 1;
+  }
+  if (user_env.check_env()) {
+    std::cerr << "Checking enviroment fail!" << std::endl;
+    return 1;
+  }
+
+  if (user_env.is_server()) {
+    return run_server(&user_env, lp) == SUCCESS ? 0 : 1;
+  }
+
+  FILE *out = NULL;
+  if (lp.output && !(out = fopen(lp.output, "w"))) {
+    fprintf(stderr, "Couldn't open %s\n", lp.output);
+    return 1;
+  }
+  BenchReport report(lp.format, out);
+  report.check_clock(lp.skew_ns);
+  int ret = run_client(&user_env, lp, report);
+  if (out) {
+    fclose(out);
+  }
+  return ret == SUCCESS ? 0 : 1;
+}
@@ -2,19 +2,62 @@
 
 Pinned_Fix_Memory::~Pinned_Fix_Memory() {
   for (uint i = 0; i < blocks.size(); i++) {
+    if (blocks[i] == nullptr) {
+      continue;
+    }
     blocks[i]->unreg_free_local();
-		free(blocks[i]);
+		delete blocks[i];
 		blocks[i] = nullptr;
   }
+	if (implicit_mr) {
+		ibv_dereg_mr(implicit_mr);
+	}
+}
+
+bool Pinned_Fix_Memory::allocate_next_block(ibv_pd *pd, ibv_access_flags flags,
+																						uint64_t *voff) {
+	return allocate_next_blocks(pd, flags, 1, voff);
 }
 
-bool Pinned_Fix_Memory::allocate_next_block(ibv_pd *pd, ibv_access_flags flags) {
-	uint64_t start = next_offset.fetch_add(block_length);
-	if (start + block_length <= max_size) {
-		pinned_block *b = new pinned_block(start, block_length);
-		uint64_t idx = start / block_length;
+bool Pinned_Fix_Memory::allocate_next_blocks(ibv_pd *pd, ibv_access_flags flags,
+																						 uint64_t num, uint64_t *voff) {
+	uint64_t len = block_length * num;
+	uint64_t start = next_offset.fetch_add(len);
+	if (num == 0 || start + len > max_size) {
+		next_offset.fetch_sub(len);
+		return false;
+	}
 
-		b->reg_alloc_local(pd, flags, align_str);
+	for (uint64_t i = 0; i < num; i++) {
+		pinned_block *b = new pinned_block(start + i * block_length, block_length);
+		uint64_t idx = start / block_length + i;
+
+		if (reg_mode == MEM_REG_IMPLICIT_ODP) {
+			/* plain allocation, the implicit mr already covers it */
+			b->local_mem = (byte *)aligned_alloc(align_str, block_length);
+			if (b->local_mem) {
+				b->mr = implicit_mr;
+				b->pinned = true;
+				b->shared_mr = true;
+			}
+		} else if (reg_mode == MEM_REG_ODP) {
+			b->reg_alloc_local(pd, (ibv_access_flags)(flags | IBV_ACCESS_ON_DEMAND),
+												 align_str);
+		} else {
+			b->reg_alloc_local(pd, flags, align_str);
+		}
+
+		if (!b->pinned) {
+			fprintf(stderr, " Couldn't allocate and register block %lu.\n", idx);
+			b->unreg_free_local();
+			delete b;
+			release_blocks(start / block_length, i);
+			/* give the range back unless a later allocation already took
+			the offsets past it, the hole then just stays empty */
+			uint64_t end = start + len;
+			next_offset.compare_exchange_strong(end, start);
+			return false;
+		}
 
 		mem_mutex.lock();
 
@@ -22,20 +65,284 @@ bool Pinned_Fix_Memory::allocate_next_block(ibv_pd *pd, ibv_access_flags flags)
 		blocks[idx] = b;
 
 		mem_mutex.unlock();
-	} else {
-		next_offset.fetch_sub(block_length);
+	}
+
+	if (voff) {
+		*voff = start;
+	}
+	return true;
+}
+
+void Pinned_Fix_Memory::release_blocks(uint64_t first, uint64_t num) {
+	std::lock_guard<std::mutex> lock(mem_mutex);
+
+	for (uint64_t idx = first; idx < first + num; idx++) {
+		blocks[idx]->unreg_free_local();
+		delete blocks[idx];
+		blocks[idx] = nullptr;
+	}
+}
+
+bool Pinned_Fix_Memory::get_region(size_t block_num, remote_mr *desc) {
+	std::lock_guard<std::mutex> lock(mem_mutex);
+
+	pinned_block *b = block_num < blocks.size() ? blocks[block_num] : nullptr;
+	if (b == nullptr || !b->pinned || b->mr == NULL) {
+		return false;
+	}
+	desc->voff = b->virtual_offset;
+	/* the implicit mr starts at 0, use the block itself */
+	desc->addr = (uint64_t)b->local_mem;
+	desc->length = (uint32_t)b->mem_length;
+	desc->rkey = b->mr->rkey;
+	return true;
+}
+
+/********** small memory **********/
+Pinned_Small_Memory::~Pinned_Small_Memory() {
+	for (auto &it : regions) {
+		small_region &r = it.second;
+		if (r.mr) {
+			ibv_dereg_mr(r.mr);
+		}
+		if (r.dm) {
+			ibv_free_dm(r.dm);
+		}
+		if (r.host) {
+			free(r.host);
+		}
+	}
+}
+
+bool Pinned_Small_Memory::alloc_device(ibv_pd *pd, ibv_access_flags flags,
+																			 small_region &r) {
+	if (!dm_queried) {
+		ibv_device_attr_ex attr;
+		memset(&attr, 0, sizeof(attr));
+		if (ibv_query_device_ex(pd->context, NULL, &attr) == 0) {
+			dm_left = std::min((uint64_t)attr.max_dm_size, dm_limit);
+		}
+		dm_queried = true;
+	}
+	if (r.length > dm_left) {
+		return false;
+	}
+
+	ibv_alloc_dm_attr dm_attr;
+	memset(&dm_attr, 0, sizeof(dm_attr));
+	dm_attr.length = r.length;
+	r.dm = ibv_alloc_dm(pd->context, &dm_attr);
+	if (r.dm == NULL) {
+		/* other processes share it, stop trying once it ran out */
+		dm_left = 0;
+		return false;
+	}
+	r.mr = ibv_reg_dm_mr(pd, r.dm, 0, r.length,
+											 (unsigned int)flags | IBV_ACCESS_ZERO_BASED);
+	if (r.mr == NULL) {
+		ibv_free_dm(r.dm);
+		r.dm = NULL;
+		return false;
+	}
+
+	/* device memory starts with garbage */
+	std::vector<byte> zero(r.length, 0);
+	ibv_memcpy_to_dm(r.dm, 0, zero.data(), r.length);
+	dm_left -= r.length;
+	return true;
+}
+
+bool Pinned_Small_Memory::alloc_host(ibv_pd *pd, ibv_access_flags flags,
+																		 small_region &r) {
+	r.host = (byte *)aligned_alloc(SMALL_REGION_ALIGN, r.length);
+	if (r.host == NULL) {
+		return false;
+	}
+	memset(r.host, 0, r.length);
+	r.mr = ibv_reg_mr(pd, r.host, r.length, flags);
+	if (r.mr == NULL) {
+		free(r.host);
+		r.host = NULL;
 		return false;
 	}
+	return true;
+}
+
+bool Pinned_Small_Memory::allocate(ibv_pd *pd, ibv_access_flags flags,
+																	 uint64_t len, bool device, uint64_t *voff) {
+	std::lock_guard<std::mutex> lock(mem_mutex);
+	small_region r;
 
+	memset(&r, 0, sizeof(r));
+	r.length = (len + SMALL_REGION_ALIGN - 1) & ~(SMALL_REGION_ALIGN - 1);
+	if (r.length == 0 || r.length > FIX_BLOCK_LENGTH) {
+		return false;
+	}
+	if (!(device && alloc_device(pd, flags, r)) && !alloc_host(pd, flags, r)) {
+		return false;
+	}
+
+	r.voff = next_offset;
+	next_offset += r.length;
+	regions[r.voff] = r;
+	if (voff) {
+		*voff = r.voff;
+	}
+	return true;
+}
+
+small_region *Pinned_Small_Memory::find(uint64_t voff) {
+	std::lock_guard<std::mutex> lock(mem_mutex);
+
+	auto it = regions.upper_bound(voff);
+	if (it == regions.begin()) {
+		return NULL;
+	}
+	--it;
+	if (voff >= it->second.voff + it->second.length) {
+		return NULL;
+	}
+	/* regions are never erased, the pointer stays valid */
+	return &it->second;
+}
+
+bool Pinned_Small_Memory::get_region(uint64_t voff, remote_mr *desc) {
+	small_region *r = find(voff);
+
+	if (r == NULL) {
+		return false;
+	}
+	desc->voff = r->voff;
+	/* zero based for device memory */
+	desc->addr = r->dm ? 0 : (uint64_t)r->host;
+	desc->length = (uint32_t)r->length;
+	desc->rkey = r->mr->rkey;
+	return true;
+}
+
+void Pinned_Small_Memory::get_regions(std::vector<remote_mr> &out) {
+	std::vector<uint64_t> voffs;
+	remote_mr desc;
+
+	{
+		std::lock_guard<std::mutex> lock(mem_mutex);
+		for (auto &it : regions) {
+			voffs.push_back(it.first);
+		}
+	}
+	for (uint64_t voff : voffs) {
+		if (get_region(voff, &desc)) {
+			out.push_back(desc);
+		}
+	}
+}
+
+/********** on demand paging **********/
+/* like check_odp_support in perftest, for one-sided access to the blocks */
+static bool check_odp_support(ibv_context *context, bool implicit,
+															bool *atomic) {
+	ibv_device_attr_ex dattr;
+	uint32_t rc_caps;
+
+	if (ibv_query_device_ex(context, NULL, &dattr)) {
+		fprintf(stderr, " Couldn't query device for on-demand paging capabilities.\n");
+		return false;
+	}
+	if (!(dattr.odp_caps.general_caps & IBV_ODP_SUPPORT)) {
+		fprintf(stderr, " On-demand paging is not supported.\n");
+		return false;
+	}
+	if (implicit && !(dattr.odp_caps.general_caps & IBV_ODP_SUPPORT_IMPLICIT)) {
+		fprintf(stderr, " Implicit on-demand paging is not supported.\n");
+		return false;
+	}
+	rc_caps = dattr.odp_caps.per_transport_caps.rc_odp_caps;
+	if (!(rc_caps & IBV_ODP_SUPPORT_READ) || !(rc_caps & IBV_ODP_SUPPORT_WRITE)) {
+		fprintf(stderr, " RDMA read/write is not supported for RC transport.\n");
+		return false;
+	}
+	*atomic = rc_caps & IBV_ODP_SUPPORT_ATOMIC;
+	return true;
+}
+
+bool MemoryMagr::set_reg_mode(ibv_pd *pd, mem_reg_mode mode) {
+	bool atomic = false;
+
+	if (mode == p_fix_memory.reg_mode) {
+		return true;
+	}
+	/* blocks already registered would mix modes */
+	if (p_fix_memory.next_offset > 0) {
+		return false;
+	}
+	if (mode != MEM_REG_PINNED &&
+			!check_odp_support(pd->context, mode == MEM_REG_IMPLICIT_ODP, &atomic)) {
+		return false;
+	}
+
+	if (mode == MEM_REG_IMPLICIT_ODP) {
+		int access = IBV_ACCESS_ON_DEMAND | IBV_ACCESS_LOCAL_WRITE |
+								 IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+		if (atomic) {
+			access |= IBV_ACCESS_REMOTE_ATOMIC;
+		}
+		p_fix_memory.implicit_mr = ibv_reg_mr(pd, NULL, SIZE_MAX, access);
+		if (p_fix_memory.implicit_mr == NULL) {
+			fprintf(stderr, " Couldn't register the implicit on-demand MR.\n");
+			return false;
+		}
+	}
+	p_fix_memory.reg_mode = mode;
+	return true;
+}
+
+bool MemoryMagr::prefetch(ibv_pd *pd, uint64_t voff, uint64_t len, bool write,
+													bool sync) {
+	const uint32_t max_sge = 32;
+	uint64_t block_len = p_fix_memory.block_length;
+	std::vector<ibv_sge> sges;
+
+	if (p_fix_memory.reg_mode == MEM_REG_PINNED) {
+		return true;
+	}
+	if (voff + len > p_fix_memory.next_offset) {
+		return false;
+	}
+
+	/* one sge per block, the lkey may differ from block to block */
+	for (uint64_t off = voff; off < voff + len; ) {
+		uint64_t n = std::min(voff + len - off, block_len - off % block_len);
+		ibv_mr *mr = get_pinned_mr(off - off % block_len, block_len);
+		if (mr == NULL) {
+			return false;
+		}
+		ibv_sge sge;
+		sge.addr = (uint64_t)get_local_address(off);
+		sge.length = (uint32_t)n;
+		sge.lkey = mr->lkey;
+		sges.push_back(sge);
+		off += n;
+	}
+
+	for (size_t i = 0; i < sges.size(); i += max_sge) {
+		uint32_t num = (uint32_t)std::min(sges.size() - i, (size_t)max_sge);
+		if (ibv_advise_mr(pd, write ? IBV_ADVISE_MR_ADVICE_PREFETCH_WRITE :
+																	IBV_ADVISE_MR_ADVICE_PREFETCH,
+											sync ? IBV_ADVISE_MR_FLAG_FLUSH : 0,
+											sges.data() + i, num)) {
+			return false;
+		}
+	}
 	return true;
 }
 
 /* allocate and make mr for a memory block */
 bool MemoryMagr::allocate_pinned_memory(ibv_pd *pd, ibv_access_flags flags,
-																				 uint64_t len, bool fixed) {
+																				 uint64_t len, bool fixed, uint64_t *voff) {
 	if (fixed) {
-		assert(len == p_fix_memory.block_length);
-		p_fix_memory.allocate_next_block(pd, flags);
+		assert(len > 0 && len % p_fix_memory.block_length == 0);
+		return p_fix_memory.allocate_next_blocks(pd, flags,
+																						 len / p_fix_memory.block_length, voff);
 
 	} else {
 		// TODO mzy: variable length
@@ -45,6 +352,10 @@ bool MemoryMagr::allocate_pinned_memory(ibv_pd *pd, ibv_access_flags flags,
 
 /* get mr for pinned memory block */
 ibv_mr *MemoryMagr::get_pinned_mr(uint64_t voff, uint64_t len, bool fixed) {
+	if (voff >= SMALL_VOFF_BASE) {
+		small_region *r = p_small_memory.find(voff);
+		return r ? r->mr : NULL;
+	}
 	if (fixed) {
 		ibv_mr *mr = NULL;
 		assert(len == p_fix_memory.block_length);
@@ -55,4 +366,118 @@ ibv_mr *MemoryMagr::get_pinned_mr(uint64_t voff, uint64_t len, bool fixed) {
 		return mr;
 	}
 	return NULL;
-}
\ No newline at end of file
+}
+
+/* local address of a pinned virtual offset, NULL if not pinned */
+byte *MemoryMagr::get_local_address(uint64_t voff) {
+	if (voff >= SMALL_VOFF_BASE) {
+		small_region *r = p_small_memory.find(voff);
+		return (r && r->host) ? r->host + (voff - r->voff) : NULL;
+	}
+	uint64_t len = p_fix_memory.block_length;
+	if (voff >= p_fix_memory.next_offset) {
+		return NULL;
+	}
+	byte *block = p_fix_memory.get_block_address(voff / len);
+	return block ? block + voff % len : NULL;
+}
+
+/* describe the pinned block at voff for advertisement */
+bool MemoryMagr::get_pinned_region(uint64_t voff, remote_mr *desc) {
+	if (voff >= SMALL_VOFF_BASE) {
+		return p_small_memory.get_region(voff, desc);
+	}
+	if (voff >= p_fix_memory.next_offset) {
+		return false;
+	}
+	return p_fix_memory.get_region(voff / p_fix_memory.block_length, desc);
+}
+
+/* snapshot all pinned blocks, returns the number of regions */
+size_t MemoryMagr::get_pinned_regions(std::vector<remote_mr> &regions) {
+	uint64_t num = p_fix_memory.next_offset / p_fix_memory.block_length;
+	remote_mr desc;
+
+	regions.clear();
+	for (uint64_t i = 0; i < num; i++) {
+		/* blocks still being registered are advertised once pinned */
+		if (p_fix_memory.get_region(i, &desc)) {
+			regions.push_back(desc);
+		}
+	}
+	p_small_memory.get_regions(regions);
+	return regions.size();
+}
+
+bool MemoryMagr::allocate_small_memory(ibv_pd *pd, ibv_access_flags flags,
+																			 uint64_t len, uint64_t *voff, bool device) {
+	return p_small_memory.allocate(pd, flags, len, device, voff);
+}
+
+bool MemoryMagr::is_device_memory(uint64_t voff) {
+	small_region *r = voff >= SMALL_VOFF_BASE ? p_small_memory.find(voff) : NULL;
+	return r && r->dm;
+}
+
+bool MemoryMagr::read_small_memory(uint64_t voff, void *dst, uint64_t len) {
+	small_region *r = p_small_memory.find(voff);
+	uint64_t off;
+
+	if (r == NULL || (off = voff - r->voff) + len > r->length) {
+		return false;
+	}
+	if (r->dm) {
+		return ibv_memcpy_from_dm(dst, r->dm, off, len) == 0;
+	}
+	memcpy(dst, r->host + off, len);
+	return true;
+}
+
+bool MemoryMagr::write_small_memory(uint64_t voff, const void *src, uint64_t len) {
+	small_region *r = p_small_memory.find(voff);
+	uint64_t off;
+
+	if (r == NULL || (off = voff - r->voff) + len > r->length) {
+		return false;
+	}
+	if (r->dm) {
+		return ibv_memcpy_to_dm(r->dm, off, src, len) == 0;
+	}
+	memcpy(r->host + off, src, len);
+	return true;
+}
+
+/********** remote memory **********/
+void Remote_Memory::update(const remote_mr *mrs, uint32_t num, bool reset) {
+	std::lock_guard<std::mutex> lock(mem_mutex);
+
+	if (reset) {
+		regions.clear();
+	}
+	for (uint32_t i = 0; i < num; i++) {
+		regions[mrs[i].voff] = mrs[i];
+	}
+}
+
+bool Remote_Memory::lookup(uint64_t voff, uint64_t len, remote_mr *mr) {
+	std::lock_guard<std::mutex> lock(mem_mutex);
+
+	/* the last region starting at or before voff */
+	auto it = regions.upper_bound(voff);
+	if (it == regions.begin()) {
+		return false;
+	}
+	--it;
+
+	const remote_mr &r = it->second;
+	if (voff + len > r.voff + r.length) {
+		return false;
+	}
+	*mr = r;
+	return true;
+}
+
+size_t Remote_Memory::size() {
+	std::lock_guard<std::mutex> lock(mem_mutex);
+	return regions.size();
+}
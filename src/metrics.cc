@@ -0,0 +1,267 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <chrono>
+
+#include "metrics.h"
+#include "perftest_counters.h"
+#include "rdma_com.h"
+
+#define METRICS_UNIX_PREFIX  "unix:"
+
+/* busy and total jiffies of all cpus, the first line of /proc/stat */
+static bool read_cpu_stat(uint64_t *busy, uint64_t *total) {
+  unsigned long long v[8] = {0};
+  FILE *fp = fopen("/proc/stat", "r");
+  if (!fp) {
+    return false;
+  }
+  int n = fscanf(fp, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+                 &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+  fclose(fp);
+  if (n < 4) {
+    return false;
+  }
+  *total = 0;
+  for (int i = 0; i < 8; i++) {
+    *total += v[i];
+  }
+  /* idle and iowait */
+  *busy = *total - v[3] - v[4];
+  return true;
+}
+
+static uint64_t wall_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+MetricsExporter::~MetricsExporter() {
+  stop();
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (counters) {
+    counters_close(counters);
+  }
+}
+
+int16_t MetricsExporter::open(const char *where) {
+  target = where;
+  if (!strncmp(where, METRICS_UNIX_PREFIX, strlen(METRICS_UNIX_PREFIX))) {
+    /* the reader may come up later, keep trying on every sample */
+    reconnect();
+    return SUCCESS;
+  }
+  fd = ::open(where, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Couldn't open %s: %s\n", where, strerror(errno));
+    return FAILURE;
+  }
+  return SUCCESS;
+}
+
+bool MetricsExporter::reconnect() {
+  sockaddr_un addr;
+  const char *path = target.c_str() + strlen(METRICS_UNIX_PREFIX);
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return false;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return false;
+  }
+  if (connect(fd, (sockaddr *)&addr, sizeof(addr))) {
+    close(fd);
+    fd = -1;
+    return false;
+  }
+  return true;
+}
+
+void MetricsExporter::add_connection(const std::string &name,
+                                     ConnectionProc *conn) {
+  conn_source s;
+  s.name = name;
+  s.conn = conn;
+  s.ops = s.bytes = s.errors = 0;
+  conns.push_back(s);
+}
+
+void MetricsExporter::add_histogram(const AtomicHistogram *hist) {
+  hist_source s;
+  s.hist = hist;
+  s.prev.assign(LAT_HIST_BUCKETS, 0);
+  hists.push_back(s);
+}
+
+int16_t MetricsExporter::add_port_counters(const char *dev_name, int port,
+                                           const char *names) {
+  if (counters) {
+    return FAILURE;
+  }
+  if (counters_alloc(names, &counters) ||
+      counters_open(counters, dev_name, port)) {
+    /* counters_open frees the context when it fails */
+    counters = NULL;
+    return FAILURE;
+  }
+  return SUCCESS;
+}
+
+int16_t MetricsExporter::start(int interval_ms) {
+  if (running || interval_ms <= 0) {
+    return FAILURE;
+  }
+  for (auto &s : conns) {
+    conn_metrics *m = s.conn->get_metrics();
+    s.ops = m->completed.get();
+    s.bytes = m->bytes.get();
+    s.errors = m->errors.get();
+  }
+  for (auto &s : hists) {
+    s.hist->snapshot(s.prev);
+  }
+  if (!read_cpu_stat(&cpu_busy, &cpu_total)) {
+    cpu_busy = cpu_total = 0;
+  }
+  if (counters) {
+    counters_sample(counters);
+  }
+  running = true;
+  thread = std::thread(&MetricsExporter::run, this, interval_ms);
+  return SUCCESS;
+}
+
+void MetricsExporter::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!running) {
+      return;
+    }
+    running = false;
+  }
+  cv.notify_all();
+  thread.join();
+}
+
+void MetricsExporter::run(int interval_ms) {
+  uint64_t last = now_ns();
+  std::unique_lock<std::mutex> lock(mutex);
+  while (running) {
+    cv.wait_for(lock, std::chrono::milliseconds(interval_ms));
+    uint64_t now = now_ns();
+    double seconds = (now - last) / 1e9;
+    last = now;
+    /* the last partial interval is sampled too */
+    lock.unlock();
+    /* the only thread that refines, see get_clock.h */
+    perf_clock_refine();
+    sample(seconds);
+    lock.lock();
+  }
+}
+
+void MetricsExporter::sample(double seconds) {
+  char buf[512];
+  std::string line, per_conn;
+  uint64_t ops = 0, bytes = 0, errors = 0, inflight = 0;
+  std::vector<uint64_t> counts;
+  LatencyHistogram lat;
+
+  for (auto &s : conns) {
+    conn_metrics *m = s.conn->get_metrics();
+    /* completed first, inflight must not go negative */
+    uint64_t c_ops = m->completed.get();
+    uint64_t c_signaled = m->signaled.get();
+    uint64_t c_bytes = m->bytes.get();
+    uint64_t c_errors = m->errors.get();
+    uint64_t d_ops = c_ops - s.ops, d_bytes = c_bytes - s.bytes;
+    uint64_t d_errors = c_errors - s.errors;
+    uint64_t c_inflight = c_signaled > c_ops ? c_signaled - c_ops : 0;
+
+    snprintf(buf, sizeof(buf),
+             "%s{\"name\":\"%s\",\"kops\":%.3f,\"mbps\":%.2f,\"inflight\":%lu,"
+             "\"errors\":%lu}",
+             per_conn.empty() ? "" : ",", s.name.c_str(),
+             d_ops / seconds / 1e3, d_bytes / seconds / 1e6, c_inflight, d_errors);
+    per_conn += buf;
+
+    ops += d_ops;
+    bytes += d_bytes;
+    errors += d_errors;
+    inflight += c_inflight;
+    s.ops = c_ops;
+    s.bytes = c_bytes;
+    s.errors = c_errors;
+  }
+
+  for (auto &s : hists) {
+    s.hist->snapshot(counts);
+    for (size_t i = 0; i < LAT_HIST_BUCKETS; i++) {
+      if (counts[i] != s.prev[i]) {
+        lat.record(LatencyHistogram::bucket_value(i), counts[i] - s.prev[i]);
+      }
+    }
+    s.prev.swap(counts);
+  }
+
+  double cpu_util = 0;
+  uint64_t busy, total;
+  if (read_cpu_stat(&busy, &total)) {
+    if (total > cpu_total) {
+      cpu_util = 100.0 * (busy - cpu_busy) / (total - cpu_total);
+    }
+    cpu_busy = busy;
+    cpu_total = total;
+  }
+
+  snprintf(buf, sizeof(buf),
+           "{\"ts_ms\":%lu,\"interval_s\":%.3f,\"ops\":%lu,\"kops\":%.3f,"
+           "\"mbps\":%.2f,\"inflight\":%lu,\"errors\":%lu,\"cpu_util\":%.1f,"
+           "\"lat_count\":%lu,\"lat_p50_us\":%.3f,\"lat_p99_us\":%.3f,"
+           "\"lat_p999_us\":%.3f,\"lat_max_us\":%.3f,\"conns\":[",
+           wall_ms(), seconds, ops, ops / seconds / 1e3, bytes / seconds / 1e6,
+           inflight, errors, cpu_util, lat.count(), lat.percentile(50) / 1e3,
+           lat.percentile(99) / 1e3, lat.percentile(99.9) / 1e3,
+           lat.max() / 1e3);
+  line = buf;
+  line += per_conn;
+  line += "]";
+  if (counters && !counters_sample(counters)) {
+    line += ",\"port\":{";
+    for (unsigned i = 0; i < counters_count(counters); i++) {
+      snprintf(buf, sizeof(buf), "%s\"%s\":{\"delta\":%llu,\"rate\":%.2f}",
+               i ? "," : "", counters_name(counters, i),
+               counters_delta(counters, i), counters_rate(counters, i));
+      line += buf;
+    }
+    line += "}";
+  }
+  line += "}\n";
+  emit(line);
+}
+
+void MetricsExporter::emit(const std::string &line) {
+  bool unix_socket = target.compare(0, strlen(METRICS_UNIX_PREFIX),
+                                    METRICS_UNIX_PREFIX) == 0;
+  if (fd < 0 && !(unix_socket && reconnect())) {
+    return;
+  }
+  /* a reader that went away drops this sample, not the process */
+  ssize_t n = unix_socket ? send(fd, line.data(), line.size(), MSG_NOSIGNAL)
+                          : write(fd, line.data(), line.size());
+  if (n < 0 && unix_socket) {
+    close(fd);
+    fd = -1;
+  }
+}
@@ -0,0 +1,362 @@
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "bench_util.h"
+#include "perftest_communication.h"
+
+/* Times the out of band key exchange of lib/perf over loopback tcp:
+P clients connect to one server, each with Q QPs worth of keys, and
+both ends run in this process.
+
+  oobbench [<bench options>]
+
+  -p, --port      tcp port of the server (default 18515)
+  -P, --peers     clients, "1,8" or "1:64" (default 1,8)
+  -q, --qps       QPs per client (default 1,1000)
+  -n, --iters     exchanges per configuration (default 20)
+  -f, --format    csv (default) or json, one line per configuration
+  -w, --output    file instead of stdout
+
+op per_qp is the loop the perftest drivers run: ctx_hand_shake once per
+QP, a round trip each, the server taking its clients one after the
+other. op batch has every client call ctx_hand_shake_batch and the
+server oob_xchg_peers over all of them at once. The server accepts with
+ethernet_server_accept_peers. One op is the exchange of every QP of
+every client, timed on the server, latencies are per exchange. conns is
+P and size is Q. Every received key is checked. */
+
+#define OOB_BENCH_HOST          "127.0.0.1"
+#define OOB_BENCH_CONNECT_TRIES 100
+#define OOB_BENCH_TIMEOUT_MS    10000
+
+static struct option oob_options[] = {
+  { name : "port",      has_arg : 1, flag : NULL, val : 'p' },
+  { name : "peers",     has_arg : 1, flag : NULL, val : 'P' },
+  { name : "qps",       has_arg : 1, flag : NULL, val : 'q' },
+  { name : "iters",     has_arg : 1, flag : NULL, val : 'n' },
+  { name : "format",    has_arg : 1, flag : NULL, val : 'f' },
+  { name : "output",    has_arg : 1, flag : NULL, val : 'w' },
+  {0}
+};
+
+struct oob_params {
+  int               port;
+  std::vector<int>  peers;
+  std::vector<int>  qps;
+  int               iters;
+  bench_format      format;
+  const char        *output;
+};
+
+static int16_t parse_oob_params(int argc, char *argv[], oob_params *op) {
+  op->port = 18515;
+  parse_int_list("1,8", op->peers);
+  parse_int_list("1,1000", op->qps);
+  op->iters = 20;
+  op->format = BENCH_CSV;
+  op->output = NULL;
+
+  while (1) {
+    int ch = getopt_long(argc, argv, "p:P:q:n:f:w:", oob_options, NULL);
+    if (ch == -1) {
+      break;
+    }
+    switch (ch) {
+      case 'p': {
+        op->port = atoi(optarg);
+        if (op->port <= 0 || op->port > 65535) {
+          fprintf(stderr, "Bad port %s\n", optarg);
+          return FAILURE;
+        }
+      } break;
+      case 'P': {
+        if (!parse_int_list(optarg, op->peers)) {
+          fprintf(stderr, "Bad peer list %s\n", optarg);
+          return FAILURE;
+        }
+      } break;
+      case 'q': {
+        if (!parse_int_list(optarg, op->qps)) {
+          fprintf(stderr, "Bad qp list %s\n", optarg);
+          return FAILURE;
+        }
+      } break;
+      case 'n': {
+        op->iters = atoi(optarg);
+        if (op->iters <= 0) {
+          fprintf(stderr, "Iters must be positive\n");
+          return FAILURE;
+        }
+      } break;
+      case 'f': {
+        if (!parse_format(optarg, &op->format)) {
+          fprintf(stderr, "Format is csv or json\n");
+          return FAILURE;
+        }
+      } break;
+      case 'w': { op->output = optarg; } break;
+    default:
+      return FAILURE;
+      break;
+    }
+  }
+  return SUCCESS;
+}
+
+/* one end of the exchange, its socket and keys */
+struct oob_end {
+  perftest_parameters       params;
+  perftest_comm             comm;
+  std::vector<pingpong_dest> my_dest;
+  std::vector<pingpong_dest> rem_dest;
+};
+
+/* keys nobody else has, so a key landing in the wrong slot shows */
+static void fill_keys(std::vector<pingpong_dest> &dest, int side, int peer) {
+  for (size_t q = 0; q < dest.size(); q++) {
+    pingpong_dest &d = dest[q];
+    memset(&d, 0, sizeof(d));
+    d.lid = side;
+    d.out_reads = peer;
+    d.qpn = (int)q;
+    d.psn = (int)(q * 3 + side);
+    d.rkey = 0xdeadbeef ^ (unsigned)q;
+    d.vaddr = 0x123456789abcull + q;
+    d.srqn = (unsigned)peer;
+    for (int k = 0; k < 16; k++) {
+      d.gid.raw[k] = (uint8_t)(k + side);
+    }
+  }
+}
+
+static uint64_t count_bad_keys(const std::vector<pingpong_dest> &rem,
+                               const std::vector<pingpong_dest> &sent) {
+  uint64_t bad = 0;
+  for (size_t q = 0; q < rem.size(); q++) {
+    const pingpong_dest &x = rem[q], &y = sent[q];
+    if (x.lid != y.lid || x.out_reads != y.out_reads || x.qpn != y.qpn ||
+        x.psn != y.psn || x.rkey != y.rkey || x.vaddr != y.vaddr ||
+        x.srqn != y.srqn || memcmp(x.gid.raw, y.gid.raw, 16)) {
+      bad++;
+    }
+  }
+  return bad;
+}
+
+static void init_end(oob_end *e, int port, char *servername, int qps,
+                     int side, int peer) {
+  memset(&e->params, 0, sizeof(e->params));
+  e->params.port = port;
+  e->params.servername = servername;
+  e->params.machine = servername ? CLIENT : SERVER;
+  e->params.sockfd = -1;
+  memset(&e->comm, 0, sizeof(e->comm));
+  e->comm.rdma_params = &e->params;
+  e->my_dest.resize(qps);
+  e->rem_dest.resize(qps);
+  fill_keys(e->my_dest, side, peer);
+}
+
+/* the client may come before the listener, it tries again for a while */
+static void client_connect(oob_end *c, int *ret) {
+  for (int tries = 0; tries < OOB_BENCH_CONNECT_TRIES; tries++) {
+    if (!establish_connection(&c->comm)) {
+      *ret = SUCCESS;
+      return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  *ret = FAILURE;
+}
+
+static void client_exchange(oob_end *c, bool batch, int iters, int *ret) {
+  for (int i = 0; i < iters; i++) {
+    if (batch) {
+      if (ctx_hand_shake_batch(&c->comm, c->my_dest.data(), c->rem_dest.data(),
+                               (int)c->my_dest.size())) {
+        *ret = FAILURE;
+        return;
+      }
+      continue;
+    }
+    for (size_t q = 0; q < c->my_dest.size(); q++) {
+      if (ctx_hand_shake(&c->comm, &c->my_dest[q], &c->rem_dest[q])) {
+        *ret = FAILURE;
+        return;
+      }
+    }
+  }
+  *ret = SUCCESS;
+}
+
+/* what the server pays to exchange with every client once */
+static int16_t server_exchange(oob_end *s, std::vector<int> &fds, bool batch) {
+  int qps = (int)s->my_dest.size();
+  if (batch) {
+    std::vector<oob_peer> peers(fds.size());
+    for (size_t p = 0; p < fds.size(); p++) {
+      peers[p].fd = fds[p];
+      peers[p].my_dest = s->my_dest.data();
+      peers[p].rem_dest = &s->rem_dest[p * qps];
+      peers[p].num = qps;
+    }
+    return oob_xchg_peers(peers.data(), (int)peers.size(),
+                          OOB_BENCH_TIMEOUT_MS) ? FAILURE : SUCCESS;
+  }
+  for (size_t p = 0; p < fds.size(); p++) {
+    s->params.sockfd = fds[p];
+    for (int q = 0; q < qps; q++) {
+      if (ctx_hand_shake(&s->comm, &s->my_dest[q], &s->rem_dest[p * qps + q])) {
+        return FAILURE;
+      }
+    }
+  }
+  return SUCCESS;
+}
+
+static int16_t run_config(const oob_params &op, int num_peers, int qps,
+                          BenchReport &report) {
+  static char host[] = OOB_BENCH_HOST;
+  oob_end server;
+  std::vector<oob_end> clients(num_peers);
+  std::vector<int> fds(num_peers, -1);
+  std::vector<int> rets(num_peers, FAILURE);
+  std::vector<std::thread> ts;
+  int16_t ret = SUCCESS;
+
+  init_end(&server, op.port, NULL, qps, 0, 0);
+  server.rem_dest.resize((size_t)num_peers * qps);
+  std::thread accept_thread([&] {
+    /* bounded, a client that gave up connecting must not hang the join */
+    if (ethernet_server_accept_peers(&server.comm, num_peers, fds.data(),
+                                     OOB_BENCH_TIMEOUT_MS)) {
+      ret = FAILURE;
+    }
+  });
+  /* give it the time to listen, a client that is early tries again */
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  for (int p = 0; p < num_peers; p++) {
+    init_end(&clients[p], op.port, host, qps, 1, p);
+    ts.emplace_back(client_connect, &clients[p], &rets[p]);
+  }
+  for (auto &t : ts) {
+    t.join();
+  }
+  ts.clear();
+  accept_thread.join();
+  for (int p = 0; p < num_peers; p++) {
+    if (rets[p]) {
+      ret = FAILURE;
+    }
+  }
+
+  LatencyHistogram lat;
+  bench_result r;
+  r.suite = "oob";
+  r.size = qps;
+  r.depth = r.threads = 1;
+  r.conns = num_peers;
+  r.target_kops = 0;
+  r.lat = &lat;
+
+  for (int batch = 0; batch < 2 && ret == SUCCESS; batch++) {
+    lat.reset();
+    for (int p = 0; p < num_peers; p++) {
+      ts.emplace_back(client_exchange, &clients[p], batch != 0, op.iters, &rets[p]);
+    }
+    uint64_t start = now_ns();
+    for (int i = 0; i < op.iters; i++) {
+      uint64_t t0 = now_ns();
+      if (server_exchange(&server, fds, batch != 0)) {
+        fprintf(stderr, "%s exchange of %d peers x %d qps failed\n",
+                batch ? "batch" : "per_qp", num_peers, qps);
+        ret = FAILURE;
+        break;
+      }
+      lat.record(now_ns() - t0);
+    }
+    double seconds = (now_ns() - start) / 1e9;
+    if (ret) {
+      /* clients blocked on a dead exchange see their socket close */
+      for (int p = 0; p < num_peers; p++) {
+        shutdown(fds[p], SHUT_RDWR);
+      }
+    }
+    for (auto &t : ts) {
+      t.join();
+    }
+    ts.clear();
+
+    r.errors = 0;
+    for (int p = 0; p < num_peers && ret == SUCCESS; p++) {
+      /* clients are accepted in any order, out_reads names the sender */
+      std::vector<pingpong_dest> got(server.rem_dest.begin() + (size_t)p * qps,
+                                     server.rem_dest.begin() + (size_t)(p + 1) * qps);
+      int from = got[0].out_reads;
+      if (from < 0 || from >= num_peers) {
+        r.errors += qps;
+      } else {
+        r.errors += count_bad_keys(got, clients[from].my_dest);
+      }
+      r.errors += count_bad_keys(clients[p].rem_dest, server.my_dest);
+      if (rets[p]) {
+        r.errors++;
+      }
+    }
+    if (ret == SUCCESS) {
+      r.op = batch ? "batch" : "per_qp";
+      r.ops = op.iters;
+      r.seconds = seconds;
+      report.row(r);
+    }
+  }
+
+  for (int p = 0; p < num_peers; p++) {
+    if (fds[p] >= 0) {
+      close(fds[p]);
+    }
+    if (clients[p].params.sockfd >= 0) {
+      close(clients[p].params.sockfd);
+    }
+  }
+  return ret;
+}
+
+int main(int argc, char *argv[]) {
+  oob_params op;
+  if (parse_oob_params(argc, argv, &op)) {
+    std::cerr << "Can't parse bench parameters!" << std::endl;
+    return 1;
+  }
+  perf_clock_calibrate();
+
+  FILE *out = NULL;
+  if (op.output && !(out = fopen(op.output, "w"))) {
+    fprintf(stderr, "Couldn't open %s\n", op.output);
+    return 1;
+  }
+  BenchReport report(op.format, out);
+  report.note("oob key exchange over %s:%d, %d exchanges per configuration",
+              OOB_BENCH_HOST, op.port, op.iters);
+  int ret = SUCCESS;
+  for (int peers : op.peers) {
+    for (int qps : op.qps) {
+      if (run_config(op, peers, qps, report)) {
+        ret = FAILURE;
+        break;
+      }
+    }
+    if (ret) {
+      break;
+    }
+  }
+  if (out) {
+    fclose(out);
+  }
+  return ret == SUCCESS ? 0 : 1;
+}
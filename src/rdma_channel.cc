@@ -0,0 +1,321 @@
+#include "rdma_channel.h"
+
+int16_t RdmaChannel::open() {
+  MemoryMagr *mem = conn->get_mem_magr();
+  uint64_t ring_voff, stage_voff;
+
+  if (conn->pin_memory((ibv_access_flags)(IBV_ACCESS_LOCAL_WRITE |
+                                          IBV_ACCESS_REMOTE_WRITE),
+                       FIX_BLOCK_LENGTH, &ring_voff) ||
+      conn->pin_memory(IBV_ACCESS_LOCAL_WRITE, FIX_BLOCK_LENGTH, &stage_voff)) {
+    return FAILURE;
+  }
+  ring = mem->get_local_address(ring_voff);
+  stage = mem->get_local_address(stage_voff);
+  stage_mr = mem->get_pinned_mr(stage_voff, FIX_BLOCK_LENGTH);
+  memset(ring, 0, FIX_BLOCK_LENGTH);
+
+  local.ring_voff = ring_voff;
+  local.ring_size = RDMA_CHANNEL_RING_LEN;
+  local.credit_voff = ring_voff + RDMA_CHANNEL_RING_LEN;
+  signal_period = std::max(1, std::min(RDMA_CHANNEL_SIGNAL_PERIOD,
+                                       conn->get_tx_depth() / 2));
+
+  conn->set_channel(this);
+  return conn->advertise_ring(local);
+}
+
+/********** sender **********/
+int16_t RdmaChannel::wait_space(uint64_t len) {
+  if (send_tail + len - credit() <= remote.ring_size) {
+    return SUCCESS;
+  }
+  /* the receiver can only free what it got */
+  if (flush_batch()) {
+    return FAILURE;
+  }
+  while (send_tail + len - credit() > remote.ring_size) {
+    if (is_failed()) {
+      return FAILURE;
+    }
+  }
+  return SUCCESS;
+}
+
+byte *RdmaChannel::reserve(uint32_t length) {
+  uint64_t flen = rdma_frame_len(length, checksum);
+
+  if (flen > RDMA_CHANNEL_MAX_FRAME || !ready() || is_failed()) {
+    return NULL;
+  }
+  if (batch_count == RDMA_CHANNEL_MAX_BATCH && flush_batch()) {
+    return NULL;
+  }
+
+  uint64_t pos = send_tail % remote.ring_size;
+  if (pos + flen > remote.ring_size) {
+    /* a batch is one contiguous write, skip the ring tail */
+    if (mode == CHANNEL_POLL) {
+      /* frames are 8 byte aligned, there is room for the marker */
+      if (wait_space(8)) {
+        return NULL;
+      }
+      rdma_msg_head::encode(stage + pos, rdma_msg_head::values(
+          RDMA_MESSAGE_MAGIC, RDMA_CHANNEL_WRAP));
+      send_tail += 8;
+    }
+    if (flush_batch()) {
+      return NULL;
+    }
+
+    uint64_t rest = (remote.ring_size - send_tail % remote.ring_size) %
+                    remote.ring_size;
+    if (wait_space(rest + flen)) {
+      return NULL;
+    }
+    send_tail += rest;
+    batch_start = send_tail;
+    pos = 0;
+  } else if (wait_space(flen)) {
+    return NULL;
+  }
+
+  byte *p = stage + pos;
+  byte *data = p + rdma_msg_head::size;
+  rdma_msg_head::encode(p, rdma_msg_head::values(
+      RDMA_MESSAGE_MAGIC, checksum ? length | RDMA_MESSAGE_CRC : length));
+  rdma_msg_tail::write<MSG_TAIL_MAGIC>(
+      data + length + (checksum ? rdma_msg_crc::size : 0), RDMA_MESSAGE_MAGIC);
+
+  send_tail += flen;
+  batch_count++;
+  return data;
+}
+
+/* the batch never wraps, its frames follow each other from batch_start */
+void RdmaChannel::seal_batch() {
+  byte *p = stage + batch_start % remote.ring_size;
+
+  for (uint32_t i = 0; i < batch_count; i++) {
+    uint32_t length = rdma_msg_head::read<MSG_HEAD_LENGTH>(p);
+    bool crc = length & RDMA_MESSAGE_CRC;
+    byte *data = p + rdma_msg_head::size;
+
+    length &= ~RDMA_MESSAGE_CRC;
+    if (crc) {
+      rdma_msg_crc::write<MSG_CRC_VALUE>(data + length, crc32c(0, data, length));
+    }
+    p += rdma_frame_len(length, crc);
+  }
+}
+
+int16_t RdmaChannel::flush_batch() {
+  if (send_tail == batch_start) {
+    return SUCCESS;
+  }
+  if (is_failed()) {
+    return FAILURE;
+  }
+  seal_batch();
+
+  rdma_mem_info info;
+  uint64_t start = batch_start % remote.ring_size;
+
+  memset(&info, 0, sizeof(info));
+  info.length = (uint32_t)(send_tail - batch_start);
+  if (conn->lookup_remote_mr(remote.ring_voff + start, info)) {
+    return FAILURE;
+  }
+  info.src_mr = stage_mr;
+  info.local_address = (uint64_t)(stage + start);
+  if (mode == CHANNEL_IMM) {
+    info.use_imm_data = true;
+    info.imm_data = htonl((batch_count << 24) | (uint32_t)(start / 8));
+  } else {
+    info.unsignaled = (++write_count % signal_period) != 0;
+  }
+
+  batch_start = send_tail;
+  batch_count = 0;
+  return conn->rdma_write(info);
+}
+
+int16_t RdmaChannel::flush() {
+  std::lock_guard<std::mutex> lock(send_mutex);
+  return flush_batch();
+}
+
+int16_t RdmaChannel::post_locked(const byte *head, uint32_t head_len,
+                                 const byte *data, uint32_t length) {
+  byte *p = reserve(head_len + length);
+
+  if (p == NULL) {
+    return FAILURE;
+  }
+  if (head_len) {
+    memcpy(p, head, head_len);
+  }
+  if (length) {
+    memcpy(p + head_len, data, length);
+  }
+  return SUCCESS;
+}
+
+int16_t RdmaChannel::post(const byte *head, uint32_t head_len,
+                          const byte *data, uint32_t length, bool flush_now) {
+  std::lock_guard<std::mutex> lock(send_mutex);
+
+  if (post_locked(head, head_len, data, length)) {
+    return FAILURE;
+  }
+  return flush_now ? flush_batch() : SUCCESS;
+}
+
+int16_t RdmaChannel::post_if(const byte *head, uint32_t head_len,
+                             const byte *data, uint32_t length,
+                             const std::function<bool()> &flush_if) {
+  std::lock_guard<std::mutex> lock(send_mutex);
+  int16_t ret = post_locked(head, head_len, data, length);
+
+  /* frames posted before ours may be waiting for this flush */
+  if (flush_if() && flush_batch()) {
+    ret = FAILURE;
+  }
+  return ret;
+}
+
+int16_t RdmaChannel::send(const byte *data, uint32_t length) {
+  return post(NULL, 0, data, length, true);
+}
+
+int16_t RdmaChannel::send(const RdmaMessage &msg) {
+  return send(msg.data, msg.length);
+}
+
+/********** receiver **********/
+void RdmaChannel::fail(uint64_t offset) {
+  fprintf(stderr, "corrupted frame at ring offset %lu, closing the channel\n",
+          offset);
+  /* the peer waits for credit we can't return, drop the connection so
+  both sides see it die */
+  failed.store(true);
+  conn->set_alive(false);
+  conn->stop();
+}
+
+bool RdmaChannel::check_frame(byte *data, uint32_t length) {
+  if (crc32c(0, data, length) == rdma_msg_crc::read<MSG_CRC_VALUE>(data + length)) {
+    return true;
+  }
+  crc_errors++;
+  fprintf(stderr, "crc mismatch on %u byte frame, dropped\n", length);
+  return false;
+}
+
+void RdmaChannel::return_credit() {
+  rdma_mem_info info;
+  byte *src = stage + local.ring_size;
+
+  memset(&info, 0, sizeof(info));
+  info.length = sizeof(uint64_t);
+  if (!ready() || conn->lookup_remote_mr(remote.credit_voff, info)) {
+    return;
+  }
+  memcpy(src, &recv_head, sizeof(uint64_t));
+  info.src_mr = stage_mr;
+  info.local_address = (uint64_t)src;
+
+  if (conn->rdma_write(info) == SUCCESS) {
+    credit_sent = recv_head;
+  }
+}
+
+void RdmaChannel::on_imm(uint32_t imm) {
+  uint64_t start = (uint64_t)(imm & 0xffffff) * 8;
+  uint32_t count = imm >> 24;
+  uint64_t pos = recv_head % local.ring_size;
+
+  if (failed.load()) {
+    return;
+  }
+  if (start != pos) {
+    /* the sender skipped the ring tail */
+    assert(start == 0);
+    recv_head += local.ring_size - pos;
+  }
+
+  byte *p = ring + start;
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t length = rdma_msg_head::read<MSG_HEAD_LENGTH>(p);
+    bool crc = length & RDMA_MESSAGE_CRC;
+    byte *data = p + rdma_msg_head::size;
+    length &= ~RDMA_MESSAGE_CRC;
+    uint64_t flen = rdma_frame_len(length, crc);
+    if (rdma_msg_head::read<MSG_HEAD_MAGIC>(p) != RDMA_MESSAGE_MAGIC ||
+        flen > local.ring_size - (p - ring) ||
+        rdma_msg_tail::read<MSG_TAIL_MAGIC>(
+            data + length + (crc ? rdma_msg_crc::size : 0)) != RDMA_MESSAGE_MAGIC) {
+      fail((uint64_t)(p - ring));
+      return;
+    }
+    if (!crc || check_frame(data, length)) {
+      handler(data, length);
+    }
+
+    p += flen;
+    recv_head += flen;
+  }
+
+  if (recv_head - credit_sent >= local.ring_size / 8) {
+    return_credit();
+  }
+}
+
+int RdmaChannel::poll(int max_frames) {
+  int num = 0;
+
+  while (num < max_frames && !failed.load()) {
+    /* the ring is written behind our back, reload it every round */
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    uint64_t pos = recv_head % local.ring_size;
+    byte *p = ring + pos;
+    if (rdma_msg_head::read<MSG_HEAD_MAGIC>(p) != RDMA_MESSAGE_MAGIC) {
+      break;
+    }
+
+    uint32_t length = rdma_msg_head::read<MSG_HEAD_LENGTH>(p);
+    if (length == RDMA_CHANNEL_WRAP) {
+      memset(p, 0, rdma_msg_head::size);
+      recv_head += local.ring_size - pos;
+      continue;
+    }
+    bool crc = length & RDMA_MESSAGE_CRC;
+    length &= ~RDMA_MESSAGE_CRC;
+    uint64_t flen = rdma_frame_len(length, crc);
+    if (flen > local.ring_size - pos) {
+      fail(pos);
+      return num;
+    }
+    byte *data = p + rdma_msg_head::size;
+    if (rdma_msg_tail::read<MSG_TAIL_MAGIC>(
+            data + length + (crc ? rdma_msg_crc::size : 0)) != RDMA_MESSAGE_MAGIC) {
+      /* the tail of the frame has not landed yet */
+      break;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    if (!crc || check_frame(data, length)) {
+      handler(data, length);
+    }
+
+    memset(p, 0, flen);
+    recv_head += flen;
+    num++;
+  }
+
+  if (recv_head - credit_sent >= local.ring_size / 8) {
+    return_credit();
+  }
+  return num;
+}
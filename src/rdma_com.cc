@@ -9,25 +9,86 @@ int16_t ConnectionProc::rdma_read(rdma_mem_info &info) {
   return rdma_op(RDMA_REMOTE_READ, info);
 }
 
+int16_t ConnectionProc::rdma_fetch_add(rdma_mem_info &info, uint64_t add) {
+  info.compare_add = add;
+  return rdma_op(RDMA_REMOTE_FETCH_ADD, info);
+}
+
+int16_t ConnectionProc::rdma_cmp_swap(rdma_mem_info &info, uint64_t compare,
+                                      uint64_t swap) {
+  info.compare_add = compare;
+  info.swap = swap;
+  return rdma_op(RDMA_REMOTE_CMP_SWAP, info);
+}
+
+/* qps * chunk covers the length, the last chunk takes the rest */
+static uint32_t stripe_chunk(uint32_t length, uint32_t qps) {
+  return ((length - 1) / qps + RDMA_STRIPE_ALIGN) &
+         ~(uint32_t)(RDMA_STRIPE_ALIGN - 1);
+}
+
+int ConnectionProc::send_wrs_per_qp(uint32_t length) {
+  /* the lanes may not be up yet, count as if they were */
+  uint32_t qps = conn_params.num_of_qps;
+  if (qps <= 1 || length < RDMA_STRIPE_MIN) {
+    return 1;
+  }
+  uint32_t chunk = stripe_chunk(length, qps);
+  uint32_t chunks = (length + chunk - 1) / chunk;
+  return (chunks + qps - 1) / qps;
+}
+
 int16_t ConnectionProc::rdma_op(DmaType_t dma_type, rdma_mem_info &info) {
+  uint32_t qps = conn_ctx.qps_ready.load(std::memory_order_acquire) ?
+                 conn_params.active_qps : 1;
+
+  /* an imm must not overtake the data, unsignaled chunks would never be
+  reclaimed, so only tracked plain ops are striped */
+  if (qps > 1 && info.req && !info.use_imm_data &&
+      info.length >= RDMA_STRIPE_MIN) {
+    uint32_t chunk = stripe_chunk(info.length, qps);
+    uint32_t off = 0;
+
+    for (uint32_t i = 0; i < qps && off < info.length; i++, off += chunk) {
+      if (post_rdma_wr(conn_ctx.qps[i], dma_type, info, off,
+                       std::min(chunk, info.length - off))) {
+        if (!off) {
+          return FAILURE;
+        }
+        /* the chunks already posted still complete on req, FAILURE
+        would let the caller reuse it under them */
+        info.req->failed.store(true);
+        return SUCCESS;
+      }
+    }
+    return SUCCESS;
+  }
+  return post_rdma_wr(conn_ctx.qp, dma_type, info, 0, info.length);
+}
+
+int16_t ConnectionProc::post_rdma_wr(ibv_qp *qp, DmaType_t dma_type,
+                                     rdma_mem_info &info, uint32_t offset,
+                                     uint32_t length) {
   int ret = 0;
   struct ibv_send_wr *bad_send_work_req = NULL;
   struct ibv_send_wr send_wr;
   struct ibv_sge sge;
 
   sge.lkey = info.src_mr->lkey;
-  sge.addr = info.local_address;
-  sge.length = info.length;
+  sge.addr = info.local_address + offset;
+  sge.length = length;
 
-  send_wr.wr_id = (uint64_t)this;
+  send_wr.wr_id = (uint64_t)info.req;
 
   send_wr.next = NULL;
   send_wr.sg_list =  &sge;
   send_wr.num_sge = 1;
-  send_wr.send_flags = IBV_SEND_SIGNALED;
+  /* an unsignaled wqe is only reclaimed by a later signaled one */
+  assert(!(info.unsignaled && info.req));
+  send_wr.send_flags = info.unsignaled ? 0 : IBV_SEND_SIGNALED;
 
-  send_wr.wr.rdma.remote_addr = (uint64_t)(info.dst_mr->addr) + info.offset;
-  send_wr.wr.rdma.rkey = info.dst_mr->rkey;
+  send_wr.wr.rdma.remote_addr = info.dst_mr.addr + info.offset + offset;
+  send_wr.wr.rdma.rkey = info.dst_mr.rkey;
 
   if (RDMA_REMOTE_WRITE == dma_type) {
     if (info.use_imm_data) {
@@ -36,31 +97,308 @@ int16_t ConnectionProc::rdma_op(DmaType_t dma_type, rdma_mem_info &info) {
     } else {
       send_wr.opcode = IBV_WR_RDMA_WRITE;
     }
+    if (length <= conn_params.max_inline_data) {
+      send_wr.send_flags |= IBV_SEND_INLINE;
+    }
   } else if (RDMA_REMOTE_READ == dma_type) {
     send_wr.opcode = IBV_WR_RDMA_READ;
+  } else if (RDMA_REMOTE_FETCH_ADD == dma_type ||
+             RDMA_REMOTE_CMP_SWAP == dma_type) {
+    assert(length == sizeof(uint64_t));
+    assert((send_wr.wr.rdma.remote_addr & 7) == 0);
+    /* wr.atomic overlays wr.rdma, set every field again */
+    uint64_t remote_addr = send_wr.wr.rdma.remote_addr;
+    send_wr.opcode = RDMA_REMOTE_FETCH_ADD == dma_type ?
+                     IBV_WR_ATOMIC_FETCH_AND_ADD : IBV_WR_ATOMIC_CMP_AND_SWP;
+    send_wr.wr.atomic.remote_addr = remote_addr;
+    send_wr.wr.atomic.compare_add = info.compare_add;
+    send_wr.wr.atomic.swap = info.swap;
+    send_wr.wr.atomic.rkey = info.dst_mr.rkey;
   } else {
     assert(false);
   }
 
-  ret = ibv_post_send(conn_ctx.qp, &send_wr, &bad_send_work_req);
+  if (info.req) {
+    info.req->pending.fetch_add(1);
+  }
+  ret = ibv_post_send(qp, &send_wr, &bad_send_work_req);
 
   if (ret) {
+    if (info.req) {
+      info.req->pending.fetch_sub(1);
+    }
+    metrics.errors.add();
     return FAILURE;
   }
+  metrics.bytes.add(length);
+  if (!info.unsignaled) {
+    metrics.signaled.add();
+  }
   return SUCCESS;
 }
 
-/********** client **********/
+/********** memory regions **********/
+int16_t ConnectionProc::pin_memory(ibv_access_flags flags, uint64_t len,
+                                   uint64_t *voff) {
+  uint64_t off;
+  std::vector<remote_mr> regions;
+  remote_mr desc;
+
+  if (conn_ctx.pd == NULL) {
+    return FAILURE;
+  }
+  if (!local_mem.allocate_pinned_memory(conn_ctx.pd, flags, len, true, &off)) {
+    return FAILURE;
+  }
+  if (voff) {
+    *voff = off;
+  }
+
+  /* incremental update, blocks pinned before the connection is
+  established go with the full table in on_connection */
+  if (!conn_params.connected) {
+    return SUCCESS;
+  }
+  for (uint64_t b = off; b < off + len; b += FIX_BLOCK_LENGTH) {
+    if (local_mem.get_pinned_region(b, &desc)) {
+      regions.push_back(desc);
+    }
+  }
+  return advertise_regions(regions.data(), regions.size(), false);
+}
+
+int16_t ConnectionProc::pin_small_memory(ibv_access_flags flags, uint64_t len,
+                                         uint64_t *voff, bool device) {
+  uint64_t off;
+  remote_mr desc;
+
+  if (conn_ctx.pd == NULL ||
+      !local_mem.allocate_small_memory(conn_ctx.pd, flags, len, &off, device)) {
+    return FAILURE;
+  }
+  if (voff) {
+    *voff = off;
+  }
+  if (!conn_params.connected || !local_mem.get_pinned_region(off, &desc)) {
+    return SUCCESS;
+  }
+  return advertise_regions(&desc, 1, false);
+}
+
+int16_t ConnectionProc::lookup_remote_mr(uint64_t voff, rdma_mem_info &info) {
+  if (!remote_mem.lookup(voff, info.length, &info.dst_mr)) {
+    return FAILURE;
+  }
+  info.offset = (uint32_t)(voff - info.dst_mr.voff);
+  return SUCCESS;
+}
+
+int16_t ConnectionProc::advertise_local_regions() {
+  std::vector<remote_mr> regions;
+
+  local_mem.get_pinned_regions(regions);
+  return advertise_regions(regions.data(), regions.size(), true);
+}
+
+int16_t ConnectionProc::advertise_regions(const remote_mr *regions, size_t num,
+                                          bool reset) {
+  std::unique_lock<std::mutex> lock(conn_ctx.meta_mutex);
+  size_t sent = 0;
+
+  /* an empty reset still has to clear the peer cache */
+  do {
+    uint32_t count = std::min(num - sent, (size_t)META_MAX_REGIONS);
+    MetaMessage *msg = get_meta_send_slot(lock);
+
+    if (msg == NULL) {
+      return FAILURE;
+    }
+
+    msg->type = MetaMessage::META_RECV_MR;
+    msg->reset = (reset && sent == 0) ? 1 : 0;
+    msg->count = count;
+    memcpy(msg->data.regions, regions + sent, count * sizeof(remote_mr));
+
+    if (post_meta_send_wr(msg)) {
+      return FAILURE;
+    }
+    sent += count;
+  } while (sent < num);
+
+  return SUCCESS;
+}
+
+int16_t ConnectionProc::advertise_ring(const ring_desc &ring) {
+  std::unique_lock<std::mutex> lock(conn_ctx.meta_mutex);
+  MetaMessage *msg = get_meta_send_slot(lock);
+
+  if (msg == NULL) {
+    return FAILURE;
+  }
+
+  msg->type = MetaMessage::META_RECV_RING;
+  msg->reset = 0;
+  msg->count = 0;
+  msg->data.ring = ring;
+  return post_meta_send_wr(msg);
+}
+
+/********** qps **********/
+int16_t ConnectionProc::create_extra_qps(ibv_qp_init_attr &qp_attr) {
+  memset(conn_ctx.qps, 0, sizeof(conn_ctx.qps));
+  conn_ctx.qps[0] = conn_ctx.qp;
+  conn_ctx.qps_ready.store(false);
+  conn_ctx.qps_local_ready = false;
+  conn_ctx.qps_peer_ready = false;
+  conn_ctx.peer_qps_num = 0;
+  conn_params.active_qps = 1;
+
+  /* rdma ops only, nothing is ever received on the extra qps */
+  qp_attr.cap.max_recv_wr = 1;
+  for (int i = 1; i < conn_params.num_of_qps; i++) {
+    conn_ctx.qps[i] = ibv_create_qp(conn_ctx.pd, &qp_attr);
+    if (conn_ctx.qps[i] == NULL) {
+      fprintf(stderr, "Couldn't create extra QP %d\n", i);
+      return FAILURE;
+    }
+    conn_ctx.qp_psn[i] = lrand48() & 0xffffff;
+  }
+  return SUCCESS;
+}
+
+int16_t ConnectionProc::advertise_qps() {
+  if (conn_params.num_of_qps == 1) {
+    return SUCCESS;
+  }
+
+  std::unique_lock<std::mutex> lock(conn_ctx.meta_mutex);
+  MetaMessage *msg = get_meta_send_slot(lock);
+
+  if (msg == NULL) {
+    return FAILURE;
+  }
+
+  msg->type = MetaMessage::META_RECV_QP;
+  msg->reset = 0;
+  msg->count = conn_params.num_of_qps;
+  for (int i = 0; i < conn_params.num_of_qps; i++) {
+    msg->data.qps[i].qpn = conn_ctx.qps[i]->qp_num;
+    msg->data.qps[i].psn = conn_ctx.qp_psn[i];
+  }
+  return post_meta_send_wr(msg);
+}
+
+int16_t ConnectionProc::connect_qps(const qp_desc *remote, uint32_t num) {
+  uint32_t active = std::min(num, (uint32_t)conn_params.num_of_qps);
+  ibv_qp_attr attr;
+  int mask;
+
+  /* port, path, mtu and timers are those rdma cm negotiated for the
+  first qp, only the qp numbers and psns differ */
+  for (uint32_t i = 1; i < active; i++) {
+    ibv_qp *qp = conn_ctx.qps[i];
+
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    if (rdma_init_qp_attr(conn_ctx.cm_id, &attr, &mask)) {
+      return FAILURE;
+    }
+    attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
+                           IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_ATOMIC;
+    if (ibv_modify_qp(qp, &attr, mask | IBV_QP_ACCESS_FLAGS)) {
+      fprintf(stderr, "Failed to modify QP %d to INIT\n", i);
+      return FAILURE;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    if (rdma_init_qp_attr(conn_ctx.cm_id, &attr, &mask)) {
+      return FAILURE;
+    }
+    attr.dest_qp_num = remote[i].qpn;
+    attr.rq_psn = remote[i].psn;
+    /* the first qp runs at the mtu rdma cm resolved for the path, the
+    lanes are capped at the requested one */
+    attr.path_mtu = std::min(attr.path_mtu, conn_params.path_mtu);
+    if (ibv_modify_qp(qp, &attr, mask)) {
+      fprintf(stderr, "Failed to modify QP %d to RTR\n", i);
+      return FAILURE;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    if (rdma_init_qp_attr(conn_ctx.cm_id, &attr, &mask)) {
+      return FAILURE;
+    }
+    attr.sq_psn = conn_ctx.qp_psn[i];
+    if (ibv_modify_qp(qp, &attr, mask)) {
+      fprintf(stderr, "Failed to modify QP %d to RTS\n", i);
+      return FAILURE;
+    }
+  }
+  conn_params.active_qps = active;
+
+  /* our side is rts, the peer may stripe once it knows */
+  std::unique_lock<std::mutex> lock(conn_ctx.meta_mutex);
+  conn_ctx.qps_local_ready = true;
+  update_qps_ready();
+
+  MetaMessage *msg = get_meta_send_slot(lock);
+  if (msg == NULL) {
+    return FAILURE;
+  }
+
+  msg->type = MetaMessage::META_RECV_QP_READY;
+  msg->reset = 0;
+  msg->count = active;
+  return post_meta_send_wr(msg);
+}
+
+void ConnectionProc::update_qps_ready() {
+  conn_ctx.qps_ready.store(conn_ctx.qps_local_ready &&
+                           conn_ctx.qps_peer_ready &&
+                           conn_params.active_qps > 1,
+                           std::memory_order_release);
+}
+
+int16_t ConnectionProc::on_established() {
+  uint32_t early_qps;
+  {
+    /* a META_RECV_QP handled after this sees connected and connects
+    itself, one handled before left its qps for us */
+    std::lock_guard<std::mutex> lock(conn_ctx.meta_mutex);
+    conn_params.connected = true;
+    early_qps = conn_ctx.peer_qps_num;
+  }
+
+  /* advertise the regions pinned so far, later blocks follow
+  incrementally from pin_memory */
+  if (advertise_local_regions() || advertise_qps()) {
+    return FAILURE;
+  }
+  if (early_qps && connect_qps(conn_ctx.peer_qps, early_qps)) {
+    fprintf(stderr, "connecting extra QPs failed, staying on one\n");
+  }
+  return SUCCESS;
+}
+
+/********** server **********/
 RDMAServer::RDMAServer(EnvironmentProc *env){
   /* set parameters */
   conn_params.env = env->get_params();
   assert(conn_params.env->machine == SERVER);
   conn_params.connected = false;
-  conn_params.num_of_qps = 1;
-  conn_params.wr_cq_number = 128;
+  conn_params.num_of_qps = conn_params.env->num_of_qps;
+  conn_params.active_qps = 1;
+  conn_params.wr_cq_number = conn_params.env->rx_depth;
+  conn_params.tx_depth = conn_params.env->tx_depth;
+  conn_params.out_reads = conn_params.env->out_reads;
+  conn_params.path_mtu = conn_params.env->curr_mtu;
+  conn_params.max_inline_data = 0;
 }
 
-int16_t RDMAServer::on_connect_request(rdma_cm_id *id) {
+int16_t RDMAServer::on_connect_request(rdma_cm_id *id,
+                                       const rdma_conn_param *peer) {
   /* build ibv connection */
   if (build_connection(id)) {
     return FAILURE;
@@ -68,9 +406,15 @@ int16_t RDMAServer::on_connect_request(rdma_cm_id *id) {
 
   rdma_conn_param cm_params;
 
+  /* we answer at most the reads the client issues and issue at most
+  those it answers */
+  conn_params.out_reads = std::min(conn_params.out_reads,
+                                   (int)std::min(peer->initiator_depth,
+                                                 peer->responder_resources));
+
   memset(&cm_params, 0, sizeof(cm_params));
-  cm_params.initiator_depth = 1;
-  cm_params.responder_resources = 1;
+  cm_params.initiator_depth = conn_params.out_reads;
+  cm_params.responder_resources = conn_params.out_reads;
   cm_params.rnr_retry_count = 7; /* infinite retry */
 
   if (rdma_accept(id, &cm_params)) {
@@ -81,12 +425,7 @@ int16_t RDMAServer::on_connect_request(rdma_cm_id *id) {
 }
 
 int16_t RDMAServer::on_connection(rdma_cm_id *id) {
-  conn_params.connected = true;
-
-  /* TODO mzy: init & send meta on connection */
-
-  post_meta_send_wr();
-  return SUCCESS;
+  return on_established();
 }
 
 int16_t RDMAServer::on_disconnect(rdma_cm_id *id) {
@@ -102,7 +441,7 @@ int16_t RDMAServer::on_event(rdma_cm_event *event) {
   int16_t ret = SUCCESS;
 
   if (event->event == RDMA_CM_EVENT_CONNECT_REQUEST)
-    ret = on_connect_request(event->id);
+    ret = on_connect_request(event->id, &event->param.conn);
   else if (event->event == RDMA_CM_EVENT_ESTABLISHED)
     ret = on_connection(event->id);
   else if (event->event == RDMA_CM_EVENT_DISCONNECTED)
@@ -120,9 +459,22 @@ int16_t RDMAServer::run() {
     return FAILURE;
   }
   if (rdma_create_id(conn_ctx.cm_channel, cm_id, NULL, RDMA_PS_TCP)) {
+    rdma_destroy_event_channel(conn_ctx.cm_channel);
     return FAILURE;
   }
 
+  int16_t ret = run_events();
+
+  /* see RDMAClient::run */
+  if (!conn_params.connected) {
+    release();
+  }
+  rdma_destroy_id(conn_ctx.cm_id_control);
+  rdma_destroy_event_channel(conn_ctx.cm_channel);
+  return ret;
+}
+
+int16_t RDMAServer::run_events() {
   /* Now use rdma cm to establish connection*/
 	char *service;
 	char* src_ip = NULL;
@@ -171,20 +523,23 @@ int16_t RDMAServer::run() {
 		return FAILURE;
 	}
 
-	if (event->event != RDMA_CM_EVENT_CONNECT_REQUEST) {
-		fprintf(stderr, "error RDMA_CM_EVENT on server connect %d\n", event->event);
+	/* acked up front, the id can't be destroyed with an event pending */
+	memcpy(&event_copy, event, sizeof(*event));
+	rdma_ack_cm_event(event);
+
+	if (event_copy.event != RDMA_CM_EVENT_CONNECT_REQUEST) {
+		fprintf(stderr, "error RDMA_CM_EVENT on server connect %d\n", event_copy.event);
 		return FAILURE;
 	}
 
-	conn_ctx.cm_id = event->id;
+	conn_ctx.cm_id = event_copy.id;
 	conn_ctx.context = conn_ctx.cm_id->verbs;
 
 	/* retrieve the first pending event, should be
     RDMA_CM_EVENT_CONNECT_REQUEST to build connection */
-  if (on_connect_request(event->id)) {
+  if (on_connect_request(event_copy.id, &event_copy.param.conn)) {
     return FAILURE;
   }
-  rdma_ack_cm_event(event);
 
   /* working on cm_event */
   while (rdma_get_cm_event(conn_ctx.cm_channel, &event) == 0) {
@@ -195,9 +550,6 @@ int16_t RDMAServer::run() {
       break;
   }
 
-	rdma_destroy_id(conn_ctx.cm_id_control);
-  rdma_destroy_event_channel(conn_ctx.cm_channel);
-
   return SUCCESS;
 }
 
@@ -212,8 +564,13 @@ RDMAClient::RDMAClient(EnvironmentProc *env) {
   conn_params.env = env->get_params();
   assert(conn_params.env->machine == CLIENT);
   conn_params.connected = false;
-  conn_params.num_of_qps = 1;
-  conn_params.wr_cq_number = 128;
+  conn_params.num_of_qps = conn_params.env->num_of_qps;
+  conn_params.active_qps = 1;
+  conn_params.wr_cq_number = conn_params.env->rx_depth;
+  conn_params.tx_depth = conn_params.env->tx_depth;
+  conn_params.out_reads = conn_params.env->out_reads;
+  conn_params.path_mtu = conn_params.env->curr_mtu;
+  conn_params.max_inline_data = 0;
 }
 
 
@@ -233,8 +590,8 @@ int16_t RDMAClient::on_route_resolved(rdma_cm_id *id) {
   rdma_conn_param cm_params;
 
   memset(&cm_params, 0, sizeof(cm_params));
-  cm_params.initiator_depth = 1;
-  cm_params.responder_resources = 1;
+  cm_params.initiator_depth = conn_params.out_reads;
+  cm_params.responder_resources = conn_params.out_reads;
   cm_params.retry_count = 7;
   cm_params.rnr_retry_count = 7; /* infinite retry */
 
@@ -253,9 +610,23 @@ int16_t RDMAClient::run() {
     return FAILURE;
   }
   if (rdma_create_id(conn_ctx.cm_channel, cm_id, NULL, RDMA_PS_TCP)) {
+    conn_ctx.cm_id = NULL;
+    rdma_destroy_event_channel(conn_ctx.cm_channel);
     return FAILURE;
   }
 
+  int16_t ret = run_events();
+
+  /* on_disconnect tears down an established connection, one that never
+  came up is released here, before the channel its id lives on */
+  if (!conn_params.connected) {
+    release();
+  }
+  rdma_destroy_event_channel(conn_ctx.cm_channel);
+  return ret;
+}
+
+int16_t RDMAClient::run_events() {
 	char *service;
 	int num_of_retry= NUM_OF_RETRIES;
 	sockaddr_in sin, source_sin;
@@ -364,8 +735,6 @@ int16_t RDMAClient::run() {
       break;
   }
 
-  rdma_destroy_event_channel(conn_ctx.cm_channel);
-
   return SUCCESS;
 }
 
@@ -374,12 +743,7 @@ void RDMAClient::stop() {
 }
 
 int16_t RDMAClient::on_connection(rdma_cm_id *id) {
-  conn_params.connected = true;
-
-  /* TODO mzy: init & send meta on connection */
-
-  post_meta_send_wr();
-  return SUCCESS;
+  return on_established();
 }
 
 int16_t RDMAClient::on_disconnect(rdma_cm_id *id) {
@@ -0,0 +1,187 @@
+#include <thread>
+
+#include "remote_sync.h"
+
+#define REMOTE_LOCK_MAX_BACKOFF_US  64
+
+/********** atomics **********/
+int16_t RemoteAtomics::open() {
+  MemoryMagr *mem = conn->get_mem_magr();
+  uint64_t voff;
+
+  if (conn->pin_memory(IBV_ACCESS_LOCAL_WRITE, FIX_BLOCK_LENGTH, &voff)) {
+    return FAILURE;
+  }
+  scratch = (uint64_t *)mem->get_local_address(voff);
+  scratch_mr = mem->get_pinned_mr(voff, FIX_BLOCK_LENGTH);
+  return SUCCESS;
+}
+
+int16_t RemoteAtomics::atomic_op(bool cas, uint64_t voff, uint64_t compare_add,
+                                 uint64_t swap, uint64_t *old) {
+  rdma_mem_info info;
+  rdma_request req;
+  uint64_t *slot = scratch +
+                   next_slot.fetch_add(1) % (FIX_BLOCK_LENGTH / sizeof(uint64_t));
+
+  memset(&info, 0, sizeof(info));
+  info.length = sizeof(uint64_t);
+  if (scratch == NULL || conn->lookup_remote_mr(voff, info)) {
+    return FAILURE;
+  }
+  info.src_mr = scratch_mr;
+  info.local_address = (uint64_t)slot;
+  info.req = &req;
+
+  int16_t ret = cas ? conn->rdma_cmp_swap(info, compare_add, swap) :
+                      conn->rdma_fetch_add(info, compare_add);
+  if (ret || !req.wait()) {
+    return FAILURE;
+  }
+  *old = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+  return SUCCESS;
+}
+
+int16_t RemoteAtomics::fetch_add(uint64_t voff, uint64_t add, uint64_t *old) {
+  return atomic_op(false, voff, add, 0, old);
+}
+
+int16_t RemoteAtomics::cmp_swap(uint64_t voff, uint64_t compare, uint64_t swap,
+                                uint64_t *old) {
+  return atomic_op(true, voff, compare, swap, old);
+}
+
+/********** spin lock **********/
+int16_t RemoteSpinLock::try_lock(bool *acquired) {
+  uint64_t old;
+
+  if (atomics->cmp_swap(voff, 0, owner, &old)) {
+    return FAILURE;
+  }
+  *acquired = (old == 0);
+  return SUCCESS;
+}
+
+int16_t RemoteSpinLock::lock() {
+  uint32_t backoff = 1;
+  bool acquired = false;
+
+  while (1) {
+    if (try_lock(&acquired)) {
+      return FAILURE;
+    }
+    if (acquired) {
+      return SUCCESS;
+    }
+    /* every retry is a round trip to the peer nic, back off */
+    std::this_thread::sleep_for(std::chrono::microseconds(backoff));
+    backoff = std::min(backoff * 2, (uint32_t)REMOTE_LOCK_MAX_BACKOFF_US);
+  }
+}
+
+int16_t RemoteSpinLock::unlock() {
+  uint64_t old;
+
+  /* a plain write is not atomic against the atomics of other nodes */
+  if (atomics->cmp_swap(voff, owner, 0, &old)) {
+    return FAILURE;
+  }
+  return old == owner ? SUCCESS : FAILURE;
+}
+
+/********** ticket lock **********/
+int16_t RemoteTicketLock::lock() {
+  uint64_t word;
+
+  if (atomics->fetch_add(voff, (uint64_t)1 << 32, &word)) {
+    return FAILURE;
+  }
+  ticket = (uint32_t)(word >> 32);
+  while ((uint32_t)word != ticket) {
+    /* the tickets ahead of us each hold the lock for a while */
+    std::this_thread::sleep_for(std::chrono::microseconds(
+        std::min((uint32_t)(ticket - (uint32_t)word),
+                 (uint32_t)REMOTE_LOCK_MAX_BACKOFF_US)));
+    if (atomics->read(voff, &word)) {
+      return FAILURE;
+    }
+  }
+  return SUCCESS;
+}
+
+int16_t RemoteTicketLock::unlock() {
+  uint64_t word;
+
+  if (ticket != UINT32_MAX) {
+    return atomics->fetch_add(voff, 1, &word);
+  }
+  /* serving would carry into the ticket half, wrap it by hand */
+  if (atomics->read(voff, &word)) {
+    return FAILURE;
+  }
+  while (1) {
+    uint64_t old;
+    if (atomics->cmp_swap(voff, word, word & ~(uint64_t)UINT32_MAX, &old)) {
+      return FAILURE;
+    }
+    if (old == word) {
+      return SUCCESS;
+    }
+    word = old;
+  }
+}
+
+/********** slot allocator **********/
+int16_t RemoteSlotAllocator::alloc(uint64_t *slot) {
+  uint64_t words = (num + 63) / 64;
+
+  for (uint64_t n = 0; n < words; n++) {
+    uint64_t w = (hint + n) % words;
+    uint64_t voff = bitmap_voff + w * sizeof(uint64_t);
+    /* bits past num in the last word count as taken */
+    uint64_t valid = (w == words - 1 && num % 64) ?
+                     ((uint64_t)1 << (num % 64)) - 1 : ~(uint64_t)0;
+    uint64_t word;
+
+    if (atomics->read(voff, &word)) {
+      return FAILURE;
+    }
+    while ((~word & valid) != 0) {
+      uint64_t bit = __builtin_ctzll(~word & valid);
+      uint64_t old;
+      if (atomics->cmp_swap(voff, word, word | ((uint64_t)1 << bit), &old)) {
+        return FAILURE;
+      }
+      if (old == word) {
+        hint = w;
+        *slot = w * 64 + bit;
+        return SUCCESS;
+      }
+      /* lost the race, retry on what the peer holds now */
+      word = old;
+    }
+  }
+  return FAILURE;
+}
+
+int16_t RemoteSlotAllocator::free(uint64_t slot) {
+  uint64_t voff = bitmap_voff + slot / 64 * sizeof(uint64_t);
+  uint64_t mask = (uint64_t)1 << (slot % 64);
+  uint64_t word, old;
+
+  assert(slot < num);
+  if (atomics->read(voff, &word)) {
+    return FAILURE;
+  }
+  while (word & mask) {
+    if (atomics->cmp_swap(voff, word, word & ~mask, &old)) {
+      return FAILURE;
+    }
+    if (old == word) {
+      return SUCCESS;
+    }
+    word = old;
+  }
+  /* double free */
+  return FAILURE;
+}
@@ -0,0 +1,168 @@
+#include "rpc.h"
+
+RpcEndpoint::RpcEndpoint(ConnectionProc *conn, WorkerPool *pool,
+                         channel_mode mode)
+    : channel(conn, [this](byte *data, uint32_t length) {
+                on_frame(data, length);
+              }, mode),
+      mode(mode), pool(pool), next_id(1), in_flight(0), unflushed(0),
+      polling(false) {}
+
+int16_t RpcEndpoint::post_frame(uint16_t type, uint16_t opcode, int32_t status,
+                                uint64_t id, const byte *data, uint32_t length,
+                                bool flush) {
+  byte head[RPC_HEAD_LEN];
+
+  rpc_head::encode(head, rpc_head::values(type, opcode, (uint32_t)status, id));
+  return channel.post(head, RPC_HEAD_LEN, data, length, flush);
+}
+
+/********** caller **********/
+int16_t RpcEndpoint::start_call(uint16_t opcode, const byte *data,
+                                uint32_t length, rpc_callback cb, bool flush,
+                                uint64_t *id) {
+  *id = next_id.fetch_add(1);
+  {
+    std::lock_guard<std::mutex> lock(call_mutex);
+    pending[*id] = cb;
+  }
+
+  if (post_frame(RdmaMessage::MSG_CMD, opcode, RPC_OK, *id, data, length, flush)) {
+    std::lock_guard<std::mutex> lock(call_mutex);
+    pending.erase(*id);
+    return FAILURE;
+  }
+  return SUCCESS;
+}
+
+int16_t RpcEndpoint::call_async(uint16_t opcode, const byte *data,
+                                uint32_t length, rpc_callback cb, bool flush) {
+  uint64_t id;
+  return start_call(opcode, data, length, cb, flush, &id);
+}
+
+int16_t RpcEndpoint::call(uint16_t opcode, const byte *data, uint32_t length,
+                          std::vector<byte> &reply, int32_t *status) {
+  std::atomic_bool done(false);
+  uint64_t id;
+
+  if (start_call(opcode, data, length,
+                 [&](int32_t st, const byte *rdata, uint32_t rlen) {
+                   *status = st;
+                   reply.assign(rdata, rdata + rlen);
+                   done.store(true, std::memory_order_release);
+                 }, true, &id)) {
+    return FAILURE;
+  }
+  while (!done.load(std::memory_order_acquire)) {
+    if (channel.is_failed()) {
+      /* the callback refers to our stack, it must not run once we left.
+      If it is already gone it is running, wait for it */
+      std::lock_guard<std::mutex> lock(call_mutex);
+      if (pending.erase(id)) {
+        return FAILURE;
+      }
+    }
+    if (mode == CHANNEL_POLL) {
+      poll();
+    }
+  }
+  return SUCCESS;
+}
+
+int RpcEndpoint::poll() {
+  bool idle = false;
+
+  /* RdmaChannel::poll is single threaded, a blocking call polls only
+  while nobody else does */
+  if (!polling.compare_exchange_strong(idle, true)) {
+    return 0;
+  }
+  int num = channel.poll();
+  polling.store(false);
+  return num;
+}
+
+/********** dispatch **********/
+void RpcEndpoint::on_frame(byte *data, uint32_t length) {
+  if (length < RPC_HEAD_LEN) {
+    fprintf(stderr, "short rpc frame %u\n", length);
+    return;
+  }
+  uint16_t type = rpc_head::read<RPC_HEAD_TYPE>(data);
+  uint16_t opcode = rpc_head::read<RPC_HEAD_OPCODE>(data);
+  int32_t status = (int32_t)rpc_head::read<RPC_HEAD_STATUS>(data);
+  uint64_t id = rpc_head::read<RPC_HEAD_ID>(data);
+  byte *body = data + RPC_HEAD_LEN;
+  uint32_t body_len = length - RPC_HEAD_LEN;
+
+  if (type == RdmaMessage::MSG_DONE) {
+    rpc_callback cb;
+    {
+      std::lock_guard<std::mutex> lock(call_mutex);
+      auto it = pending.find(id);
+      if (it == pending.end()) {
+        fprintf(stderr, "rpc response for unknown id %lu\n", id);
+        return;
+      }
+      cb = std::move(it->second);
+      pending.erase(it);
+    }
+    cb(status, body, body_len);
+    return;
+  }
+
+  if (type != RdmaMessage::MSG_CMD) {
+    fprintf(stderr, "unprocessed rpc frame type %d\n", type);
+    return;
+  }
+  in_flight.fetch_add(1);
+  if (pool == NULL) {
+    serve(opcode, id, body, body_len);
+    return;
+  }
+  /* the frame is reclaimed once we return, the worker needs a copy,
+  made in the same allocation as the task itself */
+  rpc_task *task = (rpc_task *)malloc(sizeof(rpc_task) + body_len);
+  task->endpoint = this;
+  task->opcode = opcode;
+  task->id = id;
+  task->length = body_len;
+  memcpy(task->data, body, body_len);
+  pool->dispatch(run_rpc_task, task);
+}
+
+void RpcEndpoint::run_rpc_task(void *arg) {
+  rpc_task *task = static_cast<rpc_task *>(arg);
+  task->endpoint->serve(task->opcode, task->id, task->data, task->length);
+  free(task);
+}
+
+void RpcEndpoint::serve(uint16_t opcode, uint64_t id, const byte *data,
+                        uint32_t length) {
+  std::vector<byte> reply;
+  int32_t status = RPC_NO_HANDLER;
+
+  auto it = handlers.find(opcode);
+  if (it != handlers.end()) {
+    status = it->second(data, length, reply);
+  }
+
+  /* batch responses while other requests are queued or running. Every
+  handler leaves in_flight under the send lock after posting, so the last
+  one out finds every earlier response in the batch and flushes it */
+  byte head[RPC_HEAD_LEN];
+  rpc_head::encode(head, rpc_head::values(RdmaMessage::MSG_DONE, opcode,
+                                          (uint32_t)status, id));
+  if (channel.post_if(head, RPC_HEAD_LEN, reply.data(), (uint32_t)reply.size(),
+                      [this]() {
+                        if (in_flight.fetch_sub(1) == 1 ||
+                            ++unflushed >= RPC_RESPONSE_BATCH) {
+                          unflushed = 0;
+                          return true;
+                        }
+                        return false;
+                      })) {
+    fprintf(stderr, "rpc response %lu for opcode %d lost\n", id, opcode);
+  }
+}
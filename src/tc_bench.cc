@@ -0,0 +1,391 @@
+#include <getopt.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "bench_util.h"
+#include "rpc.h"
+
+/* Benchmark suites over our own ConnectionProc API, so its numbers can
+be put next to ib_write_bw / ib_read_bw / ib_send_bw of perftest.
+
+  tcbench <env options> [-- <bench options>]
+
+  -s, --suite     write,read,send (default all three)
+  -b, --sizes     message sizes, "8,64,4096" or "2:1048576" (default)
+  -D, --depths    ops each thread keeps in flight (default 1,16)
+  -T, --threads   threads issuing ops on the connection (default 1)
+  -d, --duration  milliseconds per configuration (default 1000)
+  -f, --format    csv (default) or json, one line per configuration
+  -w, --output    file instead of stdout
+  -k, --skew-ns   largest cross-core clock skew for valid latencies
+                  (default 100)
+
+Every configuration reports bandwidth, message rate and the post to
+completion latency of each op, the depth 1 rows are the latency suite
+and the smallest sizes the message rate suite. write and read go to the
+server's first pinned block, send is an rpc whose handler only acks, so
+it measures the channel the rpc layer uses. The server takes the same
+env options and no bench options, it serves until the client leaves. */
+
+#define BENCH_RPC_SINK        1
+/* largest rpc payload that fits a channel frame with room to spare */
+#define BENCH_MAX_SEND        (RDMA_CHANNEL_MAX_FRAME - RPC_HEAD_LEN - 64)
+
+static struct option bench_options[] = {
+  { name : "suite",     has_arg : 1, flag : NULL, val : 's' },
+  { name : "sizes",     has_arg : 1, flag : NULL, val : 'b' },
+  { name : "depths",    has_arg : 1, flag : NULL, val : 'D' },
+  { name : "threads",   has_arg : 1, flag : NULL, val : 'T' },
+  { name : "duration",  has_arg : 1, flag : NULL, val : 'd' },
+  { name : "format",    has_arg : 1, flag : NULL, val : 'f' },
+  { name : "output",    has_arg : 1, flag : NULL, val : 'w' },
+  { name : "skew-ns",   has_arg : 1, flag : NULL, val : 'k' },
+  {0}
+};
+
+struct bench_params {
+  bool                  suite_write;
+  bool                  suite_read;
+  bool                  suite_send;
+  std::vector<uint32_t> sizes;
+  std::vector<int>      depths;
+  std::vector<int>      threads;
+  int                   duration_ms;
+  bench_format          format;
+  const char            *output;
+  int64_t               skew_ns;
+};
+
+/* what one thread did in one configuration */
+struct bench_worker {
+  LatencyHistogram      lat;
+  uint64_t              ops;
+  uint64_t              errors;
+  /* send suite, calls whose ack is outstanding */
+  std::atomic<int>      inflight;
+};
+
+static int16_t parse_bench_params(int argc, char *argv[], bench_params *bp) {
+  bp->suite_write = bp->suite_read = bp->suite_send = true;
+  parse_size_list("2:1048576", bp->sizes);
+  parse_int_list("1,16", bp->depths);
+  parse_int_list("1", bp->threads);
+  bp->duration_ms = 1000;
+  bp->format = BENCH_CSV;
+  bp->output = NULL;
+  bp->skew_ns = BENCH_SKEW_NS;
+
+  /* argv[0] is skipped by getopt, optind was left by parse_params */
+  optind = 0;
+  while (1) {
+    int ch = getopt_long(argc, argv, "s:b:D:T:d:f:w:k:", bench_options, NULL);
+    if (ch == -1) {
+      break;
+    }
+    switch (ch) {
+      case 's': {
+        bp->suite_write = strstr(optarg, "write") != NULL;
+        bp->suite_read = strstr(optarg, "read") != NULL;
+        bp->suite_send = strstr(optarg, "send") != NULL;
+        if (!bp->suite_write && !bp->suite_read && !bp->suite_send) {
+          fprintf(stderr, "No known suite in %s\n", optarg);
+          return FAILURE;
+        }
+      } break;
+      case 'b': {
+        if (!parse_size_list(optarg, bp->sizes)) {
+          fprintf(stderr, "Bad size list %s\n", optarg);
+          return FAILURE;
+        }
+      } break;
+      case 'D': {
+        if (!parse_int_list(optarg, bp->depths)) {
+          fprintf(stderr, "Bad depth list %s\n", optarg);
+          return FAILURE;
+        }
+      } break;
+      case 'T': {
+        if (!parse_int_list(optarg, bp->threads)) {
+          fprintf(stderr, "Bad thread list %s\n", optarg);
+          return FAILURE;
+        }
+      } break;
+      case 'd': {
+        bp->duration_ms = atoi(optarg);
+        if (bp->duration_ms <= 0) {
+          fprintf(stderr, "Duration must be positive\n");
+          return FAILURE;
+        }
+      } break;
+      case 'f': {
+        if (!parse_format(optarg, &bp->format)) {
+          fprintf(stderr, "Format is csv or json\n");
+          return FAILURE;
+        }
+      } break;
+      case 'w': { bp->output = optarg; } break;
+      case 'k': { bp->skew_ns = atoll(optarg); } break;
+    default:
+      return FAILURE;
+      break;
+    }
+  }
+  return SUCCESS;
+}
+
+/********** suites **********/
+/* keep depth reads or writes in flight until stop, then drain */
+static void one_sided_worker(ConnectionProc *conn, bool read, rdma_mem_info base,
+                             int depth, const std::atomic_bool *stop,
+                             bench_worker *w) {
+  std::vector<rdma_request> reqs(depth);
+  std::vector<uint64_t> start(depth);
+  std::vector<bool> busy(depth, false);
+  int inflight = 0;
+
+  while (true) {
+    bool stopping = stop->load(std::memory_order_relaxed);
+    if (stopping && !inflight) {
+      break;
+    }
+    for (int i = 0; i < depth; i++) {
+      if (busy[i]) {
+        if (reqs[i].pending.load(std::memory_order_acquire) > 0) {
+          continue;
+        }
+        w->lat.record(now_ns() - start[i]);
+        busy[i] = false;
+        inflight--;
+        if (reqs[i].failed.load()) {
+          reqs[i].failed.store(false);
+          w->errors++;
+        } else {
+          w->ops++;
+        }
+      }
+      if (!stopping) {
+        rdma_mem_info info = base;
+        info.req = &reqs[i];
+        start[i] = now_ns();
+        if (read ? conn->rdma_read(info) : conn->rdma_write(info)) {
+          w->errors++;
+          continue;
+        }
+        busy[i] = true;
+        inflight++;
+      }
+    }
+  }
+}
+
+/* keep depth rpcs in flight, the acks come back on the cq thread which
+is the only writer of w->lat until inflight drops to 0 */
+static void send_worker(RpcEndpoint *rpc, const byte *payload, uint32_t size,
+                        int depth, const std::atomic_bool *stop,
+                        bench_worker *w) {
+  uint64_t post_errors = 0;
+  while (!stop->load(std::memory_order_relaxed)) {
+    if (w->inflight.load(std::memory_order_acquire) >= depth) {
+      continue;
+    }
+    uint64_t start = now_ns();
+    w->inflight.fetch_add(1);
+    if (rpc->call_async(BENCH_RPC_SINK, payload, size,
+                        [w, start](int32_t status, const byte *data, uint32_t length) {
+                          w->lat.record(now_ns() - start);
+                          if (status == RPC_OK) {
+                            w->ops++;
+                          } else {
+                            w->errors++;
+                          }
+                          w->inflight.fetch_sub(1, std::memory_order_release);
+                        })) {
+      w->inflight.fetch_sub(1);
+      post_errors++;
+    }
+  }
+  while (w->inflight.load(std::memory_order_acquire) > 0) {}
+  w->errors += post_errors;
+}
+
+/* one configuration, workers run for duration_ms */
+static void run_config(const char *suite, int threads, int duration_ms,
+                       bench_result *r, LatencyHistogram *lat,
+                       std::function<void(const std::atomic_bool *, bench_worker *)> body) {
+  std::vector<bench_worker> workers(threads);
+  std::vector<std::thread> ts;
+  std::atomic_bool stop(false);
+
+  for (auto &w : workers) {
+    w.ops = w.errors = 0;
+    w.inflight.store(0);
+  }
+  uint64_t start = now_ns();
+  for (int t = 0; t < threads; t++) {
+    ts.emplace_back(body, &stop, &workers[t]);
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(duration_ms));
+  stop.store(true);
+  for (auto &t : ts) {
+    t.join();
+  }
+  r->seconds = (now_ns() - start) / 1e9;
+
+  r->suite = suite;
+  r->op = suite;
+  r->threads = threads;
+  r->conns = 1;
+  r->ops = r->errors = 0;
+  r->target_kops = 0;
+  lat->reset();
+  for (auto &w : workers) {
+    r->ops += w.ops;
+    r->errors += w.errors;
+    lat->merge(w.lat);
+  }
+  r->lat = lat;
+}
+
+static int run_client(ConnectionProc *conn, RpcEndpoint *rpc, bench_params &bp,
+                      BenchReport &report) {
+  rdma_mem_info base;
+  uint64_t local_voff;
+  LatencyHistogram lat;
+
+  if (conn->pin_memory((ibv_access_flags)IBV_ACCESS_LOCAL_WRITE,
+                       FIX_BLOCK_LENGTH, &local_voff)) {
+    fprintf(stderr, "Couldn't pin the local block\n");
+    return FAILURE;
+  }
+  memset(&base, 0, sizeof(base));
+  /* the server's target is the first block it pinned */
+  while (conn->lookup_remote_mr(0, base)) {
+    if (!conn->is_alive()) {
+      return FAILURE;
+    }
+  }
+  byte *local = (byte *)conn->get_mem_magr()->get_local_address(local_voff);
+  base.local_address = (uint64_t)local;
+  base.src_mr = conn->get_mem_magr()->get_pinned_mr(local_voff, FIX_BLOCK_LENGTH);
+
+  report.note("tcbench qps %d, outstanding reads %d, tx depth %d, %d ms per run",
+              conn->get_active_qps(), conn->get_out_reads(),
+              conn->get_tx_depth(), bp.duration_ms);
+
+  const char *names[3] = {"write", "read", "send"};
+  bool enabled[3] = {bp.suite_write, bp.suite_read, bp.suite_send};
+  for (int s = 0; s < 3; s++) {
+    if (!enabled[s]) {
+      continue;
+    }
+    for (uint32_t size : bp.sizes) {
+      if (size > (s == 2 ? BENCH_MAX_SEND : FIX_BLOCK_LENGTH)) {
+        report.note("%s skips %u bytes, larger than one %s", names[s], size,
+                    s == 2 ? "channel frame" : "block");
+        continue;
+      }
+      for (int depth : bp.depths) {
+        for (int threads : bp.threads) {
+          bench_result r;
+          r.size = size;
+          r.depth = depth;
+          if (s < 2) {
+            if (depth * threads > conn->get_tx_depth()) {
+              report.note("%s skips depth %d x %d threads, above tx depth %d",
+                          names[s], depth, threads, conn->get_tx_depth());
+              continue;
+            }
+            base.length = size;
+            bool read = s == 1;
+            run_config(names[s], threads, bp.duration_ms, &r, &lat,
+                       [&](const std::atomic_bool *stop, bench_worker *w) {
+                         one_sided_worker(conn, read, base, depth, stop, w);
+                       });
+          } else {
+            run_config(names[s], threads, bp.duration_ms, &r, &lat,
+                       [&](const std::atomic_bool *stop, bench_worker *w) {
+                         send_worker(rpc, local, size, depth, stop, w);
+                       });
+          }
+          report.row(r);
+          if (!conn->is_alive()) {
+            return FAILURE;
+          }
+        }
+      }
+    }
+  }
+  return SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+  EnvironmentProc    user_env;
+  bench_params       bp;
+  if (user_env.parse_params(argc, argv)) {
+    std::cerr << "Can't parse input parameters!" << std::endl;
+    return 1;
+  }
+  /* getopt stopped at "--", the rest is ours */
+  int bench_argc = argc - optind + 1;
+  char **bench_argv = argv + optind - 1;
+  if (parse_bench_params(bench_argc, bench_argv, &bp)) {
+    std::cerr << "Can't parse bench parameters!" << std::endl;
+    return 1;
+  }
+  if (user_env.check_env()) {
+    std::cerr << "Checking enviroment fail!" << std::endl;
+    return 1;
+  }
+
+  ConnectionProc *conn = bench_connect(&user_env);
+  if (!conn) {
+    return 1;
+  }
+
+  RpcEndpoint rpc(conn, NULL);
+  rpc.register_handler(BENCH_RPC_SINK,
+                       [](const byte *data, uint32_t length, std::vector<byte> &reply) {
+                         return (int32_t)RPC_OK;
+                       });
+
+  if (user_env.is_server()) {
+    /* pinned before the channel so it is voff 0 */
+    if (conn->pin_memory((ibv_access_flags)(IBV_ACCESS_LOCAL_WRITE |
+                                            IBV_ACCESS_REMOTE_READ |
+                                            IBV_ACCESS_REMOTE_WRITE)) ||
+        rpc.open()) {
+      fprintf(stderr, "Couldn't set up the target\n");
+      return 1;
+    }
+    while (conn->is_alive()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return 0;
+  }
+
+  if (rpc.open()) {
+    fprintf(stderr, "Couldn't open the rpc channel\n");
+    return 1;
+  }
+  while (!rpc.ready()) {
+    if (!conn->is_alive()) {
+      return 1;
+    }
+  }
+
+  FILE *out = NULL;
+  if (bp.output && !(out = fopen(bp.output, "w"))) {
+    fprintf(stderr, "Couldn't open %s\n", bp.output);
+    return 1;
+  }
+  BenchReport report(bp.format, out);
+  report.check_clock(bp.skew_ns);
+  int ret = run_client(conn, &rpc, bp, report);
+  if (out) {
+    fclose(out);
+  }
+  conn->stop();
+  return ret == SUCCESS ? 0 : 1;
+}
@@ -0,0 +1,381 @@
+#include <sched.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <unordered_set>
+
+#include "worker_pool.h"
+
+/********** deque **********/
+WorkDeque::WorkDeque(size_t capacity) : mask(capacity - 1), top(0), bottom(0) {
+  assert((capacity & (capacity - 1)) == 0);
+  buffer = new slot[capacity];
+}
+
+WorkDeque::~WorkDeque() {
+  delete [] buffer;
+}
+
+bool WorkDeque::push(const work_item &w) {
+  int64_t b = bottom.load(std::memory_order_relaxed);
+  int64_t t = top.load(std::memory_order_acquire);
+
+  if (b - t > mask) {
+    return false;
+  }
+  slot &s = buffer[b & mask];
+  s.fn.store(w.fn, std::memory_order_relaxed);
+  s.arg.store(w.arg, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  bottom.store(b + 1, std::memory_order_relaxed);
+  return true;
+}
+
+bool WorkDeque::pop(work_item *w) {
+  int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+  bottom.store(b, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int64_t t = top.load(std::memory_order_relaxed);
+
+  if (t > b) {
+    /* empty */
+    bottom.store(b + 1, std::memory_order_relaxed);
+    return false;
+  }
+
+  slot &s = buffer[b & mask];
+  w->fn = s.fn.load(std::memory_order_relaxed);
+  w->arg = s.arg.load(std::memory_order_relaxed);
+  if (t == b) {
+    /* the last one, race the thieves for it */
+    bool won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                           std::memory_order_relaxed);
+    bottom.store(b + 1, std::memory_order_relaxed);
+    return won;
+  }
+  return true;
+}
+
+bool WorkDeque::steal(work_item *w) {
+  int64_t t = top.load(std::memory_order_acquire);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int64_t b = bottom.load(std::memory_order_acquire);
+
+  if (t >= b) {
+    return false;
+  }
+  slot &s = buffer[t & mask];
+  w->fn = s.fn.load(std::memory_order_relaxed);
+  w->arg = s.arg.load(std::memory_order_relaxed);
+  return top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                     std::memory_order_relaxed);
+}
+
+size_t WorkDeque::size() {
+  int64_t b = bottom.load(std::memory_order_relaxed);
+  int64_t t = top.load(std::memory_order_relaxed);
+  return b > t ? (size_t)(b - t) : 0;
+}
+
+/********** numa **********/
+static bool read_node_cpus(int node, cpu_set_t *cpus) {
+  char path[128];
+  char list[4096];
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return false;
+  }
+  bool ok = fgets(list, sizeof(list), f) != NULL;
+  fclose(f);
+  if (!ok) {
+    return false;
+  }
+
+  /* "0-3,8-11" */
+  CPU_ZERO(cpus);
+  char *p = list;
+  while (*p && *p != '\n') {
+    int lo = (int)strtol(p, &p, 10);
+    int hi = lo;
+    if (*p == '-') {
+      hi = (int)strtol(p + 1, &p, 10);
+    }
+    for (int c = lo; c <= hi && c < CPU_SETSIZE; c++) {
+      CPU_SET(c, cpus);
+    }
+    if (*p == ',') {
+      p++;
+    }
+  }
+  return true;
+}
+
+int current_numa_node() {
+  int cpu = sched_getcpu();
+  cpu_set_t cpus;
+
+  for (int node = 0; cpu >= 0 && read_node_cpus(node, &cpus); node++) {
+    if (CPU_ISSET(cpu, &cpus)) {
+      return node;
+    }
+  }
+  return 0;
+}
+
+/********** pool **********/
+/* ids of the pools alive, a thread checks its pool is still there
+before it touches it */
+static std::mutex pools_mutex;
+static std::unordered_set<uint64_t> live_pools;
+static uint64_t next_pool_id = 0;
+/* bumped on every pool destruction, so a thread feeding another pool
+only looks at live_pools again when one may have gone */
+static std::atomic<uint64_t> pools_epoch(0);
+
+/* the deque this thread pushes to, a thread feeds one pool lock-free */
+struct work_tls {
+  WorkerPool  *pool;
+  uint64_t    id;
+  WorkDeque   *queue;
+  int32_t     slot;   /* source slot, -1 for a worker */
+  uint64_t    epoch;  /* pools_epoch when pool was last seen alive */
+
+  bool pool_alive() {
+    uint64_t e = pools_epoch.load(std::memory_order_acquire);
+    if (e == epoch) {
+      return true;
+    }
+    std::lock_guard<std::mutex> lock(pools_mutex);
+    epoch = e;
+    return live_pools.count(id) > 0;
+  }
+  void reset() {
+    pool = NULL;
+    queue = NULL;
+    slot = -1;
+  }
+  ~work_tls() {
+    /* hand the deque back, under the lock the pool can't go away */
+    std::lock_guard<std::mutex> lock(pools_mutex);
+    if (pool && slot >= 0 && live_pools.count(id)) {
+      pool->source_free[slot].store(true, std::memory_order_release);
+    }
+  }
+};
+static thread_local work_tls tls_queue = {NULL, 0, NULL, -1, 0};
+
+static void run_work_task(void *arg) {
+  work_task *task = static_cast<work_task *>(arg);
+  (*task)();
+  delete task;
+}
+
+WorkerPool::WorkerPool(uint32_t num, int numa_node)
+    : num_sources(0), numa_node(numa_node), sleeping(0), stopping(false) {
+  {
+    std::lock_guard<std::mutex> lock(pools_mutex);
+    id = next_pool_id++;
+    live_pools.insert(id);
+  }
+  for (uint32_t i = 0; i < MAX_WORK_SOURCES; i++) {
+    source_queues[i].store(NULL);
+    source_free[i].store(false);
+  }
+  for (uint32_t i = 0; i < num; i++) {
+    worker_queues.push_back(new WorkDeque(WORK_DEQUE_SIZE));
+  }
+  for (uint32_t i = 0; i < num; i++) {
+    workers.emplace_back(&WorkerPool::worker_loop, this, i);
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(pools_mutex);
+    live_pools.erase(id);
+    pools_epoch.fetch_add(1, std::memory_order_release);
+  }
+  stopping.store(true);
+  {
+    std::lock_guard<std::mutex> lock(task_mutex);
+    task_cond.notify_all();
+  }
+  for (auto &w : workers) {
+    w.join();
+  }
+  for (auto q : worker_queues) {
+    delete q;
+  }
+  for (uint32_t i = 0; i < num_sources.load(); i++) {
+    delete source_queues[i].load();
+  }
+}
+
+WorkDeque *WorkerPool::local_queue() {
+  if (tls_queue.pool == this && tls_queue.id == id) {
+    return tls_queue.queue;
+  }
+  if (tls_queue.pool != NULL) {
+    if (tls_queue.pool_alive()) {
+      /* already feeding another pool */
+      return NULL;
+    }
+    /* that pool is gone, its deque with it */
+    tls_queue.reset();
+  }
+
+  /* a deque whose thread exited first, the owner is gone so taking
+  over its bottom is safe */
+  uint32_t sources = num_sources.load();
+  for (uint32_t i = 0; i < sources; i++) {
+    bool free = true;
+    if (source_free[i].load(std::memory_order_relaxed) &&
+        source_free[i].compare_exchange_strong(free, false,
+                                               std::memory_order_acquire)) {
+      return adopt_source(i, source_queues[i].load(std::memory_order_acquire));
+    }
+  }
+
+  uint32_t idx = num_sources.load();
+  while (idx < MAX_WORK_SOURCES &&
+         !num_sources.compare_exchange_weak(idx, idx + 1)) {}
+  if (idx >= MAX_WORK_SOURCES) {
+    return NULL;
+  }
+  WorkDeque *q = new WorkDeque(WORK_DEQUE_SIZE);
+  source_queues[idx].store(q, std::memory_order_release);
+  return adopt_source(idx, q);
+}
+
+WorkDeque *WorkerPool::adopt_source(uint32_t slot, WorkDeque *q) {
+  tls_queue.pool = this;
+  tls_queue.id = id;
+  tls_queue.queue = q;
+  tls_queue.slot = (int32_t)slot;
+  tls_queue.epoch = pools_epoch.load(std::memory_order_acquire);
+  return q;
+}
+
+void WorkerPool::wake_one() {
+  /* pairs with the fence in worker_loop, either the worker sees the
+  task or we see it sleeping */
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleeping.load(std::memory_order_relaxed) > 0) {
+    std::lock_guard<std::mutex> lock(task_mutex);
+    task_cond.notify_one();
+  }
+}
+
+void WorkerPool::dispatch(work_fn fn, void *arg) {
+  work_item w = {fn, arg};
+  WorkDeque *q = local_queue();
+
+  if (q == NULL || !q->push(w)) {
+    std::lock_guard<std::mutex> lock(task_mutex);
+    tasks.push_back(w);
+  }
+  wake_one();
+}
+
+void WorkerPool::dispatch(work_task task) {
+  dispatch(run_work_task, new work_task(std::move(task)));
+}
+
+size_t WorkerPool::pending() {
+  size_t num = 0;
+
+  for (auto q : worker_queues) {
+    num += q->size();
+  }
+  for (uint32_t i = 0; i < num_sources.load(); i++) {
+    WorkDeque *q = source_queues[i].load(std::memory_order_acquire);
+    num += q ? q->size() : 0;
+  }
+  std::lock_guard<std::mutex> lock(task_mutex);
+  return num + tasks.size();
+}
+
+bool WorkerPool::find_work(uint32_t idx, work_item *w) {
+  uint32_t num = (uint32_t)worker_queues.size();
+
+  if (worker_queues[idx]->pop(w)) {
+    return true;
+  }
+  /* sources first, they are what keeps the pollers going */
+  uint32_t sources = num_sources.load();
+  for (uint32_t i = 0; i < sources; i++) {
+    WorkDeque *q = source_queues[(idx + i) % sources].load(std::memory_order_acquire);
+    if (q && q->steal(w)) {
+      return true;
+    }
+  }
+  for (uint32_t i = 1; i < num; i++) {
+    if (worker_queues[(idx + i) % num]->steal(w)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* task_mutex must be held */
+bool WorkerPool::pop_overflow(work_item *w) {
+  if (tasks.empty()) {
+    return false;
+  }
+  *w = tasks.front();
+  tasks.pop_front();
+  return true;
+}
+
+void WorkerPool::worker_loop(uint32_t idx) {
+  tls_queue.pool = this;
+  tls_queue.id = id;
+  tls_queue.queue = worker_queues[idx];
+  tls_queue.slot = -1;
+
+  cpu_set_t cpus;
+  if (numa_node >= 0 && read_node_cpus(numa_node, &cpus)) {
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  }
+
+  work_item w;
+  uint32_t idle = 0;
+  while (1) {
+    bool found = find_work(idx, &w);
+    if (!found && (idle % 64 == 0 || stopping.load())) {
+      std::lock_guard<std::mutex> lock(task_mutex);
+      found = pop_overflow(&w);
+    }
+    if (found) {
+      w.fn(w.arg);
+      idle = 0;
+      continue;
+    }
+    if (stopping.load()) {
+      return;
+    }
+    if (++idle < WORK_SPIN_ROUNDS) {
+      continue;
+    }
+
+    /* park, the mutex is held from announcing ourselves until the wait
+    so a dispatcher that saw us sleeping can not notify too early */
+    std::unique_lock<std::mutex> lock(task_mutex);
+    sleeping.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    found = find_work(idx, &w) || pop_overflow(&w);
+    if (!found && !stopping.load()) {
+      task_cond.wait(lock);
+    }
+    sleeping.fetch_sub(1);
+    lock.unlock();
+
+    if (found) {
+      w.fn(w.arg);
+    }
+    idle = 0;
+  }
+}